@@ -0,0 +1,27 @@
+#ifndef ADAPTOR_DETECT_HEADER
+#define ADAPTOR_DETECT_HEADER
+
+/*
+ * Find the adaptor from the first reads of a FASTQ/FASTA file. K-mers in the 3'
+ * half of reads are counted, the most frequent one which is not low complexity is
+ * taken as the seed, and extended to both sides by the consensus of the reads
+ * carrying it. The left end stops at the insert, the right end at the end of
+ * the adaptor. The consensus is compared with the adaptors of common kits.
+ */
+struct adaptor_guess {
+    char *consensus;  // assembled from the reads, NULL if not found
+    const char *name; // name of the matched kit, NULL if unknown
+    const char *seq;  // adaptor to use, the consensus observed in the reads
+    long sampled;     // reads sampled
+    long hits;        // reads carrying the seed k-mer
+};
+
+// sample n_reads from fn. return 0 if found, 1 if no adaptor dominant, -1 on error
+extern int adaptor_detect(const char *fn, long n_reads, int n_threads, struct adaptor_guess *g);
+
+// print the result in one line
+extern void adaptor_guess_print(FILE *fp, const struct adaptor_guess *g);
+
+extern void adaptor_guess_destroy(struct adaptor_guess *g);
+
+#endif
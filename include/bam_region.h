@@ -0,0 +1,52 @@
+#ifndef BAM_REGION_HEADER
+#define BAM_REGION_HEADER
+
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
+#include "htslib/kstring.h"
+
+/*
+ * Parallel processing of an indexed BAM/CRAM. The genome is split into shards of
+ * contigs or chunks of them by the index, and the shards are processed by kt_for.
+ * Every thread has its own samFile and iterator. Records overlapping two shards
+ * belong to the shard of their start. The outputs of the shards are written in
+ * order, or each shard is written into its own BAM for merging later. Outputs of
+ * a shard waiting for the shards before it are spilled to a temporary file if too
+ * large, so the memory does not grow with the depth.
+ */
+
+// bases of a shard
+#define BAM_SHARD_SIZE 10000000
+
+// tid is -1 for the unmapped reads at the end of file, beg and end are 0 based [beg, end)
+struct bam_shard {
+    int tid;
+    int beg;
+    int end;
+};
+
+/*
+ * Called for every record of a shard, in order. Text output is appended to str.
+ * Return 1 to keep the record for the BAM output, 0 to skip, -1 to stop on error.
+ * It runs on several threads at once, data should only be read.
+ */
+typedef int (*bam_shard_func)(void *data, bam1_t *b, const bam_hdr_t *h, kstring_t *str);
+
+struct bam_shard_opts {
+    int n_threads;
+    bam_shard_func func;
+    void *data;
+    BGZF *text;          // text of the shards in order, NULL for none
+    samFile *out;        // kept records of the shards in order, NULL for none
+    bam_hdr_t *out_hdr;  // header of out
+    const char *prefix;  // kept records into prefix.NNNNN.bam for each shard, NULL for none
+    const char *mode;    // mode to open the shard files, "wb" if NULL
+};
+
+// split fn by the index. contigs without reads in the index stats are skipped. return NULL if not indexed
+extern struct bam_shard *bam_shards_build(const char *fn, int shard_size, int *n);
+
+// return 0 on success, -1 on error
+extern int bam_shards_run(const char *fn, const struct bam_shard *shards, int n, struct bam_shard_opts *opts);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef BUCKET_WRITER_HEADER
+#define BUCKET_WRITER_HEADER
+
+#include "htslib/kstring.h"
+
+/*
+ * Write many BGZF files with bounded memory and file handlers. Records are
+ * appended to in-memory buckets, full blocks are compressed the same way as
+ * bgzf_write() does, so the output is identical to writing each file with BGZF.
+ * Compressed blocks are spilled to disk once the memory limit is reached, and
+ * at most max_open files are kept open, the least recently used is closed first.
+ * The partial block of every bucket stays in memory until bucket_writer_close,
+ * so mem_limit should be at least BGZF_BLOCK_SIZE for each bucket.
+ */
+struct bucket_writer;
+
+// mem_limit in bytes, n_threads is used to compress the blocks
+extern struct bucket_writer *bucket_writer_init(size_t mem_limit, int max_open, int n_threads);
+
+// add an output file, return the bucket id
+extern int bucket_writer_add(struct bucket_writer *w, const char *fn);
+
+// the buffer of a bucket, append the uncompressed data to it directly
+extern kstring_t *bucket_writer_buffer(struct bucket_writer *w, int id);
+
+// compress the full blocks and spill buckets to disk if out of memory. return 0 on success, -1 on error.
+extern int bucket_writer_flush(struct bucket_writer *w);
+
+// write all the data and EOF markers, and free the writer. return 0 on success, -1 on error.
+extern int bucket_writer_close(struct bucket_writer *w);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "utils.h"
 #include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
+#include "htslib/kstring.h"
 
 struct name {
     char *barcode;
@@ -11,20 +13,144 @@ struct name {
     BGZF *fp2;
 };
 
+struct barcode_index;
+
 struct barcode {
     int n, m;
     struct name *names;
+    int l_index1; // length of the first index for dual index barcodes, else 0
+    struct barcode_index *index;
 };
 
-
+// return the number of mismatches in the first l bases, stop counting once larger than max.
+// count_mismatch2 treats N in s2 as a wildcard, the same as check_match2.
+extern int count_mismatch(const char *s1, const char *s2, int l, int max);
+extern int count_mismatch2(const char *s1, const char *s2, int l, int max);
 
 extern int check_match(char *s1, const char *s2, int m, int l);
 extern int check_match2(char *s1, const char *s2, int m, int l);
 
+// Each line is the name and barcode seperated by tab. For dual indexes the third column
+// is the second index, and barcode is the concatenation of both.
 extern int load_barcode_file(const char*fn, struct barcode*b);
 
 extern int clean_barcode_struct(struct barcode *bc);
 
+// return the common length of all barcodes, or -1 if the lengths differ.
+extern int barcode_length(struct barcode *bc);
+
+// Build a hash of all sequences within mismatch edits of every barcode. Sequences
+// close to two samples are reported and assigned to the first one in the file, so
+// lookups give the same result as scanning the barcodes in order. Set wildcard to
+// treat N in barcodes as matching any base (check_match2), else check_match is used.
+// return 0 on success, 1 if only the linear scan is available.
+extern int barcode_index_build(struct barcode *bc, int length, int mismatch, int wildcard);
+
+// The same as barcode_index_build, for dual indexes. Barcodes and looked up sequences are
+// the first index of length followed by the second index of length2, mismatches are
+// counted for each index.
+extern int barcode_index_build2(struct barcode *bc, int length, int mismatch, int length2, int mismatch2, int wildcard);
+
+// return the index of the matched barcode, or -1 for no match.
+extern int barcode_lookup(struct barcode *bc, const char *seq);
+
+struct adaptor_matcher;
+
+extern struct adaptor_matcher *adaptor_matcher_init(const char *adaptor, int mismatch);
+extern void adaptor_matcher_destroy(struct adaptor_matcher *am);
+
+// Return the first offset in [0, end) where the adaptor matches seq with at most
+// the given mismatches (N in adaptor matches any base), or end if not found. In
+// partial mode a prefix of the adaptor at the 3' end of seq is also a hit, and
+// prefixes shorter than 8 bases must match exactly.
+extern int adaptor_search(const struct adaptor_matcher *am, const char *seq, int l, int end, int partial);
+
+/*
+ * FASTQ/FASTA reader. Input is read in large blocks, bgzipped files can be
+ * decompressed by a thread pool. Records are views into the block buffer, the
+ * name, comment, sequence and quality are NUL terminated in place, multi-line
+ * sequences are joined. qual is NULL for FASTA records.
+ */
+struct fastq_record {
+    char *name;    // up to the first white space, like kseq
+    char *comment; // rest of the title line, empty if none
+    char *seq;
+    char *qual;
+    int l_name;
+    int l_comment;
+    int l_seq;
+};
+
+// a batch of records, views stay valid until the chunk is refilled or destroyed
+struct fastq_chunk {
+    int n, m;
+    struct fastq_record *r;
+    char *buf;
+    int l_buf, m_buf;
+};
+
+struct fastq_reader;
+
+// fn could be "-" for stdin, pool may be NULL.
+extern struct fastq_reader *fastq_reader_open(const char *fn, hts_tpool *pool);
+extern void fastq_reader_close(struct fastq_reader *r);
+
+extern struct fastq_chunk *fastq_chunk_init();
+extern void fastq_chunk_destroy(struct fastq_chunk *c);
+
+// Read records until about size bases are loaded. return the number of records,
+// 0 at the end of file, -1 on error.
+extern int fastq_read_chunk(struct fastq_reader *r, struct fastq_chunk *c, int size);
+
+// Read the same number of records from both ends, read names are checked.
+extern int fastq_read_chunk2(struct fastq_reader *r1, struct fastq_reader *r2, struct fastq_chunk *c1, struct fastq_chunk *c2, int size);
+
+// Read one record, the view is valid until the next call. return NULL at the end of file,
+// exit on error.
+extern struct fastq_record *fastq_read(struct fastq_reader *r);
+
+// Read one record from both ends. return 1 on success, 0 at the end of files, exit on error.
+extern int fastq_read2(struct fastq_reader *r1, struct fastq_reader *r2, struct fastq_record **a, struct fastq_record **b);
+
+// Write a record from its views, the comment is skipped. prefix (C string) and tag
+// are appended to the read name if not NULL. return 0 on success, -1 on error.
+extern int fastq_write(BGZF *fp, const struct fastq_record *r, const char *prefix, const char *tag, int l_tag);
+
+// The same as fastq_write, but append the record to a string.
+extern int fastq_format(kstring_t *s, const struct fastq_record *r, const char *prefix, const char *tag, int l_tag);
+
+// Quality binning of the output. Tables map phred scores to the binned scores,
+// scores larger than the table are taken as the last entry.
+#define QUAL_BINS_SIZE 96
+
+// Fill the table by the scheme, illumina8 (8 levels), bin4 (4 levels) or custom bins
+// like 0-9:6,10-29:20,30-93:37, scores not listed are kept. return 0 on success, -1
+// if not recognised.
+extern int fastq_qual_bins_parse(const char *scheme, uint8_t *table);
+
+// Bin the qualities written by fastq_write, fastq_format and ubam_write by the table,
+// NULL to copy qualities as they are.
+extern void fastq_set_qual_bins(const uint8_t *table);
+
+// copy l qualities with the bins set by fastq_set_qual_bins
+extern void fastq_qual_copy(char *dst, const char *src, int l);
+
+// Uncompressed output to stdout, for piping interleaved reads to aligners. Records are
+// collected by fastq_format and written by fastq_flush in large blocks.
+extern BGZF *fastq_stdout_open();
+
+// Write the records collected in s if longer than FASTQ_FLUSH_SIZE, or force is set.
+// s is cleared after writing. return 0 on success, -1 on error.
+#define FASTQ_FLUSH_SIZE (4<<20)
+extern int fastq_flush(BGZF *fp, kstring_t *s, int force);
+
+// remove the read number, /1 or /2 given by c, from the read name of a view
+extern void fastq_strip_read_number(struct fastq_record *r, char c);
+
+// cut the view before the adaptor start i returned by adaptor_search, the rule shared by
+// the tools. return 1 if nothing is left before the adaptor, the read should be dropped.
+extern int fastq_trim_adaptor(struct fastq_record *r, int i);
+
 // return -1 for unknown or error, 0 for fastq, 1 for fasta.
 extern int check_file_is_fastq(const char *fn);
 
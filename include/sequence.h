@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #if defined(_MSC_VER) && !defined(__clang__)
 # define inline __inline
@@ -28,6 +29,18 @@ extern int seq2code4(int seq);
 
 extern char *rev_seqs(const char *dna_seqs, unsigned long n);
 
+// whole buffer kernels, SIMD if the CPU supports. bases other than ACGTU are taken as N
+// reverse complement, dst could be the same as src
+extern void seq_revcomp(char *dst, const char *src, int l);
+// reverse complement of 4 bits codes in place
+extern void seq_revcomp_nt16(uint8_t *seq, int l);
+// ACGTN to 0-4, the same as seq2code4()
+extern void seq_encode_nt4(uint8_t *dst, const char *src, int l);
+// IUPAC to 4 bits codes, the same as seq_nt16_table of htslib
+extern void seq_encode_nt16(uint8_t *dst, const char *src, int l);
+extern void seq_decode_nt4(char *dst, const uint8_t *src, int l);
+extern void seq_decode_nt16(char *dst, const uint8_t *src, int l);
+
 #define C4_Stop 0
 #define C4_Phe  1
 #define C4_Leu  2
@@ -150,17 +163,22 @@ static inline int check_is_stop(char *codon)
 
 static inline void compl_seq(char *seq, int l)
 {
-    int i;
-    for ( i = 0; i < l/2; i++ ) {
-        char c = revseqarr[seq2code4(seq[i])];
-        seq[i] = revseqarr[seq2code4(seq[l-i-1])];
-        seq[l-i-1] = c;
-    }
-    if ( l & 1 ) {
-        seq[l/2] = revseqarr[seq2code4(seq[l/2])];
-    }
+    seq_revcomp(seq, seq, l);
 }
 extern int check_stop_codon(char *seq, char *p_end);
+
+// codons with bases other than ACGTU
+#define C4_Unknown 21
+
+// batch translation, the sequence is encoded once and codons are translated 16 at a time
+// by SIMD if the CPU supports. amino acids are the C4_* ids, the same as codon2aminoid().
+// frames 0-2 start at base 0-2 of seq, frames 3-5 at base 0-2 of the reverse complement.
+// aa[f] should hold (l-f%3)/3 ids, the number of codons of each frame is returned in n.
+extern void seq_translate6(const char *seq, int l, uint8_t *aa[6], int n[6]);
+// frame 0 only, return the number of codons
+extern int seq_translate(uint8_t *aa, const char *seq, int l);
+// 0 based index of the first stop codon in frame 0, -1 if no found
+extern int seq_find_stop(const char *seq, int l);
 extern enum var_type check_var_type(char *block, int block_length, int start, char *ref, int ref_length, char *alt, int alt_length );
 
 
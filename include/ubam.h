@@ -0,0 +1,24 @@
+#ifndef UBAM_HEADER
+#define UBAM_HEADER
+
+#include "htslib/sam.h"
+#include "htslib/thread_pool.h"
+#include "fastq.h"
+
+/*
+ * Unaligned BAM output for FASTQ records, the input format of most aligners.
+ * Reads are written as unmapped records, UMI and sample barcode are kept in
+ * RX and BC tags instead of the read names.
+ */
+struct ubam;
+
+// write a header without references. the file is compressed by the pool if not NULL.
+extern struct ubam *ubam_open(const char *fn, hts_tpool *pool);
+
+// read is 0 for single end, 1 or 2 for the ends of paired reads. rx and bc are
+// skipped if NULL or empty. return 0 on success, -1 on error.
+extern int ubam_write(struct ubam *u, const struct fastq_record *r, int read, const char *rx, int l_rx, const char *bc, int l_bc);
+
+extern int ubam_close(struct ubam *u);
+
+#endif
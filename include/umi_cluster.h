@@ -0,0 +1,28 @@
+#ifndef UMI_CLUSTER_HEADER
+#define UMI_CLUSTER_HEADER
+
+/*
+ * Directional adjacency clustering of the UMIs at one position, as UMI-tools does.
+ * UMI a absorbs b if they differ by one base and count(a) >= 2*count(b) - 1, and
+ * the clusters grow from the most abundant UMIs. So a sequencing error of a UMI
+ * is merged into its family, while two real UMIs one base apart are kept.
+ *
+ * UMIs of ACGT and at most UMI_MAX_PACKED bases are packed to 2 bits per base. For
+ * each base, the packed UMIs are sorted with this base masked, then the UMIs with
+ * one mismatch at this base are next to each other. The neighbours are found in
+ * O(n*l*log(n)) instead of comparing all pairs. Other UMIs are clusters by themselves.
+ */
+
+#define UMI_MAX_PACKED 32
+
+// buffers reused by the positions
+struct umi_cluster;
+
+extern struct umi_cluster *umi_cluster_init();
+extern void umi_cluster_destroy(struct umi_cluster *uc);
+
+// umis are distinct, counts are their reads. cluster[i] is set to the index of the
+// most abundant UMI of its cluster, return the number of clusters
+extern int umi_cluster_directional(struct umi_cluster *uc, int n, char *const *umis, const int *counts, int *cluster);
+
+#endif
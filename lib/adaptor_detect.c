@@ -0,0 +1,294 @@
+#include "utils.h"
+#include <string.h>
+#include <stdint.h>
+#include "htslib/thread_pool.h"
+#include "fastq.h"
+#include "sequence.h"
+#include "kthread.h"
+#include "adaptor_detect.h"
+
+// k-mers are counted in a table indexed by the 2 bits codes, 4 MB for 10-mers
+#define KMER_SIZE 10
+#define KMER_MASK ((1U<<(2*KMER_SIZE))-1)
+// the seed should be this many times more frequent than an average k-mer
+#define SEED_FOLD 20
+#define SEED_MIN 20
+#define CONSENSUS_MAX 64
+#define CONSENSUS_DEPTH 10
+#define CONSENSUS_FRAC 0.6
+#define HOMOPOLYMER_TAIL 6
+
+static const struct {
+    const char *name;
+    const char *seq;
+} known_adaptors[] = {
+    { "Illumina TruSeq", "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC" },
+    { "Illumina TruSeq read 2", "AGATCGGAAGAGCGTCGTGTAGGGAAAGAGTGT" },
+    { "Illumina Nextera", "CTGTCTCTTATACACATCT" },
+    { "Illumina small RNA", "TGGAATTCTCGGGTGCCAAGG" },
+    { "MGI/BGISEQ", "AAGTCGGAGGCCAAGCGGTCTTAGGAAGACAA" },
+    { "MGI/BGISEQ read 2", "AAGTCGGATCGTAGCCATGTCGTTCTGTGAGCCAAGGAGTTG" },
+};
+
+// sampled reads in 2 bits codes, N is 4
+struct sample_chunk {
+    int n;
+    int *offset; // read i is in [offset[i], offset[i+1])
+    uint8_t *seq;
+    int *hit;    // position of the seed, -1 if not found
+};
+
+struct detect_data {
+    struct fastq_chunk *fq;
+    struct sample_chunk *sc;
+    uint32_t *counts;
+    uint32_t seed;
+};
+
+static void count_kmers(void *_d, long i, int tid)
+{
+    struct detect_data *d = (struct detect_data*)_d;
+    struct fastq_record *r = &d->fq->r[i];
+    uint8_t *s = d->sc->seq + d->sc->offset[i];
+    uint32_t x = 0;
+    int j, l = 0;
+    seq_encode_nt4(s, r->seq, r->l_seq);
+    for ( j = 0; j < r->l_seq; ++j ) {
+        if ( s[j] > 3 ) {
+            l = 0;
+            continue;
+        }
+        x = (x << 2 | s[j]) & KMER_MASK;
+        // only the 3' half, adaptors are at the end of reads
+        if ( ++l >= KMER_SIZE && j - KMER_SIZE + 1 >= r->l_seq/2 )
+            __sync_fetch_and_add(&d->counts[x], 1);
+    }
+}
+
+static void find_seed(void *_d, long i, int tid)
+{
+    struct detect_data *d = (struct detect_data*)_d;
+    struct sample_chunk *sc = d->sc;
+    uint8_t *s = sc->seq + sc->offset[i];
+    int l_seq = sc->offset[i+1] - sc->offset[i];
+    uint32_t x = 0;
+    int j, l = 0;
+    sc->hit[i] = -1;
+    for ( j = 0; j < l_seq; ++j ) {
+        if ( s[j] > 3 ) {
+            l = 0;
+            continue;
+        }
+        x = (x << 2 | s[j]) & KMER_MASK;
+        if ( ++l >= KMER_SIZE && x == d->seed ) {
+            sc->hit[i] = j - KMER_SIZE + 1;
+            return;
+        }
+    }
+}
+
+// at least 3 kinds of bases, and none of them takes more than 6 positions
+static int low_complexity(uint32_t x)
+{
+    int c[4] = { 0, 0, 0, 0 };
+    int i, kinds = 0;
+    for ( i = 0; i < KMER_SIZE; ++i, x >>= 2 )
+        c[x & 3]++;
+    for ( i = 0; i < 4; ++i ) {
+        if ( c[i] > 6 )
+            return 1;
+        kinds += c[i] > 0;
+    }
+    return kinds < 3;
+}
+
+// the consensus base at offset from the seed, -1 if not enough reads or no consensus
+static int consensus_base(struct sample_chunk *sc, int n, int offset)
+{
+    int c[5] = { 0, 0, 0, 0, 0 };
+    int i, j, depth = 0, best = 0;
+    for ( i = 0; i < n; ++i ) {
+        for ( j = 0; j < sc[i].n; ++j ) {
+            if ( sc[i].hit[j] == -1 )
+                continue;
+            int p = sc[i].offset[j] + sc[i].hit[j] + offset;
+            if ( p < sc[i].offset[j] || p >= sc[i].offset[j+1] )
+                continue;
+            c[sc[i].seq[p]]++;
+            depth++;
+        }
+    }
+    for ( i = 1; i < 4; ++i )
+        if ( c[i] > c[best] )
+            best = i;
+    if ( depth < CONSENSUS_DEPTH || c[best] < CONSENSUS_FRAC * depth )
+        return -1;
+    return best;
+}
+
+// name the kit the consensus comes from. the consensus is always used as the adaptor, the rest of
+// the kit may be replaced by a barcode or index in the reads, so only the name is kept for the report
+static void match_known_adaptor(struct adaptor_guess *g)
+{
+    int i, best_score = 0;
+    int l = strlen(g->consensus);
+    g->name = NULL;
+    g->seq = g->consensus;
+    for ( i = 0; i < sizeof(known_adaptors)/sizeof(known_adaptors[0]); ++i ) {
+        int m = strlen(known_adaptors[i].seq);
+        if ( m > l )
+            m = l;
+        if ( m < KMER_SIZE )
+            continue;
+        int mis = count_mismatch(g->consensus, known_adaptors[i].seq, m, m/10);
+        if ( mis > m/10 )
+            continue;
+        if ( m - mis > best_score ) {
+            best_score = m - mis;
+            g->name = known_adaptors[i].name;
+        }
+    }
+}
+
+int adaptor_detect(const char *fn, long n_reads, int n_threads, struct adaptor_guess *g)
+{
+    hts_tpool *pool = NULL;
+    int i, j, ret = 1;
+    memset(g, 0, sizeof(*g));
+    if ( n_threads < 1 )
+        n_threads = 1;
+    if ( n_threads > 1 )
+        pool = hts_tpool_init(n_threads);
+
+    struct fastq_reader *r = fastq_reader_open(fn, pool);
+    if ( r == NULL ) {
+        if ( pool )
+            hts_tpool_destroy(pool);
+        return -1;
+    }
+
+    struct detect_data d;
+    int n = 0, m = 0;
+    struct sample_chunk *sc = NULL;
+    uint64_t total = 0;
+    d.counts = (uint32_t*)calloc(KMER_MASK+1, sizeof(uint32_t));
+    d.fq = fastq_chunk_init();
+    while ( g->sampled < n_reads ) {
+        int n_fq = fastq_read_chunk(r, d.fq, 10000000);
+        if ( n_fq <= 0 )
+            break;
+        if ( g->sampled + n_fq > n_reads )
+            d.fq->n = n_fq = n_reads - g->sampled;
+        if ( n == m ) {
+            m = m == 0 ? 16 : m << 1;
+            sc = (struct sample_chunk*)realloc(sc, m*sizeof(struct sample_chunk));
+        }
+        d.sc = &sc[n++];
+        d.sc->n = n_fq;
+        d.sc->offset = (int*)malloc((n_fq+1)*sizeof(int));
+        d.sc->offset[0] = 0;
+        for ( i = 0; i < n_fq; ++i ) {
+            int l = d.fq->r[i].l_seq;
+            d.sc->offset[i+1] = d.sc->offset[i] + l;
+            total += l > KMER_SIZE ? (l - l/2 - KMER_SIZE + 1) : 0;
+        }
+        d.sc->seq = (uint8_t*)malloc(d.sc->offset[n_fq] + 1);
+        d.sc->hit = (int*)malloc(n_fq*sizeof(int));
+        kt_for(n_threads, count_kmers, &d, n_fq);
+        g->sampled += n_fq;
+    }
+    fastq_chunk_destroy(d.fq);
+    fastq_reader_close(r);
+
+    // the most frequent k-mer, which is not low complexity
+    uint32_t x, best = 0;
+    for ( x = 0; x <= KMER_MASK; ++x )
+        if ( d.counts[x] > d.counts[best] && !low_complexity(x) )
+            best = x;
+    double mean = (double)total/(KMER_MASK+1);
+    if ( d.counts[best] >= SEED_MIN && d.counts[best] >= SEED_FOLD*mean ) {
+        d.seed = best;
+        for ( i = 0; i < n; ++i ) {
+            d.sc = &sc[i];
+            kt_for(n_threads, find_seed, &d, sc[i].n);
+            for ( j = 0; j < sc[i].n; ++j )
+                g->hits += sc[i].hit[j] != -1;
+        }
+
+        // extend the seed to the 5' end until the insert, then to the 3' end
+        char cons[CONSENSUS_MAX*2+KMER_SIZE+1];
+        int left = CONSENSUS_MAX, right = CONSENSUS_MAX + KMER_SIZE;
+        for ( i = 0; i < KMER_SIZE; ++i )
+            cons[left+i] = "ACGT"[best >> 2*(KMER_SIZE-1-i) & 3];
+        while ( right - left < CONSENSUS_MAX ) {
+            int c = consensus_base(sc, n, left - 1 - CONSENSUS_MAX);
+            if ( c == -1 )
+                break;
+            cons[--left] = "ACGT"[c];
+        }
+        while ( right - left < CONSENSUS_MAX ) {
+            int c = consensus_base(sc, n, right - CONSENSUS_MAX);
+            if ( c == -1 )
+                break;
+            cons[right++] = "ACGT"[c];
+        }
+        // reads end with poly A or poly G after the adaptor on some platforms
+        for ( i = right - 1; i > left && cons[i] == cons[right-1]; --i );
+        if ( right - 1 - i >= HOMOPOLYMER_TAIL && i + 1 - left >= KMER_SIZE )
+            right = i + 1;
+        cons[right] = '\0';
+        g->consensus = strdup(cons + left);
+        match_known_adaptor(g);
+        ret = 0;
+    }
+
+    for ( i = 0; i < n; ++i ) {
+        free(sc[i].offset);
+        free(sc[i].seq);
+        free(sc[i].hit);
+    }
+    free(sc);
+    free(d.counts);
+    if ( pool )
+        hts_tpool_destroy(pool);
+    return ret;
+}
+
+void adaptor_guess_print(FILE *fp, const struct adaptor_guess *g)
+{
+    if ( g->consensus == NULL ) {
+        fprintf(fp, "No dominant adaptor found in %ld reads.\n", g->sampled);
+        return;
+    }
+    fprintf(fp, "%ld of %ld reads (%.2f%%) carry adaptor %s, %s%s, use %s\n", g->hits, g->sampled,
+            g->sampled ? 100.0*g->hits/g->sampled : 0, g->consensus, g->name ? "matched " : "unknown kit",
+            g->name ? g->name : "", g->seq);
+}
+
+void adaptor_guess_destroy(struct adaptor_guess *g)
+{
+    free(g->consensus);
+    g->consensus = NULL;
+    g->seq = NULL;
+}
+
+#ifdef ADAPTOR_DETECT_MAIN
+// Report the dominant adaptor of reads.
+// Usage: adaptor_detect reads.fq.gz [reads] [threads]
+int main(int argc, char **argv)
+{
+    if ( argc == 1 ) {
+        fprintf(stderr, "Usage: adaptor_detect reads.fq.gz [reads, 1000000] [threads, 1]\n");
+        return 1;
+    }
+    long n_reads = argc > 2 ? atol(argv[2]) : 1000000;
+    int n_threads = argc > 3 ? atoi(argv[3]) : 1;
+    struct adaptor_guess g;
+    int ret = adaptor_detect(argv[1], n_reads, n_threads, &g);
+    if ( ret == -1 )
+        error("%s : %s.", argv[1], strerror(errno));
+    adaptor_guess_print(stdout, &g);
+    adaptor_guess_destroy(&g);
+    return ret;
+}
+#endif
@@ -0,0 +1,369 @@
+#include "utils.h"
+#include <string.h>
+#include <pthread.h>
+#include "htslib/sam.h"
+#include "htslib/hts.h"
+#include "kthread.h"
+#include "bam_region.h"
+
+// shards processed by each thread at a time
+#define SHARDS_PER_THREAD 4
+// outputs of a shard kept in memory. beyond it they are written if the shard is the next in
+// order, or else spilled to a temporary file
+#define SHARD_BUFFER_SIZE (8<<20)
+
+struct bam_shard *bam_shards_build(const char *fn, int shard_size, int *n)
+{
+    struct bam_shard *a = NULL;
+    int i, m = 0;
+    *n = 0;
+    samFile *fp = sam_open(fn, "r");
+    if ( fp == NULL )
+        return NULL;
+    bam_hdr_t *h = sam_hdr_read(fp);
+    hts_idx_t *idx = h ? sam_index_load(fp, fn) : NULL;
+    if ( idx == NULL ) {
+        if ( h )
+            bam_hdr_destroy(h);
+        sam_close(fp);
+        return NULL;
+    }
+    // CRAI has no read counts, and BAI or CSI may have no pseudo-bins for them, the contigs
+    // are only skipped if the index says no read
+    int is_cram = fp->format.format == cram;
+    for ( i = 0; i <= h->n_targets; ++i ) {
+        uint64_t mapped = 0, unmapped = 0;
+        int beg, len = i < h->n_targets ? h->target_len[i] : 0;
+        if ( i < h->n_targets && !is_cram && hts_idx_get_stat(idx, i, &mapped, &unmapped) == 0 && mapped + unmapped == 0 )
+            continue;
+        // the last one is the unmapped reads without coordinates
+        for ( beg = 0; beg < len || (i == h->n_targets && beg == 0); beg += shard_size ) {
+            if ( *n == m ) {
+                m = m == 0 ? 64 : m << 1;
+                a = (struct bam_shard*)realloc(a, m*sizeof(struct bam_shard));
+            }
+            a[*n].tid = i < h->n_targets ? i : -1;
+            a[*n].beg = beg;
+            a[*n].end = beg + shard_size < len ? beg + shard_size : len;
+            (*n)++;
+            if ( i == h->n_targets )
+                break;
+        }
+    }
+    hts_idx_destroy(idx);
+    bam_hdr_destroy(h);
+    sam_close(fp);
+    // an indexed file without any read
+    if ( a == NULL )
+        a = (struct bam_shard*)malloc(sizeof(struct bam_shard));
+    return a;
+}
+
+// the input of each thread, opened on its first shard
+struct shard_reader {
+    samFile *fp;
+    bam_hdr_t *hdr;
+    hts_idx_t *idx;
+    bam1_t *b;
+};
+
+struct shard_result {
+    int ret;
+    int done;
+    kstring_t str;
+    int n, m;
+    bam1_t **b;   // kept records
+    size_t size;  // bytes of str and the kept records
+    FILE *spill;  // earlier text and records of the shard, NULL if all in memory
+};
+
+struct shard_run {
+    const char *fn;
+    const struct bam_shard *shards;
+    int first; // the first shard of this round
+    int n_round; // shards of this round
+    int next;  // the next shard of this round to write
+    int ret;
+    pthread_mutex_t lock;
+    struct bam_shard_opts *opts;
+    struct shard_reader *readers;
+    struct shard_result *results;
+};
+
+static int shard_reader_open(struct shard_reader *r, const char *fn)
+{
+    r->fp = sam_open(fn, "r");
+    if ( r->fp == NULL )
+        return -1;
+    r->hdr = sam_hdr_read(r->fp);
+    if ( r->hdr == NULL )
+        return -1;
+    r->idx = sam_index_load(r->fp, fn);
+    if ( r->idx == NULL )
+        return -1;
+    r->b = bam_init1();
+    return 0;
+}
+
+static void shard_reader_close(struct shard_reader *r)
+{
+    if ( r->b )
+        bam_destroy1(r->b);
+    if ( r->idx )
+        hts_idx_destroy(r->idx);
+    if ( r->hdr )
+        bam_hdr_destroy(r->hdr);
+    if ( r->fp )
+        sam_close(r->fp);
+}
+
+// the spill is blocks of text and records, each starts with the length of text and the number of records
+static int result_spill(struct shard_result *res)
+{
+    int i;
+    if ( res->spill == NULL && (res->spill = tmpfile()) == NULL )
+        return -1;
+    if ( fwrite(&res->str.l, sizeof(size_t), 1, res->spill) != 1 || fwrite(&res->n, sizeof(int), 1, res->spill) != 1 )
+        return -1;
+    if ( res->str.l && fwrite(res->str.s, 1, res->str.l, res->spill) != res->str.l )
+        return -1;
+    for ( i = 0; i < res->n; ++i ) {
+        bam1_t *b = res->b[i];
+        if ( fwrite(&b->core, sizeof(bam1_core_t), 1, res->spill) != 1 || fwrite(&b->l_data, sizeof(int), 1, res->spill) != 1 )
+            return -1;
+        if ( fwrite(b->data, 1, b->l_data, res->spill) != b->l_data )
+            return -1;
+    }
+    res->str.l = 0;
+    res->n = 0;
+    res->size = 0;
+    return 0;
+}
+
+static int write_block(struct bam_shard_opts *opts, const char *s, size_t l)
+{
+    if ( opts->text && l && bgzf_write(opts->text, s, l) < 0 ) {
+        error_print("Write error : %d", opts->text->errcode);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_record(struct bam_shard_opts *opts, bam1_t *b)
+{
+    if ( sam_write1(opts->out, opts->out_hdr, b) < 0 ) {
+        error_print("Failed to write records.");
+        return -1;
+    }
+    return 0;
+}
+
+// write the spilled and the kept outputs of a shard, and empty it
+static int result_write(struct shard_result *res, struct bam_shard_opts *opts)
+{
+    int i, j, n;
+    size_t l;
+    if ( res->spill ) {
+        kstring_t str = {0, 0, 0};
+        bam1_t *b = bam_init1();
+        int ret = 0;
+        rewind(res->spill);
+        while ( ret == 0 && fread(&l, sizeof(size_t), 1, res->spill) == 1 ) {
+            if ( fread(&n, sizeof(int), 1, res->spill) != 1 ) {
+                ret = -1;
+                break;
+            }
+            ks_resize(&str, l + 1);
+            if ( fread(str.s, 1, l, res->spill) != l || write_block(opts, str.s, l) ) {
+                ret = -1;
+                break;
+            }
+            for ( j = 0; j < n && ret == 0; ++j ) {
+                if ( fread(&b->core, sizeof(bam1_core_t), 1, res->spill) != 1 || fread(&b->l_data, sizeof(int), 1, res->spill) != 1 ) {
+                    ret = -1;
+                    break;
+                }
+                if ( b->m_data < b->l_data ) {
+                    b->m_data = b->l_data;
+                    kroundup32(b->m_data);
+                    b->data = (uint8_t*)realloc(b->data, b->m_data);
+                }
+                if ( fread(b->data, 1, b->l_data, res->spill) != b->l_data || write_record(opts, b) )
+                    ret = -1;
+            }
+        }
+        if ( ret == 0 && ferror(res->spill) )
+            ret = -1;
+        fclose(res->spill);
+        res->spill = NULL;
+        free(str.s);
+        bam_destroy1(b);
+        if ( ret ) {
+            error_print("Failed to read back the outputs of a shard.");
+            return -1;
+        }
+    }
+    if ( write_block(opts, res->str.s, res->str.l) )
+        return -1;
+    for ( i = 0; i < res->n; ++i )
+        if ( write_record(opts, res->b[i]) )
+            return -1;
+    res->str.l = 0;
+    res->n = 0;
+    res->size = 0;
+    return 0;
+}
+
+// the outputs of shard i are too large to keep, write them if all the shards before are written
+static int result_flush(struct shard_run *d, long i)
+{
+    struct shard_result *res = &d->results[i];
+    int ret;
+    pthread_mutex_lock(&d->lock);
+    // stop if the output failed already
+    if ( d->ret )
+        ret = -1;
+    else if ( d->next == i )
+        ret = result_write(res, d->opts);
+    else if ( (ret = result_spill(res)) != 0 )
+        error_print("Failed to spill the outputs of shard %ld : %s.", d->first + i, strerror(errno));
+    pthread_mutex_unlock(&d->lock);
+    return ret;
+}
+
+// shard i is done, write it and the done shards after it if all the shards before are written
+static void result_done(struct shard_run *d, long i)
+{
+    pthread_mutex_lock(&d->lock);
+    d->results[i].done = 1;
+    while ( d->ret == 0 && d->next < d->n_round && d->results[d->next].done ) {
+        struct shard_result *res = &d->results[d->next];
+        if ( res->ret || result_write(res, d->opts) ) {
+            d->ret = -1;
+            break;
+        }
+        d->next++;
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void process_shard(void *_d, long i, int tid)
+{
+    struct shard_run *d = (struct shard_run*)_d;
+    struct shard_reader *r = &d->readers[tid];
+    struct shard_result *res = &d->results[i];
+    const struct bam_shard *s = &d->shards[d->first + i];
+    struct bam_shard_opts *opts = d->opts;
+    samFile *out = NULL;
+    hts_itr_t *itr = NULL;
+    kstring_t fn = {0, 0, 0};
+    int ret;
+
+    res->ret = -1;
+    if ( r->fp == NULL && shard_reader_open(r, d->fn) ) {
+        error_print("Failed to open %s with its index.", d->fn);
+        goto clean;
+    }
+    itr = sam_itr_queryi(r->idx, s->tid == -1 ? HTS_IDX_NOCOOR : s->tid, s->beg, s->end);
+    if ( itr == NULL ) {
+        error_print("Failed to query %s.", d->fn);
+        goto clean;
+    }
+    if ( opts->prefix ) {
+        ksprintf(&fn, "%s.%05ld.bam", opts->prefix, d->first + i);
+        out = sam_open(fn.s, opts->mode ? opts->mode : "wb");
+        if ( out == NULL || sam_hdr_write(out, r->hdr) ) {
+            error_print("%s : %s.", fn.s, strerror(errno));
+            goto clean;
+        }
+    }
+
+    while ( (ret = sam_itr_next(r->fp, itr, r->b)) >= 0 ) {
+        // reads overlapping the previous shard were processed there
+        if ( s->tid != -1 && r->b->core.pos < s->beg )
+            continue;
+        size_t l = res->str.l;
+        ret = opts->func(opts->data, r->b, r->hdr, &res->str);
+        if ( ret == -1 )
+            goto clean;
+        // no text output
+        if ( opts->text == NULL )
+            res->str.l = 0;
+        res->size += res->str.l - l;
+        if ( ret == 1 && out && sam_write1(out, r->hdr, r->b) < 0 ) {
+            error_print("Failed to write %s.", fn.s);
+            goto clean;
+        }
+        if ( ret == 1 && opts->out ) {
+            if ( res->n == res->m ) {
+                res->m = res->m == 0 ? 1024 : res->m << 1;
+                res->b = (bam1_t**)realloc(res->b, res->m*sizeof(bam1_t*));
+                memset(res->b + res->n, 0, (res->m - res->n)*sizeof(bam1_t*));
+            }
+            res->b[res->n] = bam_copy1(res->b[res->n] ? res->b[res->n] : bam_init1(), r->b);
+            res->size += sizeof(bam1_t) + r->b->l_data;
+            res->n++;
+        }
+        if ( res->size >= SHARD_BUFFER_SIZE && result_flush(d, i) )
+            goto clean;
+    }
+    if ( ret < -1 )
+        error_print("Failed to read %s.", d->fn);
+    else
+        res->ret = 0;
+
+  clean:
+    if ( out && sam_close(out) ) {
+        error_print("Failed to close %s.", fn.s);
+        res->ret = -1;
+    }
+    free(fn.s);
+    if ( itr )
+        hts_itr_destroy(itr);
+    result_done(d, i);
+}
+
+int bam_shards_run(const char *fn, const struct bam_shard *shards, int n, struct bam_shard_opts *opts)
+{
+    int n_threads = opts->n_threads < 1 ? 1 : opts->n_threads;
+    int n_round = n_threads * SHARDS_PER_THREAD;
+    int i, j;
+    struct shard_run d;
+    d.fn = fn;
+    d.shards = shards;
+    d.opts = opts;
+    d.ret = 0;
+    pthread_mutex_init(&d.lock, NULL);
+    d.readers = (struct shard_reader*)calloc(n_threads, sizeof(struct shard_reader));
+    d.results = (struct shard_result*)calloc(n_round, sizeof(struct shard_result));
+
+    // the shards are processed by rounds, each shard is written once it is done and all the
+    // shards before it are written
+    for ( d.first = 0; d.first < n && d.ret == 0; d.first += n_round ) {
+        d.n_round = n - d.first < n_round ? n - d.first : n_round;
+        d.next = 0;
+        for ( i = 0; i < d.n_round; ++i ) {
+            d.results[i].done = 0;
+            d.results[i].str.l = 0;
+            d.results[i].n = 0;
+            d.results[i].size = 0;
+        }
+        kt_for(n_threads, process_shard, &d, d.n_round);
+    }
+
+    for ( i = 0; i < n_threads; ++i )
+        shard_reader_close(&d.readers[i]);
+    for ( i = 0; i < n_round; ++i ) {
+        for ( j = 0; j < d.results[i].m; ++j )
+            if ( d.results[i].b[j] )
+                bam_destroy1(d.results[i].b[j]);
+        if ( d.results[i].spill )
+            fclose(d.results[i].spill);
+        free(d.results[i].b);
+        free(d.results[i].str.s);
+    }
+    free(d.readers);
+    free(d.results);
+    pthread_mutex_destroy(&d.lock);
+    return d.ret;
+}
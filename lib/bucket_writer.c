@@ -0,0 +1,232 @@
+#include "utils.h"
+#include <string.h>
+#include <stdint.h>
+#include "htslib/bgzf.h"
+#include "htslib/kstring.h"
+#include "kthread.h"
+#include "bucket_writer.h"
+
+struct bucket {
+    char *fn;
+    kstring_t data; // uncompressed, less than one block after flushing
+    kstring_t comp; // compressed blocks not written yet
+    FILE *fp;
+    uint64_t last_used;
+};
+
+struct bucket_writer {
+    int n, m;
+    struct bucket *b;
+    size_t mem_limit;
+    int max_open;
+    int n_open;
+    int n_threads;
+    uint64_t clock;
+    int error;
+};
+
+struct bucket_writer *bucket_writer_init(size_t mem_limit, int max_open, int n_threads)
+{
+    struct bucket_writer *w = (struct bucket_writer*)calloc(1, sizeof(struct bucket_writer));
+    w->mem_limit = mem_limit;
+    w->max_open = max_open < 1 ? 1 : max_open;
+    w->n_threads = n_threads < 1 ? 1 : n_threads;
+    return w;
+}
+
+int bucket_writer_add(struct bucket_writer *w, const char *fn)
+{
+    // create the file now, so bad paths are reported before any reads processed
+    FILE *fp = fopen(fn, "wb");
+    if ( fp == NULL )
+        return -1;
+    fclose(fp);
+
+    if ( w->n == w->m ) {
+        w->m = w->m == 0 ? 64 : w->m << 1;
+        w->b = (struct bucket*)realloc(w->b, w->m*sizeof(struct bucket));
+    }
+    struct bucket *b = &w->b[w->n];
+    memset(b, 0, sizeof(struct bucket));
+    b->fn = strdup(fn);
+    return w->n++;
+}
+
+kstring_t *bucket_writer_buffer(struct bucket_writer *w, int id)
+{
+    return &w->b[id].data;
+}
+
+// compress one block at the end of the compressed buffer
+static int compress_block(struct bucket *b, const char *src, size_t slen)
+{
+    size_t dlen = BGZF_MAX_BLOCK_SIZE;
+    if ( ks_resize(&b->comp, b->comp.l + BGZF_MAX_BLOCK_SIZE) )
+        return -1;
+    // the same level bgzf_open(fn, "w") uses
+    if ( bgzf_compress(b->comp.s + b->comp.l, &dlen, src, slen, -1) )
+        return -1;
+    b->comp.l += dlen;
+    return 0;
+}
+
+// only full blocks are compressed, so the block boundaries are the same as BGZF
+static void compress_full_blocks(void *_w, long i, int tid)
+{
+    struct bucket_writer *w = (struct bucket_writer*)_w;
+    struct bucket *b = &w->b[i];
+    size_t offset = 0;
+    while ( b->data.l - offset >= BGZF_BLOCK_SIZE ) {
+        if ( compress_block(b, b->data.s + offset, BGZF_BLOCK_SIZE) ) {
+            w->error = 1;
+            return;
+        }
+        offset += BGZF_BLOCK_SIZE;
+    }
+    if ( offset ) {
+        memmove(b->data.s, b->data.s + offset, b->data.l - offset);
+        b->data.l -= offset;
+    }
+    // the tail is less than one block, release the rest of a buffer grown by a large chunk
+    if ( b->data.m > BGZF_BLOCK_SIZE ) {
+        b->data.m = BGZF_BLOCK_SIZE;
+        b->data.s = (char*)realloc(b->data.s, b->data.m);
+    }
+}
+
+static int compress_rest(struct bucket *b)
+{
+    if ( b->data.l == 0 )
+        return 0;
+    if ( compress_block(b, b->data.s, b->data.l) )
+        return -1;
+    b->data.l = 0;
+    return 0;
+}
+
+// reopen a file in append mode, close the least recently used one if too many open
+static FILE *bucket_open(struct bucket_writer *w, struct bucket *b)
+{
+    b->last_used = ++w->clock;
+    if ( b->fp )
+        return b->fp;
+
+    if ( w->n_open >= w->max_open ) {
+        int i;
+        struct bucket *lru = NULL;
+        for ( i = 0; i < w->n; ++i ) {
+            if ( w->b[i].fp == NULL )
+                continue;
+            if ( lru == NULL || w->b[i].last_used < lru->last_used )
+                lru = &w->b[i];
+        }
+        if ( fclose(lru->fp) )
+            return NULL;
+        lru->fp = NULL;
+        w->n_open--;
+    }
+
+    b->fp = fopen(b->fn, "ab");
+    if ( b->fp )
+        w->n_open++;
+    return b->fp;
+}
+
+static int bucket_spill(struct bucket_writer *w, struct bucket *b)
+{
+    if ( b->comp.l == 0 )
+        return 0;
+    FILE *fp = bucket_open(w, b);
+    if ( fp == NULL ) {
+        error_print("%s : %s.", b->fn, strerror(errno));
+        return -1;
+    }
+    if ( fwrite(b->comp.s, 1, b->comp.l, fp) != b->comp.l ) {
+        error_print("%s : %s.", b->fn, strerror(errno));
+        return -1;
+    }
+    // release the buffer, most buckets are idle for a long time in large plates
+    free(b->comp.s);
+    memset(&b->comp, 0, sizeof(kstring_t));
+    return 0;
+}
+
+static size_t memory_usage(struct bucket_writer *w)
+{
+    size_t mem = 0;
+    int i;
+    for ( i = 0; i < w->n; ++i )
+        mem += w->b[i].data.m + w->b[i].comp.m;
+    return mem;
+}
+
+static int cmp_compressed(const void *a, const void *b)
+{
+    size_t l1 = (*(struct bucket**)a)->comp.l;
+    size_t l2 = (*(struct bucket**)b)->comp.l;
+    return l1 < l2 ? 1 : l1 > l2 ? -1 : 0;
+}
+
+// spill the largest buckets until half of the memory limit is used. the partial blocks are
+// always kept in memory, so the block boundaries are the same as BGZF
+static int bucket_writer_spill(struct bucket_writer *w)
+{
+    size_t mem = memory_usage(w);
+    if ( mem <= w->mem_limit )
+        return 0;
+
+    int i;
+    struct bucket **a = (struct bucket**)malloc(w->n*sizeof(struct bucket*));
+    for ( i = 0; i < w->n; ++i )
+        a[i] = &w->b[i];
+
+    qsort(a, w->n, sizeof(struct bucket*), cmp_compressed);
+    for ( i = 0; i < w->n && mem > w->mem_limit/2 && a[i]->comp.l; ++i ) {
+        mem -= a[i]->comp.m;
+        if ( bucket_spill(w, a[i]) )
+            goto spill_error;
+    }
+
+    free(a);
+    return 0;
+
+  spill_error:
+    free(a);
+    return -1;
+}
+
+int bucket_writer_flush(struct bucket_writer *w)
+{
+    kt_for(w->n_threads, compress_full_blocks, w, w->n);
+    if ( w->error ) {
+        error_print("Failed to compress blocks.");
+        return -1;
+    }
+    return bucket_writer_spill(w);
+}
+
+int bucket_writer_close(struct bucket_writer *w)
+{
+    int i, ret = 0;
+    if ( bucket_writer_flush(w) )
+        ret = -1;
+
+    for ( i = 0; i < w->n; ++i ) {
+        struct bucket *b = &w->b[i];
+        // the last partial block and an empty block as EOF marker, the same as bgzf_close
+        if ( ret == 0 && (compress_rest(b) || compress_block(b, "", 0) || bucket_spill(w, b)) )
+            ret = -1;
+        if ( b->fp ) {
+            if ( fclose(b->fp) )
+                ret = -1;
+            b->fp = NULL;
+            w->n_open--;
+        }
+        free(b->fn);
+        free(b->data.s);
+        free(b->comp.s);
+    }
+    free(w->b);
+    free(w);
+    return ret;
+}
@@ -2,37 +2,133 @@
 #include "fastq.h"
 #include "zlib.h"
 #include "string.h"
+#include <ctype.h>
+#include "htslib/hts.h"
 #include "htslib/bgzf.h"
-#include "htslib/kseq.h"
+#include "htslib/khash.h"
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define FASTQ_AVX2
+#define FASTQ_SSSE3
+#endif
 
+KHASH_MAP_INIT_INT64(bcidx, int)
 
-KSEQ_INIT(gzFile, gzread)
+struct barcode_index {
+    int length;    // of the first index
+    int mismatch;
+    int length2;   // of the second index, 0 for single index
+    int mismatch2;
+    int wildcard;
+    kh_bcidx_t *hash; // NULL if not indexed
+};
 
-int check_match(char *seq1, const char *seq2, int mismatch, int length) {
-    int i;
-    int m = 0;
-    for ( i = 0; i < length; ++i ) {
-        if ( seq1[i] != seq2[i] ) {
-            m++;
-            if ( m > mismatch )
-                return -1;
-        }
+/*
+ * Mismatch counting kernel. Bases are compared 32 (AVX2, checked at run time),
+ * 16 (SSE2) and 8 (SWAR on a 64 bits word) at a time, the tail one by one. N in
+ * the second sequence matches any base if wildcard is set. Counting stops once
+ * the mismatches exceed max, the returned value is then larger than max.
+ */
+#define SWAR_LO 0x0101010101010101ULL
+#define SWAR_HI 0x8080808080808080ULL
+
+// set the high bit of every nonzero byte
+static inline uint64_t swar_nonzero(uint64_t x)
+{
+    return (((x & ~SWAR_HI) + ~SWAR_HI) | x) & SWAR_HI;
+}
+
+#ifdef FASTQ_AVX2
+__attribute__((target("avx2")))
+static int mismatch_avx2(const char *s1, const char *s2, int l, int max, int wildcard, int *_i)
+{
+    const __m256i vN = _mm256_set1_epi8('N'), vn = _mm256_set1_epi8('n');
+    int i, m = 0;
+    for ( i = 0; i + 32 <= l; i += 32 ) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(s1+i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s2+i));
+        __m256i eq = _mm256_cmpeq_epi8(a, b);
+        if ( wildcard )
+            eq = _mm256_or_si256(eq, _mm256_or_si256(_mm256_cmpeq_epi8(b, vN), _mm256_cmpeq_epi8(b, vn)));
+        m += 32 - __builtin_popcount((uint32_t)_mm256_movemask_epi8(eq));
+        if ( m > max )
+            break;
     }
-    return mismatch;
+    *_i = i;
+    return m;
 }
-int check_match2(char *seq1, const char *seq2, int mismatch, int length) {
-    int i;
-    int m = 0;
-    for ( i = 0; i < length; ++i ) {
-        if ( seq2[i] == 'n' || seq2[i] == 'N')
-            continue;
-        if ( seq1[i] != seq2[i] ) {            
-            m++;
-            if ( m > mismatch )
-                return -1;
+#endif
+
+static inline int mismatch_core(const char *s1, const char *s2, int l, int max, int wildcard)
+{
+    int i = 0, m = 0;
+#ifdef FASTQ_AVX2
+    static int has_avx2 = -1;
+    if ( l >= 32 ) {
+        if ( has_avx2 == -1 )
+            has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+        if ( has_avx2 ) {
+            m = mismatch_avx2(s1, s2, l, max, wildcard, &i);
+            if ( m > max )
+                return m;
         }
     }
-    return mismatch;
+#endif
+#ifdef __SSE2__
+    const __m128i vN = _mm_set1_epi8('N'), vn = _mm_set1_epi8('n');
+    for ( ; i + 16 <= l; i += 16 ) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s1+i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s2+i));
+        __m128i eq = _mm_cmpeq_epi8(a, b);
+        if ( wildcard )
+            eq = _mm_or_si128(eq, _mm_or_si128(_mm_cmpeq_epi8(b, vN), _mm_cmpeq_epi8(b, vn)));
+        m += 16 - __builtin_popcount(_mm_movemask_epi8(eq));
+        if ( m > max )
+            return m;
+    }
+#endif
+    for ( ; i + 8 <= l; i += 8 ) {
+        uint64_t a, b;
+        memcpy(&a, s1+i, 8);
+        memcpy(&b, s2+i, 8);
+        uint64_t x = swar_nonzero(a ^ b);
+        if ( wildcard )
+            x &= swar_nonzero(b ^ ('N'*SWAR_LO)) & swar_nonzero(b ^ ('n'*SWAR_LO));
+        m += __builtin_popcountll(x);
+        if ( m > max )
+            return m;
+    }
+    for ( ; i < l; ++i ) {
+        if ( wildcard && (s2[i] == 'N' || s2[i] == 'n') )
+            continue;
+        if ( s1[i] != s2[i] && ++m > max )
+            return m;
+    }
+    return m;
+}
+
+int count_mismatch(const char *seq1, const char *seq2, int length, int max)
+{
+    return mismatch_core(seq1, seq2, length, max, 0);
+}
+
+int count_mismatch2(const char *seq1, const char *seq2, int length, int max)
+{
+    return mismatch_core(seq1, seq2, length, max, 1);
+}
+
+int check_match(char *seq1, const char *seq2, int mismatch, int length)
+{
+    return mismatch_core(seq1, seq2, length, mismatch, 0) > mismatch ? -1 : mismatch;
+}
+
+int check_match2(char *seq1, const char *seq2, int mismatch, int length)
+{
+    return mismatch_core(seq1, seq2, length, mismatch, 1) > mismatch ? -1 : mismatch;
 }
 
 int load_barcode_file(const char *fn, struct barcode *bc)
@@ -42,11 +138,12 @@ int load_barcode_file(const char *fn, struct barcode *bc)
         error("%s : %s", fn, strerror(errno));
 
     kstring_t string = {0, 0, 0};
+    int l_index1 = -1; // 0 for single index
 
     do {
         if ( bgzf_getline(fp, '\n', &string) < 0 )
             break;
-        int i, j;
+        int i, j, sep = 0;
         for ( i = 0; i < string.l; ++i ) {
             if ( string.s[i] == '\t') {
                 string.s[i] = '\0';
@@ -69,10 +166,27 @@ int load_barcode_file(const char *fn, struct barcode *bc)
                 case 'n':
                 case 'N':
                     continue;
+                case '\t':
+                    // the third column is the second index
+                    if ( sep == 0 && j > i+1 && j+1 < string.l ) {
+                        sep = j;
+                        continue;
+                    }
+                    // fall through
                 default:
                     error("Unsupport barcode sequence. %s", string.s);
             }
         }
+        // dual indexes are kept as one concatenated barcode
+        if ( sep ) {
+            memmove(string.s+sep, string.s+sep+1, string.l-sep);
+            string.l--;
+            j--;
+        }
+        if ( l_index1 == -1 )
+            l_index1 = sep ? sep-i-1 : 0;
+        else if ( l_index1 != (sep ? sep-i-1 : 0) )
+            error("Inconsistant index columns in barcode file. %s", string.s);
         if ( bc->n == bc->m ) {
             bc->m = bc->n+8;
             bc->names = (struct name*)realloc(bc->names, bc->m *sizeof(struct name));
@@ -96,6 +210,7 @@ int load_barcode_file(const char *fn, struct barcode *bc)
     if ( bc->n == 0 )
         return 1;
 
+    bc->l_index1 = l_index1;
     free(string.s);
     bgzf_close(fp);    
     return 0;
@@ -115,29 +230,867 @@ int clean_barcode_struct(struct barcode *bc)
             bgzf_close(name->fp2);
     }
     free(bc->names);
+    if ( bc->index ) {
+        if ( bc->index->hash )
+            kh_destroy(bcidx, bc->index->hash);
+        free(bc->index);
+    }
     return 0;
 }
-int check_file_is_fastq(const char *fn)
+
+// 2 bits per base, other characters are 4
+static const uint8_t bc_nt4_table[256] = {
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+};
+
+// keep the neighbourhood hash in a reasonable size, fall back to the scan if larger
+#define BARCODE_INDEX_MAX 0x2000000
+
+int barcode_length(struct barcode *bc)
 {
-    gzFile fp;
-    kseq_t *seq = NULL;
-    int l;
-    int ret = 0;
-    fp = gzopen(fn, "r");
-    if ( fp == NULL ) {
-        error_print("%s : %s", fn, strerror(errno));
+    int i, l = -1;
+    for ( i = 0; i < bc->n; ++i ) {
+        int l0 = strlen(bc->names[i].barcode);
+        if ( l == -1 )
+            l = l0;
+        else if ( l != l0 )
+            return -1;
+    }
+    return l;
+}
+
+// enumerate sequences within mismatch of the barcode, position by position. mis2 is the budget of the second index
+static void barcode_index_push(struct barcode_index *idx, const char *s, int pos, uint64_t key, int mis, int mis2, int id, int *ambig)
+{
+    if ( pos == idx->length + idx->length2 ) {
+        int ret;
+        khiter_t k = kh_put(bcidx, idx->hash, key, &ret);
+        if ( ret != 0 )
+            kh_val(idx->hash, k) = id;
+        else if ( kh_val(idx->hash, k) != id )
+            ambig[kh_val(idx->hash, k)]++;
+        return;
+    }
+    int c, cost;
+    for ( c = 0; c < 4; ++c ) {
+        if ( "ACGT"[c] == s[pos] || (idx->wildcard && (s[pos] == 'N' || s[pos] == 'n')) )
+            cost = 0;
+        else
+            cost = 1;
+        if ( pos < idx->length ) {
+            if ( cost <= mis )
+                barcode_index_push(idx, s, pos+1, key<<2|c, mis-cost, mis2, id, ambig);
+        }
+        else if ( cost <= mis2 ) {
+            barcode_index_push(idx, s, pos+1, key<<2|c, mis, mis2-cost, id, ambig);
+        }
+    }
+}
+
+// sum(C(l,k)*3^k) for k in [0, mismatch]
+static double neighbourhood_size(int length, int mismatch)
+{
+    double c = 1, t = 1;
+    int k;
+    for ( k = 1; k <= mismatch && k <= length; ++k ) {
+        c = c * (length - k + 1) / k * 3;
+        t += c;
+    }
+    return t;
+}
+
+int barcode_index_build(struct barcode *bc, int length, int mismatch, int wildcard)
+{
+    return barcode_index_build2(bc, length, mismatch, 0, 0, wildcard);
+}
+
+int barcode_index_build2(struct barcode *bc, int length, int mismatch, int length2, int mismatch2, int wildcard)
+{
+    struct barcode_index *idx = (struct barcode_index*)calloc(1, sizeof(struct barcode_index));
+    idx->length = length;
+    idx->mismatch = mismatch;
+    idx->length2 = length2;
+    idx->mismatch2 = mismatch2;
+    idx->wildcard = wildcard;
+    bc->index = idx;
+
+    if ( length < 1 || length2 < 0 || length + length2 > 32 || bc->n == 0 )
+        return 1;
+
+    // estimate the size of the neighbourhood, the product of both indexes per barcode
+    int i, j;
+    double size = 0;
+    for ( i = 0; i < bc->n; ++i ) {
+        const char *s = bc->names[i].barcode;
+        if ( strlen(s) != length + length2 )
+            return 1;
+        double t = neighbourhood_size(length, mismatch) * neighbourhood_size(length2, mismatch2);
+        for ( j = 0; j < length + length2; ++j )
+            if ( wildcard && (s[j] == 'N' || s[j] == 'n') )
+                t *= 4;
+        size += t;
+    }
+    if ( size > BARCODE_INDEX_MAX ) {
+        warnings("Too many barcode neighbours (%.0f) to index, scan barcodes one by one.", size);
+        return 1;
+    }
+
+    idx->hash = kh_init(bcidx);
+    kh_resize(bcidx, idx->hash, (khint_t)size);
+    int *ambig = (int*)malloc(bc->n*sizeof(int));
+    for ( i = 0; i < bc->n; ++i ) {
+        memset(ambig, 0, bc->n*sizeof(int));
+        barcode_index_push(idx, bc->names[i].barcode, 0, 0, mismatch, mismatch2, i, ambig);
+        for ( j = 0; j < i; ++j ) {
+            if ( ambig[j] == 0 )
+                continue;
+            warnings("%d sequences within %d mismatches of both %s (%s) and %s (%s), assigned to %s.",
+                     ambig[j], mismatch, bc->names[j].name, bc->names[j].barcode,
+                     bc->names[i].name, bc->names[i].barcode, bc->names[j].name);
+        }
+    }
+    free(ambig);
+    return 0;
+}
+
+int barcode_lookup(struct barcode *bc, const char *seq)
+{
+    struct barcode_index *idx = bc->index;
+    int i;
+    if ( idx->hash ) {
+        uint64_t key = 0;
+        for ( i = 0; i < idx->length + idx->length2; ++i ) {
+            uint8_t c = bc_nt4_table[(uint8_t)seq[i]];
+            if ( c > 3 )
+                break;
+            key = key<<2 | c;
+        }
+        // reads with N or other characters fall back to the scan
+        if ( i == idx->length + idx->length2 ) {
+            khiter_t k = kh_get(bcidx, idx->hash, key);
+            return k == kh_end(idx->hash) ? -1 : kh_val(idx->hash, k);
+        }
+    }
+
+    for ( i = 0; i < bc->n; ++i ) {
+        const char *s = bc->names[i].barcode;
+        int ret = idx->wildcard ?
+            check_match2((char*)seq, s, idx->mismatch, idx->length) :
+            check_match((char*)seq, s, idx->mismatch, idx->length);
+        if ( ret != -1 && idx->length2 )
+            ret = idx->wildcard ?
+                check_match2((char*)seq + idx->length, s + idx->length, idx->mismatch2, idx->length2) :
+                check_match((char*)seq + idx->length, s + idx->length, idx->mismatch2, idx->length2);
+        if ( ret != -1 )
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Approximate adaptor search by shift-and with a mismatch budget. Row d of the
+ * state keeps bit j set if the adaptor prefix of j+1 bases ends at the current
+ * base with at most d mismatches, so one pass over the read finds every hit.
+ * Adaptors longer than the machine word are scanned offset by offset.
+ */
+#define ADAPTOR_WORD 64
+#define ADAPTOR_PARTIAL_EXACT 8
+
+struct adaptor_matcher {
+    char *seq;
+    int length;
+    int mismatch;
+    uint64_t mask[256];
+};
+
+struct adaptor_matcher *adaptor_matcher_init(const char *adaptor, int mismatch)
+{
+    struct adaptor_matcher *am = (struct adaptor_matcher*)malloc(sizeof(*am));
+    int i, c;
+    am->seq = strdup(adaptor);
+    am->length = strlen(adaptor);
+    am->mismatch = mismatch < 0 ? 0 : mismatch;
+    memset(am->mask, 0, sizeof(am->mask));
+    for ( i = 0; i < am->length && i < ADAPTOR_WORD; ++i ) {
+        // N in adaptor matches any base, the same as check_match2
+        if ( adaptor[i] == 'N' || adaptor[i] == 'n' ) {
+            for ( c = 0; c < 256; ++c )
+                am->mask[c] |= 1ULL<<i;
+        } else {
+            am->mask[(uint8_t)adaptor[i]] |= 1ULL<<i;
+        }
+    }
+    return am;
+}
+
+void adaptor_matcher_destroy(struct adaptor_matcher *am)
+{
+    if ( am == NULL )
+        return;
+    free(am->seq);
+    free(am);
+}
+
+static inline int adaptor_budget(const struct adaptor_matcher *am, int l, int partial)
+{
+    return partial && l < ADAPTOR_PARTIAL_EXACT ? 0 : am->mismatch;
+}
+
+static int adaptor_search_scan(const struct adaptor_matcher *am, const char *seq, int l, int end, int partial)
+{
+    int i;
+    for ( i = 0; i < end; ++i ) {
+        int m = am->length;
+        if ( l - i < m ) {
+            if ( partial == 0 )
+                break;
+            m = l - i;
+        }
+        if ( check_match2((char*)seq+i, am->seq, adaptor_budget(am, m, partial), m) != -1 )
+            return i;
+    }
+    return end;
+}
+
+int adaptor_search(const struct adaptor_matcher *am, const char *seq, int l, int end, int partial)
+{
+    int m = am->length;
+    if ( end > l )
+        end = l;
+    if ( end <= 0 )
+        return end;
+    if ( m > ADAPTOR_WORD || m == 0 )
+        return adaptor_search_scan(am, seq, l, end, partial);
+
+    // rows beyond the adaptor length are always full, no need to keep them
+    int k = am->mismatch < m ? am->mismatch : m;
+    int full = adaptor_budget(am, m, partial);
+    if ( full > k )
+        full = k;
+    uint64_t R[ADAPTOR_WORD+1];
+    uint64_t hit = 1ULL<<(m-1);
+    int d, p;
+    memset(R, 0, sizeof(R[0])*(k+1));
+
+    for ( p = 0; p < l; ++p ) {
+        uint64_t b = am->mask[(uint8_t)seq[p]];
+        uint64_t prev = R[0];
+        R[0] = (R[0]<<1 | 1) & b;
+        for ( d = 1; d <= k; ++d ) {
+            uint64_t cur = R[d];
+            R[d] = ((cur<<1 | 1) & b) | (prev<<1 | 1);
+            prev = cur;
+        }
+        if ( R[full] & hit ) {
+            // full hits come in offset order and always before the partial ones
+            int i = p - m + 1;
+            return i < end ? i : end;
+        }
+    }
+
+    if ( partial == 0 )
+        return end;
+
+    // adaptor prefix at the 3' end of read, check the longest one first
+    int i = l - m + 1;
+    if ( i < 0 )
+        i = 0;
+    for ( ; i < end; ++i ) {
+        int L = l - i;
+        d = adaptor_budget(am, L, partial);
+        if ( d > k )
+            d = k;
+        if ( R[d]>>(L-1) & 1 )
+            return i;
+    }
+    return end;
+}
+
+/*
+ * FASTQ reader. Input is loaded FASTQ_BLOCK_SIZE bytes at a time into the chunk
+ * buffer and parsed in place, the incomplete record at the end is kept for the
+ * next chunk. Bgzipped files are read by BGZF so the thread pool could be used,
+ * gzip and plain text files by zlib, which also handles concatenated gzip.
+ */
+#define FASTQ_BLOCK_SIZE 0x40000
+
+struct fastq_reader {
+    BGZF *bgzf;
+    gzFile gz;
+    int eof;
+    int error;
+    char *rest; // incomplete record left by the last chunk
+    int l_rest, m_rest;
+    struct fastq_chunk *chunk; // for fastq_read()
+    int i;
+};
+
+struct fastq_reader *fastq_reader_open(const char *fn, hts_tpool *pool)
+{
+    struct fastq_reader *r = (struct fastq_reader*)calloc(1, sizeof(struct fastq_reader));
+    if ( strcmp(fn, "-") != 0 ) {
+        BGZF *fp = bgzf_open(fn, "r");
+        if ( fp == NULL ) {
+            free(r);
+            return NULL;
+        }
+        if ( bgzf_compression(fp) == bgzf ) {
+            r->bgzf = fp;
+            if ( pool && bgzf_thread_pool(fp, pool, 0) != 0 )
+                error("Failed to set up threads for %s.", fn);
+        } else {
+            bgzf_close(fp);
+        }
+    }
+    if ( r->bgzf == NULL ) {
+        r->gz = strcmp(fn, "-") == 0 ? gzdopen(fileno(stdin), "r") : gzopen(fn, "r");
+        if ( r->gz == NULL ) {
+            free(r);
+            return NULL;
+        }
+        gzbuffer(r->gz, FASTQ_BLOCK_SIZE);
+    }
+    return r;
+}
+
+void fastq_reader_close(struct fastq_reader *r)
+{
+    if ( r == NULL )
+        return;
+    if ( r->bgzf )
+        bgzf_close(r->bgzf);
+    if ( r->gz )
+        gzclose(r->gz);
+    if ( r->chunk )
+        fastq_chunk_destroy(r->chunk);
+    free(r->rest);
+    free(r);
+}
+
+struct fastq_chunk *fastq_chunk_init()
+{
+    return (struct fastq_chunk*)calloc(1, sizeof(struct fastq_chunk));
+}
+
+void fastq_chunk_destroy(struct fastq_chunk *c)
+{
+    if ( c == NULL )
+        return;
+    free(c->r);
+    free(c->buf);
+    free(c);
+}
+
+// make room for size bytes, records already loaded are moved with the buffer
+static void chunk_reserve(struct fastq_chunk *c, int size)
+{
+    if ( size <= c->m_buf )
+        return;
+    int m = c->m_buf ? c->m_buf : FASTQ_BLOCK_SIZE;
+    while ( m < size )
+        m <<= 1;
+    char *buf = (char*)malloc(m);
+    int i;
+    memcpy(buf, c->buf, c->l_buf);
+    for ( i = 0; i < c->n; ++i ) {
+        struct fastq_record *r = &c->r[i];
+        r->name = buf + (r->name - c->buf);
+        r->comment = buf + (r->comment - c->buf);
+        r->seq = buf + (r->seq - c->buf);
+        if ( r->qual )
+            r->qual = buf + (r->qual - c->buf);
+    }
+    free(c->buf);
+    c->buf = buf;
+    c->m_buf = m;
+}
+
+static inline char *find_line(char *s, int l)
+{
+    return (char*)memchr(s, '\n', l);
+}
+
+// line length without the new line and carriage return
+static inline int line_length(char *s, char *e)
+{
+    return e > s && e[-1] == '\r' ? e - s - 1 : e - s;
+}
+
+// join lines in [s, e) in place and NUL terminate, return the length
+static int join_lines(char *s, char *e)
+{
+    char *p = s, *q = s;
+    while ( q < e ) {
+        char *nl = find_line(q, e - q);
+        int l = line_length(q, nl);
+        if ( p != q )
+            memmove(p, q, l);
+        p += l;
+        q = nl + 1;
+    }
+    *p = '\0';
+    return p - s;
+}
+
+/*
+ * Parse one record from s[pos, l), the same way as kseq. Lines are only checked
+ * until the record is known to be complete, then NUL terminated in place.
+ * return 1 on success, 0 if more data is needed, -1 on format error.
+ */
+static int parse_record(char *s, int l, int eof, int *_pos, struct fastq_record *r)
+{
+    char *p = s + *_pos, *end = s + l, *nl;
+    int n_seq = 0, n_qual = 0, l_seq = 0, l_qual = 0;
+
+    // skip to the header like kseq
+    while ( p < end && *p != '>' && *p != '@' )
+        ++p;
+    *_pos = p - s;
+    if ( p == end )
+        return 0;
+    char *title = p;
+    if ( (nl = find_line(p, end - p)) == NULL )
+        return 0;
+    char *title_end = nl;
+    p = nl + 1;
+
+    char *seq = p;
+    for ( ;; ) {
+        if ( p == end ) {
+            if ( eof )
+                break;
+            return 0;
+        }
+        if ( *p == '>' || *p == '@' || *p == '+' )
+            break;
+        if ( (nl = find_line(p, end - p)) == NULL )
+            return 0;
+        l_seq += line_length(p, nl);
+        n_seq++;
+        p = nl + 1;
+    }
+    char *seq_end = p;
+
+    char *qual = NULL, *qual_end = NULL;
+    if ( p < end && *p == '+' ) {
+        if ( (nl = find_line(p, end - p)) == NULL )
+            return 0;
+        p = qual = nl + 1;
+        // read at least one line, the same as kseq
+        do {
+            if ( p == end ) {
+                if ( eof )
+                    break;
+                return 0;
+            }
+            if ( (nl = find_line(p, end - p)) == NULL )
+                return 0;
+            l_qual += line_length(p, nl);
+            n_qual++;
+            p = nl + 1;
+        } while ( l_qual < l_seq );
+        if ( l_qual != l_seq )
+            return -1;
+        qual_end = p;
+    }
+    *_pos = p - s;
+
+    // the record is complete, terminate the views in place
+    int l_title = line_length(title + 1, title_end);
+    title[1+l_title] = '\0';
+    r->name = title + 1;
+    for ( r->l_name = 0; r->l_name < l_title; ++r->l_name )
+        if ( isspace(r->name[r->l_name]) )
+            break;
+    if ( r->l_name < l_title ) {
+        r->name[r->l_name] = '\0';
+        r->comment = r->name + r->l_name + 1;
+        r->l_comment = l_title - r->l_name - 1;
+    } else {
+        r->comment = r->name + l_title;
+        r->l_comment = 0;
+    }
+
+    // empty sequences point to the end of title
+    if ( n_seq == 0 ) {
+        r->seq = title + 1 + l_title;
+    } else if ( n_seq == 1 ) {
+        r->seq = seq;
+        seq[l_seq] = '\0';
+    } else {
+        r->seq = seq;
+        join_lines(seq, seq_end);
+    }
+    r->l_seq = l_seq;
+
+    if ( qual == NULL ) {
+        r->qual = NULL;
+    } else if ( n_qual == 0 || l_qual == 0 ) {
+        r->qual = title + 1 + l_title;
+    } else if ( n_qual == 1 ) {
+        r->qual = qual;
+        qual[l_qual] = '\0';
+    } else {
+        r->qual = qual;
+        join_lines(qual, qual_end);
+    }
+    return 1;
+}
+
+static int reader_load(struct fastq_reader *r, char *buf, int size)
+{
+    if ( r->bgzf )
+        return bgzf_read(r->bgzf, buf, size);
+    return gzread(r->gz, buf, size);
+}
+
+// read records until size bases or n records are loaded, 0 for no limit
+static int chunk_fill(struct fastq_reader *r, struct fastq_chunk *c, int size, int n)
+{
+    int pos = 0, bases = 0;
+    c->n = 0;
+    c->l_buf = 0;
+    if ( r->error )
+        return -1;
+    chunk_reserve(c, r->l_rest + 1);
+    memcpy(c->buf, r->rest, r->l_rest);
+    c->l_buf = r->l_rest;
+
+    for ( ;; ) {
+        if ( (size && bases >= size) || (n && c->n == n) )
+            break;
+        if ( c->n == c->m ) {
+            c->m = c->m ? c->m<<1 : 1024;
+            c->r = (struct fastq_record*)realloc(c->r, c->m*sizeof(struct fastq_record));
+        }
+        int ret = parse_record(c->buf, c->l_buf, r->eof, &pos, &c->r[c->n]);
+        if ( ret == 1 ) {
+            bases += c->r[c->n].l_seq;
+            c->n++;
+            continue;
+        }
+        // records before the broken one are still returned, the error is reported by the next call
+        if ( ret < 0 ) {
+            char *nl = find_line(c->buf+pos, c->l_buf-pos);
+            error_print("Inconsistant sequence and quality length. %.*s", nl ? (int)(nl-c->buf-pos) : 0, c->buf+pos);
+            r->error = 1;
+            pos = c->l_buf;
+            break;
+        }
+        if ( r->eof )
+            break;
+        chunk_reserve(c, c->l_buf + FASTQ_BLOCK_SIZE + 1);
+        int l = reader_load(r, c->buf + c->l_buf, FASTQ_BLOCK_SIZE);
+        if ( l < 0 ) {
+            error_print("Failed to read sequences.");
+            return -1;
+        }
+        if ( l == 0 ) {
+            r->eof = 1;
+            // make sure the last line is terminated
+            if ( c->l_buf > pos && c->buf[c->l_buf-1] != '\n' )
+                c->buf[c->l_buf++] = '\n';
+        }
+        c->l_buf += l;
+    }
+
+    r->l_rest = c->l_buf - pos;
+    if ( r->l_rest > r->m_rest ) {
+        r->m_rest = r->l_rest;
+        r->rest = (char*)realloc(r->rest, r->m_rest);
+    }
+    memcpy(r->rest, c->buf + pos, r->l_rest);
+    return c->n;
+}
+
+int fastq_read_chunk(struct fastq_reader *r, struct fastq_chunk *c, int size)
+{
+    return chunk_fill(r, c, size > 0 ? size : FASTQ_BLOCK_SIZE, 0);
+}
+
+int fastq_read_chunk2(struct fastq_reader *r1, struct fastq_reader *r2, struct fastq_chunk *c1, struct fastq_chunk *c2, int size)
+{
+    int n1 = chunk_fill(r1, c1, size > 0 ? size : FASTQ_BLOCK_SIZE, 0);
+    if ( n1 < 0 )
+        return -1;
+    // one more record is tried to make sure read 2 is not longer than read 1
+    int n2 = chunk_fill(r2, c2, 0, n1 ? n1 : 1);
+    if ( n2 < 0 )
         return -1;
+    if ( n1 != n2 )
+        error("Inconsistant read records. %d vs %d", n1, n2);
+
+    int i, j;
+    for ( i = 0; i < n1; ++i ) {
+        struct fastq_record *a = &c1->r[i], *b = &c2->r[i];
+        // the last character is usually the read number
+        for ( j = 0; j < a->l_name - 1; ++j )
+            if ( a->name[j] != b->name[j] )
+                error("Inconsistant read name. %s vs %s.", a->name, b->name);
+    }
+    return n1;
+}
+
+struct fastq_record *fastq_read(struct fastq_reader *r)
+{
+    if ( r->chunk == NULL )
+        r->chunk = fastq_chunk_init();
+    if ( r->i == r->chunk->n ) {
+        r->i = 0;
+        int n = fastq_read_chunk(r, r->chunk, 0);
+        if ( n < 0 )
+            error("Failed to read sequences.");
+        if ( n == 0 )
+            return NULL;
+    }
+    return &r->chunk->r[r->i++];
+}
+
+int fastq_read2(struct fastq_reader *r1, struct fastq_reader *r2, struct fastq_record **a, struct fastq_record **b)
+{
+    if ( r1->chunk == NULL ) {
+        r1->chunk = fastq_chunk_init();
+        r2->chunk = fastq_chunk_init();
+    }
+    if ( r1->i == r1->chunk->n ) {
+        r1->i = r2->i = 0;
+        int n = fastq_read_chunk2(r1, r2, r1->chunk, r2->chunk, 0);
+        if ( n < 0 )
+            error("Failed to read sequences.");
+        if ( n == 0 )
+            return 0;
+    }
+    *a = &r1->chunk->r[r1->i++];
+    *b = &r2->chunk->r[r2->i++];
+    return 1;
+}
+
+/*
+ * Quality binning. Qualities are remapped by a table of QUAL_BINS_SIZE phred
+ * scores, 16 at a time by pshufb (SSSE3, checked at run time): the low nibble
+ * of the score indexes each 16 entries block, and the block of the high nibble
+ * is selected. Scores out of the table are taken as the last entry.
+ */
+static uint8_t qual_bins[QUAL_BINS_SIZE];
+static int qual_binning = 0;
+
+#ifdef FASTQ_SSSE3
+__attribute__((target("ssse3")))
+static int qual_bin_blocks_ssse3(char *dst, const char *src, int l)
+{
+    __m128i t[QUAL_BINS_SIZE/16];
+    const __m128i v33 = _mm_set1_epi8(33), vmax = _mm_set1_epi8(QUAL_BINS_SIZE-1), v15 = _mm_set1_epi8(15);
+    int i, k;
+    for ( k = 0; k < QUAL_BINS_SIZE/16; ++k )
+        t[k] = _mm_loadu_si128((const __m128i*)(qual_bins + k*16));
+    for ( i = 0; i + 16 <= l; i += 16 ) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src+i));
+        x = _mm_min_epu8(_mm_subs_epu8(x, v33), vmax);
+        __m128i lo = _mm_and_si128(x, v15);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), v15);
+        __m128i y = _mm_setzero_si128();
+        for ( k = 0; k < QUAL_BINS_SIZE/16; ++k ) {
+            __m128i m = _mm_cmpeq_epi8(hi, _mm_set1_epi8(k));
+            y = _mm_or_si128(y, _mm_and_si128(m, _mm_shuffle_epi8(t[k], lo)));
+        }
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_add_epi8(y, v33));
+    }
+    return i;
+}
+#endif
+
+static void qual_bin(char *dst, const char *src, int l)
+{
+    int i = 0;
+#ifdef FASTQ_SSSE3
+    static int has_ssse3 = -1;
+    if ( has_ssse3 == -1 )
+        has_ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    if ( has_ssse3 )
+        i = qual_bin_blocks_ssse3(dst, src, l);
+#endif
+    for ( ; i < l; ++i ) {
+        int q = (uint8_t)src[i] < 33 ? 0 : (uint8_t)src[i] - 33;
+        dst[i] = qual_bins[q < QUAL_BINS_SIZE ? q : QUAL_BINS_SIZE-1] + 33;
+    }
+}
+
+// lower bound and the binned score of each bin
+static const int illumina8_bins[][2] = { {0, 0}, {1, 1}, {2, 6}, {10, 15}, {20, 22}, {25, 27}, {30, 33}, {35, 37}, {40, 40}, {-1, -1} };
+static const int bin4_bins[][2] = { {0, 2}, {3, 12}, {15, 23}, {31, 37}, {-1, -1} };
+
+int fastq_qual_bins_parse(const char *scheme, uint8_t *table)
+{
+    const int (*bins)[2] = NULL;
+    int i, j;
+    if ( strcmp(scheme, "illumina8") == 0 )
+        bins = illumina8_bins;
+    else if ( strcmp(scheme, "bin4") == 0 )
+        bins = bin4_bins;
+
+    if ( bins ) {
+        for ( i = 0, j = 0; i < QUAL_BINS_SIZE; ++i ) {
+            if ( bins[j+1][0] != -1 && i >= bins[j+1][0] )
+                ++j;
+            table[i] = bins[j][1];
+        }
+        return 0;
     }
-    seq = kseq_init(fp);
-    l = kseq_read(seq);
-    if ( l >= 0 ) {
-        ret =  seq->qual.l > 0 ? 0 : 1;
-    } else {   
-        ret = -1;
+
+    // custom bins, start-end:score seperated by comma, scores not listed are kept
+    for ( i = 0; i < QUAL_BINS_SIZE; ++i )
+        table[i] = i;
+    const char *p = scheme;
+    while ( *p ) {
+        char *e;
+        long start = strtol(p, &e, 10), end, q;
+        if ( e == p || *e != '-' )
+            return -1;
+        p = e + 1;
+        end = strtol(p, &e, 10);
+        if ( e == p || *e != ':' )
+            return -1;
+        p = e + 1;
+        q = strtol(p, &e, 10);
+        if ( e == p || (*e != ',' && *e != '\0') )
+            return -1;
+        if ( start < 0 || end < start || q < 0 || q >= QUAL_BINS_SIZE )
+            return -1;
+        for ( i = start; i <= end && i < QUAL_BINS_SIZE; ++i )
+            table[i] = q;
+        p = *e == ',' ? e + 1 : e;
     }
+    return 0;
+}
+
+void fastq_set_qual_bins(const uint8_t *table)
+{
+    qual_binning = table != NULL;
+    if ( table )
+        memcpy(qual_bins, table, QUAL_BINS_SIZE);
+}
 
-    gzclose(fp);
-    kseq_destroy(seq);
+void fastq_qual_copy(char *dst, const char *src, int l)
+{
+    if ( qual_binning )
+        qual_bin(dst, src, l);
+    else
+        memcpy(dst, src, l);
+}
+
+int fastq_write(BGZF *fp, const struct fastq_record *r, const char *prefix, const char *tag, int l_tag)
+{
+    if ( bgzf_write(fp, r->qual ? "@" : ">", 1) < 0 )
+        return -1;
+    if ( bgzf_write(fp, r->name, r->l_name) < 0 )
+        return -1;
+    if ( prefix && bgzf_write(fp, prefix, strlen(prefix)) < 0 )
+        return -1;
+    if ( tag && bgzf_write(fp, tag, l_tag) < 0 )
+        return -1;
+    if ( bgzf_write(fp, "\n", 1) < 0 )
+        return -1;
+    if ( bgzf_write(fp, r->seq, r->l_seq) < 0 )
+        return -1;
+    if ( r->qual ) {
+        if ( bgzf_write(fp, "\n+\n", 3) < 0 )
+            return -1;
+        if ( qual_binning ) {
+            char buf[256];
+            int i, l;
+            for ( i = 0; i < r->l_seq; i += l ) {
+                l = r->l_seq - i < sizeof(buf) ? r->l_seq - i : sizeof(buf);
+                qual_bin(buf, r->qual + i, l);
+                if ( bgzf_write(fp, buf, l) < 0 )
+                    return -1;
+            }
+        }
+        else if ( bgzf_write(fp, r->qual, r->l_seq) < 0 ) {
+            return -1;
+        }
+    }
+    if ( bgzf_write(fp, "\n", 1) < 0 )
+        return -1;
+    return 0;
+}
+
+int fastq_format(kstring_t *s, const struct fastq_record *r, const char *prefix, const char *tag, int l_tag)
+{
+    kputc(r->qual ? '@' : '>', s);
+    kputsn(r->name, r->l_name, s);
+    if ( prefix )
+        kputs(prefix, s);
+    if ( tag )
+        kputsn(tag, l_tag, s);
+    kputc('\n', s);
+    kputsn(r->seq, r->l_seq, s);
+    if ( r->qual ) {
+        kputsn("\n+\n", 3, s);
+        kputsn(r->qual, r->l_seq, s);
+        if ( qual_binning )
+            qual_bin(s->s + s->l - r->l_seq, s->s + s->l - r->l_seq, r->l_seq);
+    }
+    return kputc('\n', s) < 0 ? -1 : 0;
+}
+
+BGZF *fastq_stdout_open()
+{
+    return bgzf_open("-", "wu");
+}
+
+int fastq_flush(BGZF *fp, kstring_t *s, int force)
+{
+    if ( s->l == 0 || (!force && s->l < FASTQ_FLUSH_SIZE) )
+        return 0;
+    // one write per block, larger than the hFILE buffer so it goes to the pipe directly
+    if ( bgzf_write(fp, s->s, s->l) < 0 )
+        return -1;
+    s->l = 0;
+    return 0;
+}
+
+void fastq_strip_read_number(struct fastq_record *r, char c)
+{
+    if ( r->l_name >= 2 && r->name[r->l_name-2] == '/' && r->name[r->l_name-1] == c )
+        r->l_name -= 2;
+}
+
+int fastq_trim_adaptor(struct fastq_record *r, int i)
+{
+    if ( i == 0 )
+        return 1;
+    if ( i < r->l_seq )
+        r->l_seq = i;
+    return 0;
+}
+
+int check_file_is_fastq(const char *fn)
+{
+    struct fastq_reader *r = fastq_reader_open(fn, NULL);
+    struct fastq_record *rec;
+    int ret;
+    if ( r == NULL ) {
+        error_print("%s : %s", fn, strerror(errno));
+        return -1;
+    }
+    rec = fastq_read(r);
+    ret = rec == NULL ? -1 : rec->qual ? 0 : 1;
+    fastq_reader_close(r);
     return ret;
 }
 
@@ -164,3 +1117,112 @@ int check_acgt(const char *seq, int length)
 
 
     
+
+#ifdef FASTQ_BENCH_MAIN
+// Micro-benchmark of the mismatch kernel against the byte by byte comparison.
+// Usage: fastq_bench [rounds]
+#include <time.h>
+
+static int check_match_bytewise(char *seq1, const char *seq2, int mismatch, int length)
+{
+    int i, m = 0;
+    for ( i = 0; i < length; ++i ) {
+        if ( seq1[i] != seq2[i] ) {
+            m++;
+            if ( m > mismatch )
+                return -1;
+        }
+    }
+    return mismatch;
+}
+
+static int check_match2_bytewise(char *seq1, const char *seq2, int mismatch, int length)
+{
+    int i, m = 0;
+    for ( i = 0; i < length; ++i ) {
+        if ( seq2[i] == 'n' || seq2[i] == 'N')
+            continue;
+        if ( seq1[i] != seq2[i] ) {
+            m++;
+            if ( m > mismatch )
+                return -1;
+        }
+    }
+    return mismatch;
+}
+
+static double bench_seconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+typedef int (*match_func)(char *, const char *, int, int);
+
+static double bench_run(match_func func, char *reads, const char *barcodes, int n_reads, int n_bcs, int l, int rounds, long *hits)
+{
+    double t = bench_seconds();
+    int r, i, j;
+    long h = 0;
+    for ( r = 0; r < rounds; ++r )
+        for ( i = 0; i < n_reads; ++i )
+            for ( j = 0; j < n_bcs; ++j )
+                if ( func(reads + i*l, barcodes + j*l, 1, l) != -1 ) {
+                    h++;
+                    break;
+                }
+    *hits = h;
+    return bench_seconds() - t;
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 10;
+    int lengths[] = { 8, 10, 12, 16, 24 };
+    int n_reads = 10000, n_bcs = 96;
+    int k, i, j;
+    srand(1);
+    fprintf(stdout, "length\tfunction\tbytewise(ns)\tkernel(ns)\tspeedup\n");
+    for ( k = 0; k < sizeof(lengths)/sizeof(int); ++k ) {
+        int l = lengths[k];
+        char *barcodes = (char*)malloc(n_bcs*l);
+        char *reads = (char*)malloc(n_reads*l);
+        for ( i = 0; i < n_bcs*l; ++i )
+            barcodes[i] = "ACGT"[rand()&3];
+        for ( i = 0; i < n_bcs; ++i )
+            if ( i % 8 == 0 ) barcodes[i*l] = 'N';
+        // reads carry a barcode with 0-2 errors, or random sequence
+        for ( i = 0; i < n_reads; ++i ) {
+            char *s = reads + i*l;
+            if ( rand() % 10 ) {
+                memcpy(s, barcodes + (rand()%n_bcs)*l, l);
+                int e = rand()%3;
+                for ( j = 0; j < e; ++j )
+                    s[rand()%l] = "ACGT"[rand()&3];
+                if ( s[0] == 'N' )
+                    s[0] = 'A';
+            }
+            else {
+                for ( j = 0; j < l; ++j )
+                    s[j] = "ACGT"[rand()&3];
+            }
+        }
+        long h1, h2;
+        double calls = (double)rounds*n_reads*n_bcs;
+        double t1 = bench_run(check_match_bytewise, reads, barcodes, n_reads, n_bcs, l, rounds, &h1);
+        double t2 = bench_run(check_match, reads, barcodes, n_reads, n_bcs, l, rounds, &h2);
+        if ( h1 != h2 )
+            error("Inconsistant results of check_match. %ld vs %ld", h1, h2);
+        fprintf(stdout, "%d\tcheck_match\t%.2f\t%.2f\t%.2fx\n", l, t1/calls*1e9, t2/calls*1e9, t1/t2);
+        t1 = bench_run(check_match2_bytewise, reads, barcodes, n_reads, n_bcs, l, rounds, &h1);
+        t2 = bench_run(check_match2, reads, barcodes, n_reads, n_bcs, l, rounds, &h2);
+        if ( h1 != h2 )
+            error("Inconsistant results of check_match2. %ld vs %ld", h1, h2);
+        fprintf(stdout, "%d\tcheck_match2\t%.2f\t%.2f\t%.2fx\n", l, t1/calls*1e9, t2/calls*1e9, t1/t2);
+        free(barcodes);
+        free(reads);
+    }
+    return 0;
+}
+#endif
@@ -3,64 +3,457 @@
 #include "htslib/hts.h"
 #include "htslib/faidx.h"
 #include "sequence.h"
+#include <stdint.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SEQUENCE_SSSE3
+#endif
 
 // Return the location of terminal codon on the sequence.
 // Return -1 if no found.
 int check_stop_codon(char *seq, char *p_end )
 {
-    char *ss = seq;
-    char *se = p_end;
-    int i, l = 0;
-    
-    if ( se == NULL ) {
-        for ( se = ss; se != NULL && *se; ++se, ++l );        
-    }
-
-    l /= 3;
-    
-    for ( i = 0; i < l;  ++i) {
-        if ( codon2aminoid(ss) == C4_Stop ) {
-            return i+1;
-        }
-        ss += 3;
-    }
-    return -1;
+    int l = p_end == NULL ? strlen(seq) : p_end - seq;
+    int i = seq_find_stop(seq, l);
+    return i == -1 ? -1 : i+1;
 }
+static const uint8_t seq_nt4_table[256] = {
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+};
+
 int seq2code4(int seq)
 {
-    static const int seq2num_table[256] = {
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-        4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-    };
-    return seq2num_table[seq];
+    return seq_nt4_table[seq];
 }
 
 char *rev_seqs(const char *dna_seqs, unsigned long n)
 {
     if ( n == 0 )
         return NULL;
-    int i;
-    char *rev = (char*)calloc(n+1, sizeof(char));    
-    for ( i = 0; i < n; ++i) 
-        rev[i] = revseqarr[seq2code4(dna_seqs[n-i-1])];
+    char *rev = (char*)malloc(n+1);
+    seq_revcomp(rev, dna_seqs, n);
     rev[n] = '\0';
     return rev;
 }
 
+/*
+ * Whole buffer kernels. 16 bases are translated at a time by pshufb (SSSE3,
+ * checked at run time), indexed by the low nibble of the character. A second
+ * lookup gives the letter expected for that nibble, so other characters fall
+ * back to N. The scalar loops handle the tails and the CPUs without SSSE3.
+ */
+static const int8_t seq_nt16_comp_table[16] = { 0, 8, 4, 12, 2, 10, 9, 14, 1, 6, 5, 13, 3, 11, 7, 15 };
+
+#ifdef SEQUENCE_SSSE3
+static int has_ssse3()
+{
+    static int ret = -1;
+    if ( ret == -1 )
+        ret = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    return ret;
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i encode_nt4_ssse3(__m128i c)
+{
+    const __m128i code = _mm_setr_epi8(4, 0, 4, 1, 3, 3, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4);
+    const __m128i base = _mm_setr_epi8(0, 'A', 0, 'C', 'T', 'U', 0, 'G', 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i lo = _mm_and_si128(c, _mm_set1_epi8(0x0f));
+    __m128i up = _mm_and_si128(c, _mm_set1_epi8((char)0xdf));
+    __m128i ok = _mm_cmpeq_epi8(up, _mm_shuffle_epi8(base, lo));
+    return _mm_or_si128(_mm_and_si128(ok, _mm_shuffle_epi8(code, lo)), _mm_andnot_si128(ok, _mm_set1_epi8(4)));
+}
+
+// IUPAC codes are split into two tables by bit 4, '0'-'3' and '=' are in the row of 0x30,
+// the same as seq_nt16_table of htslib
+__attribute__((target("ssse3")))
+static inline __m128i encode_nt16_ssse3(__m128i c)
+{
+    const __m128i code0 = _mm_setr_epi8(15, 1, 14, 2, 13, 15, 15, 4, 11, 15, 15, 12, 15, 3, 15, 15);
+    const __m128i code1 = _mm_setr_epi8(15, 15, 5, 6, 8, 15, 7, 9, 15, 10, 15, 15, 15, 15, 15, 15);
+    const __m128i code3 = _mm_setr_epi8(1, 2, 4, 8, 15, 15, 15, 15, 15, 15, 15, 15, 15, 0, 15, 15);
+    __m128i lo = _mm_and_si128(c, _mm_set1_epi8(0x0f));
+    __m128i hi = _mm_cmpeq_epi8(_mm_and_si128(c, _mm_set1_epi8(0x10)), _mm_set1_epi8(0x10));
+    __m128i x = _mm_or_si128(_mm_and_si128(hi, _mm_shuffle_epi8(code1, lo)), _mm_andnot_si128(hi, _mm_shuffle_epi8(code0, lo)));
+    // letters are in 0x40-0x7f
+    __m128i letter = _mm_cmpeq_epi8(_mm_and_si128(c, _mm_set1_epi8((char)0xc0)), _mm_set1_epi8(0x40));
+    __m128i digit = _mm_cmpeq_epi8(_mm_and_si128(c, _mm_set1_epi8((char)0xf0)), _mm_set1_epi8(0x30));
+    x = _mm_or_si128(_mm_and_si128(letter, x), _mm_andnot_si128(letter, _mm_set1_epi8(15)));
+    return _mm_or_si128(_mm_and_si128(digit, _mm_shuffle_epi8(code3, lo)), _mm_andnot_si128(digit, x));
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i reverse_ssse3(__m128i x)
+{
+    return _mm_shuffle_epi8(x, _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i revcomp_ssse3(__m128i c)
+{
+    const __m128i comp = _mm_setr_epi8('T', 'G', 'C', 'A', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N');
+    return reverse_ssse3(_mm_shuffle_epi8(comp, encode_nt4_ssse3(c)));
+}
+
+__attribute__((target("ssse3")))
+static int revcomp_blocks_ssse3(char *dst, const char *src, int l)
+{
+    int i, j;
+    for ( i = 0, j = l; j - i >= 32; i += 16, j -= 16 ) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src+i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src+j-16));
+        _mm_storeu_si128((__m128i*)(dst+i), revcomp_ssse3(b));
+        _mm_storeu_si128((__m128i*)(dst+j-16), revcomp_ssse3(a));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static int revcomp_nt16_blocks_ssse3(uint8_t *s, int l)
+{
+    const __m128i comp = _mm_loadu_si128((const __m128i*)seq_nt16_comp_table);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    int i, j;
+    for ( i = 0, j = l; j - i >= 32; i += 16, j -= 16 ) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s+i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s+j-16));
+        _mm_storeu_si128((__m128i*)(s+i), reverse_ssse3(_mm_shuffle_epi8(comp, _mm_and_si128(b, mask))));
+        _mm_storeu_si128((__m128i*)(s+j-16), reverse_ssse3(_mm_shuffle_epi8(comp, _mm_and_si128(a, mask))));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static int encode_nt4_blocks_ssse3(uint8_t *dst, const char *src, int l)
+{
+    int i;
+    for ( i = 0; i + 16 <= l; i += 16 )
+        _mm_storeu_si128((__m128i*)(dst+i), encode_nt4_ssse3(_mm_loadu_si128((const __m128i*)(src+i))));
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static int encode_nt16_blocks_ssse3(uint8_t *dst, const char *src, int l)
+{
+    int i;
+    for ( i = 0; i + 16 <= l; i += 16 )
+        _mm_storeu_si128((__m128i*)(dst+i), encode_nt16_ssse3(_mm_loadu_si128((const __m128i*)(src+i))));
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static int decode_blocks_ssse3(char *dst, const uint8_t *src, int l, const char *table, int max)
+{
+    const __m128i t = _mm_loadu_si128((const __m128i*)table);
+    const __m128i m = _mm_set1_epi8(max);
+    int i;
+    for ( i = 0; i + 16 <= l; i += 16 ) {
+        __m128i x = _mm_min_epu8(_mm_loadu_si128((const __m128i*)(src+i)), m);
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_shuffle_epi8(t, x));
+    }
+    return i;
+}
+#endif
+
+void seq_revcomp(char *dst, const char *src, int l)
+{
+    int i = 0, j;
+#ifdef SEQUENCE_SSSE3
+    if ( l >= 32 && has_ssse3() )
+        i = revcomp_blocks_ssse3(dst, src, l);
+#endif
+    // both ends are swapped, so it works in place
+    for ( j = l - i; j - i >= 2; ++i, --j ) {
+        char c = revseqarr[seq_nt4_table[(uint8_t)src[i]]];
+        dst[i] = revseqarr[seq_nt4_table[(uint8_t)src[j-1]]];
+        dst[j-1] = c;
+    }
+    if ( j - i == 1 )
+        dst[i] = revseqarr[seq_nt4_table[(uint8_t)src[i]]];
+}
+
+void seq_revcomp_nt16(uint8_t *seq, int l)
+{
+    int i = 0, j;
+#ifdef SEQUENCE_SSSE3
+    if ( l >= 32 && has_ssse3() )
+        i = revcomp_nt16_blocks_ssse3(seq, l);
+#endif
+    for ( j = l - i; j - i >= 2; ++i, --j ) {
+        uint8_t c = seq_nt16_comp_table[seq[i] & 15];
+        seq[i] = seq_nt16_comp_table[seq[j-1] & 15];
+        seq[j-1] = c;
+    }
+    if ( j - i == 1 )
+        seq[i] = seq_nt16_comp_table[seq[i] & 15];
+}
+
+void seq_encode_nt4(uint8_t *dst, const char *src, int l)
+{
+    int i = 0;
+#ifdef SEQUENCE_SSSE3
+    if ( l >= 16 && has_ssse3() )
+        i = encode_nt4_blocks_ssse3(dst, src, l);
+#endif
+    for ( ; i < l; ++i )
+        dst[i] = seq_nt4_table[(uint8_t)src[i]];
+}
+
+void seq_encode_nt16(uint8_t *dst, const char *src, int l)
+{
+    int i = 0;
+#ifdef SEQUENCE_SSSE3
+    if ( l >= 16 && has_ssse3() )
+        i = encode_nt16_blocks_ssse3(dst, src, l);
+#endif
+    for ( ; i < l; ++i )
+        dst[i] = seq_nt16_table[(uint8_t)src[i]];
+}
+
+// codes larger than 4 are decoded as N
+void seq_decode_nt4(char *dst, const uint8_t *src, int l)
+{
+    int i = 0;
+#ifdef SEQUENCE_SSSE3
+    if ( l >= 16 && has_ssse3() )
+        i = decode_blocks_ssse3(dst, src, l, "ACGTNNNNNNNNNNNN", 4);
+#endif
+    for ( ; i < l; ++i )
+        dst[i] = seqarr[src[i] < 4 ? src[i] : 4];
+}
+
+void seq_decode_nt16(char *dst, const uint8_t *src, int l)
+{
+    int i = 0;
+#ifdef SEQUENCE_SSSE3
+    if ( l >= 16 && has_ssse3() )
+        i = decode_blocks_ssse3(dst, src, l, seq_nt16_str, 15);
+#endif
+    for ( ; i < l; ++i )
+        dst[i] = seq_nt16_str[src[i] < 15 ? src[i] : 15];
+}
+
+/*
+ * Translation. Bases are encoded to 2 bits once, the codon starting at every base is
+ * indexed by c0<<4|c1<<2|c2 and looked up in a 64 entries table, by 4 pshufb of 16
+ * entries selected by the top 2 bits. 48 bases give 16 codons of each forward frame,
+ * which are split from each other by pshufb again. The reverse frames are translated
+ * from the reverse complement of the codes. Codes larger than 3 make the codon unknown.
+ */
+static const uint8_t codon_table[64] = {
+    C4_Lys, C4_Asn, C4_Lys, C4_Asn, C4_Thr, C4_Thr, C4_Thr, C4_Thr,
+    C4_Arg, C4_Ser, C4_Arg, C4_Ser, C4_Ile, C4_Ile, C4_Met, C4_Ile,
+    C4_Gln, C4_His, C4_Gln, C4_His, C4_Pro, C4_Pro, C4_Pro, C4_Pro,
+    C4_Arg, C4_Arg, C4_Arg, C4_Arg, C4_Leu, C4_Leu, C4_Leu, C4_Leu,
+    C4_Glu, C4_Asp, C4_Glu, C4_Asp, C4_Ala, C4_Ala, C4_Ala, C4_Ala,
+    C4_Gly, C4_Gly, C4_Gly, C4_Gly, C4_Val, C4_Val, C4_Val, C4_Val,
+    C4_Stop, C4_Tyr, C4_Stop, C4_Tyr, C4_Ser, C4_Ser, C4_Ser, C4_Ser,
+    C4_Stop, C4_Cys, C4_Trp, C4_Cys, C4_Leu, C4_Phe, C4_Leu, C4_Phe,
+};
+
+// TAA, TAG and TGA
+#define CODON_IS_STOP(x) ((x) == 48 || (x) == 50 || (x) == 56)
+// bases checked for stop codons at a time, a multiple of 48
+#define STOP_CHUNK 1008
+
+// -1 for unknown codons
+static inline int codon_index(const uint8_t *c)
+{
+    if ( (c[0] | c[1] | c[2]) > 3 )
+        return -1;
+    return c[0]<<4 | c[1]<<2 | c[2];
+}
+
+#ifdef SEQUENCE_SSSE3
+// byte k of the frame f comes from the codon 3k+f, in the block j of 16 codons
+#define FRAME_BYTE(f, j, k) (3*(k)+(f)-16*(j) >= 0 && 3*(k)+(f)-16*(j) < 16 ? 3*(k)+(f)-16*(j) : -128)
+#define FRAME_SHUFFLE(f, j) _mm_setr_epi8(                                   \
+        FRAME_BYTE(f,j,0), FRAME_BYTE(f,j,1), FRAME_BYTE(f,j,2), FRAME_BYTE(f,j,3),     \
+        FRAME_BYTE(f,j,4), FRAME_BYTE(f,j,5), FRAME_BYTE(f,j,6), FRAME_BYTE(f,j,7),     \
+        FRAME_BYTE(f,j,8), FRAME_BYTE(f,j,9), FRAME_BYTE(f,j,10), FRAME_BYTE(f,j,11),   \
+        FRAME_BYTE(f,j,12), FRAME_BYTE(f,j,13), FRAME_BYTE(f,j,14), FRAME_BYTE(f,j,15))
+
+// indices of the 16 codons starting at c, 0xff for unknown codons. 18 codes are read
+__attribute__((target("ssse3")))
+static inline __m128i codon_index_ssse3(const uint8_t *c)
+{
+    __m128i a = _mm_loadu_si128((const __m128i*)c);
+    __m128i b = _mm_loadu_si128((const __m128i*)(c+1));
+    __m128i d = _mm_loadu_si128((const __m128i*)(c+2));
+    // codes are smaller than 8, so the 16 bits shifts never cross bytes
+    __m128i x = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(a, 4), _mm_slli_epi16(b, 2)), d);
+    __m128i bad = _mm_cmpgt_epi8(_mm_or_si128(_mm_or_si128(a, b), d), _mm_set1_epi8(3));
+    return _mm_or_si128(x, bad);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i codon_lookup_ssse3(__m128i x)
+{
+    __m128i lo = _mm_and_si128(x, _mm_set1_epi8(0x0f));
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi8(0x0f));
+    __m128i r = _mm_set1_epi8(C4_Unknown);
+    int k;
+    for ( k = 0; k < 4; ++k ) {
+        __m128i t = _mm_loadu_si128((const __m128i*)(codon_table + 16*k));
+        __m128i sel = _mm_cmpeq_epi8(hi, _mm_set1_epi8(k));
+        r = _mm_or_si128(_mm_and_si128(sel, _mm_shuffle_epi8(t, lo)), _mm_andnot_si128(sel, r));
+    }
+    return r;
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i frame_ssse3(__m128i x0, __m128i x1, __m128i x2, __m128i s0, __m128i s1, __m128i s2)
+{
+    return _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(x0, s0), _mm_shuffle_epi8(x1, s1)), _mm_shuffle_epi8(x2, s2));
+}
+
+__attribute__((target("ssse3")))
+static int translate_blocks_ssse3(const uint8_t *c, int l, uint8_t **aa)
+{
+    int i;
+    for ( i = 0; i + 50 <= l; i += 48 ) {
+        __m128i x0 = codon_lookup_ssse3(codon_index_ssse3(c+i));
+        __m128i x1 = codon_lookup_ssse3(codon_index_ssse3(c+i+16));
+        __m128i x2 = codon_lookup_ssse3(codon_index_ssse3(c+i+32));
+        if ( aa[0] )
+            _mm_storeu_si128((__m128i*)(aa[0]+i/3), frame_ssse3(x0, x1, x2, FRAME_SHUFFLE(0,0), FRAME_SHUFFLE(0,1), FRAME_SHUFFLE(0,2)));
+        if ( aa[1] )
+            _mm_storeu_si128((__m128i*)(aa[1]+i/3), frame_ssse3(x0, x1, x2, FRAME_SHUFFLE(1,0), FRAME_SHUFFLE(1,1), FRAME_SHUFFLE(1,2)));
+        if ( aa[2] )
+            _mm_storeu_si128((__m128i*)(aa[2]+i/3), frame_ssse3(x0, x1, x2, FRAME_SHUFFLE(2,0), FRAME_SHUFFLE(2,1), FRAME_SHUFFLE(2,2)));
+    }
+    return i;
+}
+
+// stop codons of frame 0, the codon index is returned in hit, -1 if no found
+__attribute__((target("ssse3")))
+static int find_stop_blocks_ssse3(const uint8_t *c, int l, int *hit)
+{
+    int i, j;
+    for ( i = 0; i + 50 <= l; i += 48 ) {
+        uint64_t m = 0;
+        for ( j = 0; j < 3; ++j ) {
+            __m128i x = codon_index_ssse3(c+i+16*j);
+            __m128i s = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(48)), _mm_cmpeq_epi8(x, _mm_set1_epi8(50)));
+            s = _mm_or_si128(s, _mm_cmpeq_epi8(x, _mm_set1_epi8(56)));
+            m |= (uint64_t)_mm_movemask_epi8(s) << 16*j;
+        }
+        // every third base starts a codon of frame 0
+        m &= 0x249249249249ULL;
+        if ( m ) {
+            *hit = (i + __builtin_ctzll(m))/3;
+            return i;
+        }
+    }
+    *hit = -1;
+    return i;
+}
+
+// N (4) is complemented to 7, which is still unknown
+__attribute__((target("ssse3")))
+static int revcomp_codes_blocks_ssse3(uint8_t *dst, const uint8_t *src, int l)
+{
+    int i;
+    for ( i = 0; i + 16 <= l; i += 16 ) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src+l-i-16));
+        _mm_storeu_si128((__m128i*)(dst+i), reverse_ssse3(_mm_xor_si128(x, _mm_set1_epi8(3))));
+    }
+    return i;
+}
+#endif
+
+// the forward frames of 2 bits codes, frames with NULL aa are skipped
+static void translate_frames(const uint8_t *c, int l, uint8_t **aa, int *n)
+{
+    int i = 0, f, k;
+#ifdef SEQUENCE_SSSE3
+    if ( l >= 50 && has_ssse3() )
+        i = translate_blocks_ssse3(c, l, aa);
+#endif
+    for ( f = 0; f < 3; ++f ) {
+        n[f] = l > f ? (l-f)/3 : 0;
+        if ( aa[f] == NULL )
+            continue;
+        for ( k = i/3; k < n[f]; ++k ) {
+            int x = codon_index(c+3*k+f);
+            aa[f][k] = x == -1 ? C4_Unknown : codon_table[x];
+        }
+    }
+}
+
+void seq_translate6(const char *seq, int l, uint8_t *aa[6], int n[6])
+{
+    uint8_t buf[1024];
+    uint8_t *c = l*2 <= sizeof(buf) ? buf : (uint8_t*)malloc(l*2);
+    uint8_t *r = c + l;
+    int i = 0;
+    seq_encode_nt4(c, seq, l);
+    translate_frames(c, l, aa, n);
+#ifdef SEQUENCE_SSSE3
+    if ( l >= 16 && has_ssse3() )
+        i = revcomp_codes_blocks_ssse3(r, c, l);
+#endif
+    for ( ; i < l; ++i )
+        r[i] = c[l-1-i] ^ 3;
+    translate_frames(r, l, aa+3, n+3);
+    if ( c != buf )
+        free(c);
+}
+
+int seq_translate(uint8_t *aa, const char *seq, int l)
+{
+    uint8_t buf[1024];
+    uint8_t *c = l <= sizeof(buf) ? buf : (uint8_t*)malloc(l);
+    uint8_t *frames[3] = { aa, NULL, NULL };
+    int n[3];
+    seq_encode_nt4(c, seq, l);
+    translate_frames(c, l, frames, n);
+    if ( c != buf )
+        free(c);
+    return n[0];
+}
+
+int seq_find_stop(const char *seq, int l)
+{
+    // the codons across chunks are read from the 2 extra bases
+    uint8_t c[STOP_CHUNK+2];
+    int i, j, x;
+    for ( i = 0; i + 3 <= l; i += STOP_CHUNK ) {
+        int n = l - i < STOP_CHUNK + 2 ? l - i : STOP_CHUNK + 2;
+        seq_encode_nt4(c, seq+i, n);
+        j = 0;
+#ifdef SEQUENCE_SSSE3
+        if ( n >= 50 && has_ssse3() ) {
+            int hit;
+            j = find_stop_blocks_ssse3(c, n, &hit);
+            if ( hit != -1 )
+                return i/3 + hit;
+        }
+#endif
+        for ( ; j + 3 <= n && j < STOP_CHUNK; j += 3 ) {
+            x = codon_index(c+j);
+            if ( CODON_IS_STOP(x) )
+                return (i+j)/3;
+        }
+    }
+    return -1;
+}
+
 // define_var_type return the variant type from the transcript block and variants
 // only account exon region
 // start is 0 based position aligned on the block
@@ -96,16 +489,20 @@ enum var_type check_var_type(char *block, int block_length, int start, char *ref
     
     // snv
     if ( ref_length == 1 ) {
-        char codon[4];
-        codon[3] = '\0';
-        memcpy(codon, block + start/3*3, 3);
-        if ( codon[start%3] == *alt )
+        uint8_t codon[3];
+        int i, x;
+        if ( block[start] == *alt )
             return var_is_reference;
-        
+        for ( i = 0; i < 3; ++i )
+            codon[i] = seq_nt4_table[(uint8_t)block[start/3*3+i]];
+        x = codon_index(codon);
+        codon[start%3] = seq_nt4_table[(uint8_t)*alt];
         int amino_ref, amino_alt;
-        amino_ref = codon2aminoid(codon);
-        codon[start%3] = *alt;
-        amino_alt = codon2aminoid(codon);
+        amino_ref = x == -1 ? C4_Unknown : codon_table[x];
+        x = codon_index(codon);
+        amino_alt = x == -1 ? C4_Unknown : codon_table[x];
+        if ( amino_ref == C4_Unknown || amino_alt == C4_Unknown )
+            return var_is_unknown;
         if ( amino_ref == 0 ) {
             if ( amino_alt == 0 )
                 return var_is_stop_retained;
@@ -132,4 +529,235 @@ enum var_type check_var_type(char *block, int block_length, int start, char *ref
 
 
 
+#endif
+
+#ifdef SEQUENCE_BENCH_MAIN
+// Benchmark of the whole buffer kernels against the per base table lookups they replace.
+// Usage: sequence_bench [rounds]
+#include <time.h>
+
+static void revcomp_scalar(char *dst, const char *src, int l)
+{
+    int i;
+    for ( i = 0; i < l; ++i )
+        dst[i] = revseqarr[seq2code4(src[l-i-1])];
+}
+
+static void revcomp_nt16_scalar(uint8_t *seq, int l)
+{
+    int i;
+    for ( i = 0; i < l>>1; ++i ) {
+        int8_t t = seq_nt16_comp_table[seq[l - 1 - i]];
+        seq[l - 1 - i] = seq_nt16_comp_table[seq[i]];
+        seq[i] = t;
+    }
+    if ( l & 1 )
+        seq[i] = seq_nt16_comp_table[seq[i]];
+}
+
+static void encode_nt4_scalar(uint8_t *dst, const char *src, int l)
+{
+    int i;
+    for ( i = 0; i < l; ++i )
+        dst[i] = seq2code4(src[i]);
+}
+
+static void encode_nt16_scalar(uint8_t *dst, const char *src, int l)
+{
+    int i;
+    for ( i = 0; i < l; ++i )
+        dst[i] = seq_nt16_table[(uint8_t)src[i]];
+}
+
+static void decode_nt4_scalar(char *dst, const uint8_t *src, int l)
+{
+    int i;
+    for ( i = 0; i < l; ++i )
+        dst[i] = seqarr[src[i] < 4 ? src[i] : 4];
+}
+
+static void decode_nt16_scalar(char *dst, const uint8_t *src, int l)
+{
+    int i;
+    for ( i = 0; i < l; ++i )
+        dst[i] = seq_nt16_str[src[i] & 15];
+}
+
+// codon by codon, as codon2aminoid() but codons with N are unknown
+static int translate_scalar(uint8_t *aa, const char *seq, int l)
+{
+    int k;
+    for ( k = 0; k*3+3 <= l; ++k ) {
+        int a = seq2code4(seq[k*3]), b = seq2code4(seq[k*3+1]), c = seq2code4(seq[k*3+2]);
+        aa[k] = a > 3 || b > 3 || c > 3 ? C4_Unknown : codon_matrix[a][b][c];
+    }
+    return k;
+}
+
+static void translate6_scalar(const char *seq, int l, uint8_t *aa[6], int n[6])
+{
+    char *rev = (char*)malloc(l);
+    int f;
+    revcomp_scalar(rev, seq, l);
+    for ( f = 0; f < 3; ++f ) {
+        n[f] = l > f ? translate_scalar(aa[f], seq+f, l-f) : 0;
+        n[f+3] = l > f ? translate_scalar(aa[f+3], rev+f, l-f) : 0;
+    }
+    free(rev);
+}
+
+static int find_stop_scalar(const char *seq, int l)
+{
+    int k;
+    for ( k = 0; k*3+3 <= l; ++k ) {
+        int a = seq2code4(seq[k*3]), b = seq2code4(seq[k*3+1]), c = seq2code4(seq[k*3+2]);
+        if ( a < 4 && b < 4 && c < 4 && codon_matrix[a][b][c] == C4_Stop )
+            return k;
+    }
+    return -1;
+}
+
+static double bench_seconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+#define N_SEQS 10000
+
+int main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 20;
+    int lengths[] = { 8, 36, 100, 150, 1000 };
+    const char *alphabet = "ACGTACGTACGTacgtNnURYMKSW=.-*0123";
+    int l_alpha = strlen(alphabet);
+    int k, i, r, failed = 0;
+    srand(1);
+    fprintf(stdout, "length\tfunction\tscalar(ns/base)\tkernel(ns/base)\tspeedup\n");
+    for ( k = 0; k < sizeof(lengths)/sizeof(int); ++k ) {
+        int l = lengths[k];
+        long n = (long)N_SEQS*l;
+        char *seqs = (char*)malloc(n);
+        char *out1 = (char*)malloc(n);
+        char *out2 = (char*)malloc(n);
+        uint8_t *codes = (uint8_t*)malloc(n);
+        uint8_t *c1 = (uint8_t*)malloc(n);
+        uint8_t *c2 = (uint8_t*)malloc(n);
+        // touch the pages before timing
+        memset(out1, 0, n); memset(out2, 0, n);
+        memset(c1, 0, n); memset(c2, 0, n);
+        for ( i = 0; i < n; ++i ) {
+            seqs[i] = alphabet[rand()%l_alpha];
+            codes[i] = rand()%16;
+        }
+        int f;
+        for ( f = 0; f < 6; ++f ) {
+            double t0 = 0, t1 = 0, t;
+            for ( r = 0; r < rounds; ++r ) {
+                t = bench_seconds();
+                for ( i = 0; i < N_SEQS; ++i ) {
+                    switch ( f ) {
+                        case 0: revcomp_scalar(out1 + i*l, seqs + i*l, l); break;
+                        case 1: memcpy(c1 + i*l, codes + i*l, l); revcomp_nt16_scalar(c1 + i*l, l); break;
+                        case 2: encode_nt4_scalar(c1 + i*l, seqs + i*l, l); break;
+                        case 3: encode_nt16_scalar(c1 + i*l, seqs + i*l, l); break;
+                        case 4: decode_nt4_scalar(out1 + i*l, codes + i*l, l); break;
+                        case 5: decode_nt16_scalar(out1 + i*l, codes + i*l, l); break;
+                    }
+                }
+                t0 += bench_seconds() - t;
+                t = bench_seconds();
+                for ( i = 0; i < N_SEQS; ++i ) {
+                    switch ( f ) {
+                        case 0: seq_revcomp(out2 + i*l, seqs + i*l, l); break;
+                        case 1: memcpy(c2 + i*l, codes + i*l, l); seq_revcomp_nt16(c2 + i*l, l); break;
+                        case 2: seq_encode_nt4(c2 + i*l, seqs + i*l, l); break;
+                        case 3: seq_encode_nt16(c2 + i*l, seqs + i*l, l); break;
+                        case 4: seq_decode_nt4(out2 + i*l, codes + i*l, l); break;
+                        case 5: seq_decode_nt16(out2 + i*l, codes + i*l, l); break;
+                    }
+                }
+                t1 += bench_seconds() - t;
+            }
+            static const char *names[] = { "revcomp", "revcomp_nt16", "encode_nt4", "encode_nt16", "decode_nt4", "decode_nt16" };
+            int diff = f == 1 || f == 2 || f == 3 ? memcmp(c1, c2, n) : memcmp(out1, out2, n);
+            if ( diff ) {
+                fprintf(stderr, "%s results are different at length %d.\n", names[f], l);
+                failed = 1;
+            }
+            // the in place version
+            if ( f == 0 ) {
+                memcpy(out2, seqs, n);
+                for ( i = 0; i < N_SEQS; ++i )
+                    seq_revcomp(out2 + i*l, out2 + i*l, l);
+                if ( memcmp(out1, out2, n) ) {
+                    fprintf(stderr, "In place revcomp results are different at length %d.\n", l);
+                    failed = 1;
+                }
+            }
+            fprintf(stdout, "%d\t%s\t%.3f\t%.3f\t%.2fx\n", l, names[f], t0*1e9/n/rounds, t1*1e9/n/rounds, t0/t1);
+        }
+        free(seqs); free(out1); free(out2); free(codes); free(c1); free(c2);
+    }
+
+    // translation of transcripts, mostly ACGT. stops in frame 0 are rare, as in open reading frames
+    fprintf(stdout, "length\tfunction\tscalar(ns/base)\tkernel(ns/base)\tspeedup\n");
+    int tlengths[] = { 100, 1500, 10000 };
+    for ( k = 0; k < sizeof(tlengths)/sizeof(int); ++k ) {
+        int l = tlengths[k], f, n_seqs = N_SEQS/10;
+        long n = (long)n_seqs*l;
+        char *seqs = (char*)malloc(n);
+        uint8_t *aa1[6], *aa2[6];
+        int n1[6], n2[6], *stop1 = (int*)malloc(n_seqs*sizeof(int)), *stop2 = (int*)malloc(n_seqs*sizeof(int));
+        for ( f = 0; f < 6; ++f ) {
+            aa1[f] = (uint8_t*)calloc(l/3+1, 1);
+            aa2[f] = (uint8_t*)calloc(l/3+1, 1);
+        }
+        for ( i = 0; i < n; ++i ) {
+            seqs[i] = rand()%1000 ? "ACGT"[rand()&3] : alphabet[rand()%l_alpha];
+            // TAA, TAG or TGA
+            if ( i%3 == 2 && seqs[i-2] == 'T' && ((seqs[i-1] == 'A' && (seqs[i] == 'A' || seqs[i] == 'G')) || (seqs[i-1] == 'G' && seqs[i] == 'A')) && rand()%100 )
+                seqs[i] = 'C';
+        }
+        double t0 = 0, t1 = 0, t2 = 0, t3 = 0, t;
+        for ( r = 0; r < rounds; ++r ) {
+            for ( i = 0; i < n_seqs; ++i ) {
+                t = bench_seconds();
+                translate6_scalar(seqs + (long)i*l, l, aa1, n1);
+                t0 += bench_seconds() - t;
+                t = bench_seconds();
+                seq_translate6(seqs + (long)i*l, l, aa2, n2);
+                t1 += bench_seconds() - t;
+                for ( f = 0; f < 6; ++f ) {
+                    if ( n1[f] != n2[f] || memcmp(aa1[f], aa2[f], n1[f]) ) {
+                        fprintf(stderr, "translate6 results are different at length %d, frame %d.\n", l, f);
+                        failed = 1;
+                        break;
+                    }
+                }
+            }
+            t = bench_seconds();
+            for ( i = 0; i < n_seqs; ++i )
+                stop1[i] = find_stop_scalar(seqs + (long)i*l, l);
+            t2 += bench_seconds() - t;
+            t = bench_seconds();
+            for ( i = 0; i < n_seqs; ++i )
+                stop2[i] = seq_find_stop(seqs + (long)i*l, l);
+            t3 += bench_seconds() - t;
+            if ( memcmp(stop1, stop2, n_seqs*sizeof(int)) ) {
+                fprintf(stderr, "find_stop results are different at length %d.\n", l);
+                failed = 1;
+            }
+        }
+        fprintf(stdout, "%d\ttranslate6\t%.3f\t%.3f\t%.2fx\n", l, t0*1e9/n/rounds, t1*1e9/n/rounds, t0/t1);
+        fprintf(stdout, "%d\tfind_stop\t%.3f\t%.3f\t%.2fx\n", l, t2*1e9/n/rounds, t3*1e9/n/rounds, t2/t3);
+        for ( f = 0; f < 6; ++f ) {
+            free(aa1[f]);
+            free(aa2[f]);
+        }
+        free(seqs); free(stop1); free(stop2);
+    }
+    return failed;
+}
 #endif
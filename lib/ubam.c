@@ -0,0 +1,120 @@
+#include "utils.h"
+#include <string.h>
+#include "htslib/sam.h"
+#include "htslib/hts.h"
+#include "ubam.h"
+#include "pkg_version.h"
+
+struct ubam {
+    samFile *fp;
+    bam_hdr_t *hdr;
+    bam1_t *b;
+    kstring_t tag;
+};
+
+struct ubam *ubam_open(const char *fn, hts_tpool *pool)
+{
+    samFile *fp = sam_open(fn, "wb");
+    if ( fp == NULL )
+        return NULL;
+
+    if ( pool ) {
+        htsThreadPool p = { pool, 0 };
+        if ( hts_set_opt(fp, HTS_OPT_THREAD_POOL, &p) ) {
+            sam_close(fp);
+            return NULL;
+        }
+    }
+
+    struct ubam *u = (struct ubam*)malloc(sizeof(struct ubam));
+    kstring_t text = {0, 0, 0};
+    ksprintf(&text, "@HD\tVN:1.5\tSO:unsorted\n@PG\tID:small_projects\tVN:%s\n", PROJECTS_VERSION);
+    u->fp = fp;
+    u->hdr = sam_hdr_parse(text.l, text.s);
+    u->hdr->l_text = text.l;
+    u->hdr->text = text.s;
+    u->b = bam_init1();
+    memset(&u->tag, 0, sizeof(kstring_t));
+    if ( sam_hdr_write(u->fp, u->hdr) ) {
+        ubam_close(u);
+        return NULL;
+    }
+    return u;
+}
+
+// strings in the read buffer are not NUL terminated
+static int append_tag(struct ubam *u, const char tag[2], const char *s, int l)
+{
+    u->tag.l = 0;
+    kputsn(s, l, &u->tag);
+    return bam_aux_append(u->b, tag, 'Z', l + 1, (uint8_t*)u->tag.s);
+}
+
+int ubam_write(struct ubam *u, const struct fastq_record *r, int read, const char *rx, int l_rx, const char *bc, int l_bc)
+{
+    bam1_t *b = u->b;
+    bam1_core_t *c = &b->core;
+    // the read name is padded by NULs, so the following fields are 4-byte aligned
+    int l_qname = r->l_name + 1;
+    int l_extranul = (4 - (l_qname & 3)) & 3;
+    int l_data = l_qname + l_extranul + ((r->l_seq+1)>>1) + r->l_seq;
+    int i;
+
+    if ( l_qname + l_extranul > 255 ) {
+        error_print("Read name is too long. %s", r->name);
+        return -1;
+    }
+    memset(c, 0, sizeof(bam1_core_t));
+    c->tid = c->mtid = -1;
+    c->pos = c->mpos = -1;
+    c->bin = 4680; // hts_reg2bin(-1, 0, 14, 5)
+    c->l_qname = l_qname + l_extranul;
+    c->l_extranul = l_extranul;
+    c->l_qseq = r->l_seq;
+    c->flag = BAM_FUNMAP;
+    if ( read )
+        c->flag |= BAM_FPAIRED | BAM_FMUNMAP | (read == 1 ? BAM_FREAD1 : BAM_FREAD2);
+
+    if ( b->m_data < l_data ) {
+        b->m_data = l_data;
+        kroundup32(b->m_data);
+        b->data = (uint8_t*)realloc(b->data, b->m_data);
+    }
+    b->l_data = l_data;
+
+    uint8_t *p = b->data;
+    memcpy(p, r->name, r->l_name);
+    memset(p + r->l_name, 0, 1 + l_extranul);
+    p += c->l_qname;
+    for ( i = 0; i < r->l_seq; i += 2 ) {
+        uint8_t x = seq_nt16_table[(uint8_t)r->seq[i]] << 4;
+        if ( i + 1 < r->l_seq )
+            x |= seq_nt16_table[(uint8_t)r->seq[i+1]];
+        *p++ = x;
+    }
+    if ( r->qual ) {
+        fastq_qual_copy((char*)p, r->qual, r->l_seq);
+        for ( i = 0; i < r->l_seq; ++i )
+            *p++ -= 33;
+    }
+    else {
+        memset(p, 0xff, r->l_seq);
+    }
+
+    if ( (rx && l_rx > 0 && append_tag(u, "RX", rx, l_rx)) ||
+         (bc && l_bc > 0 && append_tag(u, "BC", bc, l_bc)) ) {
+        error_print("Failed to add tags. %s", r->name);
+        return -1;
+    }
+    return sam_write1(u->fp, u->hdr, b) < 0 ? -1 : 0;
+}
+
+int ubam_close(struct ubam *u)
+{
+    int ret = sam_close(u->fp);
+    bam_hdr_destroy(u->hdr);
+    bam_destroy1(u->b);
+    free(u->tag.s);
+    free(u);
+    return ret;
+}
@@ -0,0 +1,271 @@
+#include "utils.h"
+#include <string.h>
+#include <limits.h>
+#include "htslib/kstring.h"
+#include "htslib/ksort.h"
+#include "umi_cluster.h"
+
+// a packed UMI with one base masked
+struct umi_key {
+    uint64_t masked;
+    int l;
+    int idx;
+};
+
+#define umi_key_lt(a, b) ((a).l < (b).l || ((a).l == (b).l && (a).masked < (b).masked))
+KSORT_INIT(umi_key, struct umi_key, umi_key_lt)
+KSORT_INIT_GENERIC(uint64_t)
+
+struct umi_cluster {
+    int m;              // UMIs
+    uint64_t *packed;
+    int *l;             // length of packed UMIs, 0 for the others
+    struct umi_key *keys;
+    int *offsets;       // edges of UMI i are edges[offsets[i]] to edges[offsets[i+1]-1]
+    int *queue;
+    int n_edges, m_edges;
+    uint64_t *edges;    // source << 32 | target, then sorted
+    uint64_t *order;    // UMIs by counts, descending
+};
+
+struct umi_cluster *umi_cluster_init()
+{
+    struct umi_cluster *uc = (struct umi_cluster*)calloc(1, sizeof(struct umi_cluster));
+    return uc;
+}
+
+void umi_cluster_destroy(struct umi_cluster *uc)
+{
+    free(uc->packed);
+    free(uc->l);
+    free(uc->keys);
+    free(uc->offsets);
+    free(uc->queue);
+    free(uc->edges);
+    free(uc->order);
+    free(uc);
+}
+
+static void umi_cluster_resize(struct umi_cluster *uc, int n)
+{
+    if ( n <= uc->m )
+        return;
+    uc->m = n;
+    kroundup32(uc->m);
+    uc->packed = (uint64_t*)realloc(uc->packed, uc->m*sizeof(uint64_t));
+    uc->l = (int*)realloc(uc->l, uc->m*sizeof(int));
+    uc->keys = (struct umi_key*)realloc(uc->keys, uc->m*sizeof(struct umi_key));
+    uc->offsets = (int*)realloc(uc->offsets, (uc->m+1)*sizeof(int));
+    uc->queue = (int*)realloc(uc->queue, uc->m*sizeof(int));
+    uc->order = (uint64_t*)realloc(uc->order, uc->m*sizeof(uint64_t));
+}
+
+// 2 bits per base, return 0 if the UMI could not be packed
+static int umi_pack(const char *s, uint64_t *packed)
+{
+    uint64_t x = 0;
+    int i;
+    for ( i = 0; s[i]; ++i ) {
+        if ( i == UMI_MAX_PACKED )
+            return 0;
+        switch ( s[i] ) {
+            case 'A': x = x << 2; break;
+            case 'C': x = x << 2 | 1; break;
+            case 'G': x = x << 2 | 2; break;
+            case 'T': x = x << 2 | 3; break;
+            default: return 0;
+        }
+    }
+    *packed = x;
+    return i;
+}
+
+static inline void umi_edge_push(struct umi_cluster *uc, int a, int b, const int *counts)
+{
+    // a absorbs b
+    if ( counts[a] < 2*counts[b] - 1 )
+        return;
+    if ( uc->n_edges == uc->m_edges ) {
+        uc->m_edges = uc->m_edges == 0 ? 64 : uc->m_edges << 1;
+        uc->edges = (uint64_t*)realloc(uc->edges, uc->m_edges*sizeof(uint64_t));
+    }
+    uc->edges[uc->n_edges++] = (uint64_t)a << 32 | (uint32_t)b;
+}
+
+int umi_cluster_directional(struct umi_cluster *uc, int n, char *const *umis, const int *counts, int *cluster)
+{
+    int i, j, k, p, max_l = 0, n_clusters = 0;
+    umi_cluster_resize(uc, n);
+    for ( i = 0; i < n; ++i ) {
+        uc->l[i] = umi_pack(umis[i], &uc->packed[i]);
+        if ( uc->l[i] > max_l )
+            max_l = uc->l[i];
+    }
+
+    // UMIs one base apart share the key with this base masked, at most 4 UMIs a key
+    uc->n_edges = 0;
+    for ( p = 0; p < max_l; ++p ) {
+        int n_keys = 0;
+        for ( i = 0; i < n; ++i ) {
+            if ( uc->l[i] <= p )
+                continue;
+            struct umi_key *key = &uc->keys[n_keys++];
+            key->masked = uc->packed[i] & ~(3ULL << 2*(uc->l[i] - 1 - p));
+            key->l = uc->l[i];
+            key->idx = i;
+        }
+        ks_introsort(umi_key, n_keys, uc->keys);
+        for ( i = 0; i < n_keys; i = j ) {
+            for ( j = i + 1; j < n_keys && uc->keys[j].l == uc->keys[i].l && uc->keys[j].masked == uc->keys[i].masked; ++j );
+            for ( k = i; k < j; ++k ) {
+                int q;
+                for ( q = k + 1; q < j; ++q ) {
+                    umi_edge_push(uc, uc->keys[k].idx, uc->keys[q].idx, counts);
+                    umi_edge_push(uc, uc->keys[q].idx, uc->keys[k].idx, counts);
+                }
+            }
+        }
+    }
+    ks_introsort(uint64_t, uc->n_edges, uc->edges);
+    for ( i = 0, j = 0; i <= n; ++i ) {
+        for ( ; j < uc->n_edges && (int)(uc->edges[j] >> 32) < i; ++j );
+        uc->offsets[i] = j;
+    }
+
+    // clusters grow from the most abundant UMIs, the earliest of ties
+    for ( i = 0; i < n; ++i ) {
+        uc->order[i] = (uint64_t)(INT_MAX - counts[i]) << 32 | (uint32_t)i;
+        cluster[i] = -1;
+    }
+    ks_introsort(uint64_t, n, uc->order);
+    for ( i = 0; i < n; ++i ) {
+        int seed = (uint32_t)uc->order[i];
+        if ( cluster[seed] >= 0 )
+            continue;
+        int head = 0, tail = 0;
+        cluster[seed] = seed;
+        uc->queue[tail++] = seed;
+        while ( head < tail ) {
+            int u = uc->queue[head++];
+            for ( k = uc->offsets[u]; k < uc->offsets[u+1]; ++k ) {
+                int v = (uint32_t)uc->edges[k];
+                if ( cluster[v] >= 0 )
+                    continue;
+                cluster[v] = seed;
+                uc->queue[tail++] = v;
+            }
+        }
+        n_clusters++;
+    }
+    return n_clusters;
+}
+
+#ifdef UMI_CLUSTER_BENCH_MAIN
+// Benchmark of the masked key search against the comparison of all pairs.
+// Usage: umi_cluster_bench [umi length]
+#include <time.h>
+#include "htslib/khash.h"
+KHASH_SET_INIT_STR(str)
+
+static double bench_seconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+static int directional_all_pairs(int n, char *const *umis, const int *counts, int *cluster, int *queue)
+{
+    int i, j, n_clusters = 0;
+    uint64_t *o = (uint64_t*)malloc(n*sizeof(uint64_t));
+    for ( i = 0; i < n; ++i ) {
+        o[i] = (uint64_t)(INT_MAX - counts[i]) << 32 | (uint32_t)i;
+        cluster[i] = -1;
+    }
+    ks_introsort(uint64_t, n, o);
+    for ( i = 0; i < n; ++i ) {
+        int seed = (uint32_t)o[i];
+        if ( cluster[seed] >= 0 )
+            continue;
+        int head = 0, tail = 0;
+        cluster[seed] = seed;
+        queue[tail++] = seed;
+        while ( head < tail ) {
+            int u = queue[head++];
+            for ( j = 0; j < n; ++j ) {
+                if ( cluster[j] >= 0 || counts[u] < 2*counts[j] - 1 )
+                    continue;
+                const char *a = umis[u], *b = umis[j];
+                int d = 0;
+                for ( ; *a && *b && d < 2; ++a, ++b )
+                    d += *a != *b;
+                if ( d == 1 && *a == 0 && *b == 0 ) {
+                    cluster[j] = seed;
+                    queue[tail++] = j;
+                }
+            }
+        }
+        n_clusters++;
+    }
+    free(o);
+    return n_clusters;
+}
+
+int main(int argc, char **argv)
+{
+    int l = argc > 1 ? atoi(argv[1]) : 12;
+    int sizes[] = { 10, 100, 1000, 10000, 50000 };
+    int i, j, k, failed = 0;
+    struct umi_cluster *uc = umi_cluster_init();
+    srand(1);
+    fprintf(stdout, "umis\tclusters\tall_pairs(ms)\tindex(ms)\tspeedup\n");
+    for ( k = 0; k < sizeof(sizes)/sizeof(int); ++k ) {
+        int n = sizes[k];
+        char **umis = (char**)malloc(n*sizeof(char*));
+        int *counts = (int*)malloc(n*sizeof(int));
+        int *c1 = (int*)malloc(n*sizeof(int)), *c2 = (int*)malloc(n*sizeof(int)), *queue = (int*)malloc(n*sizeof(int));
+        khash_t(str) *seen = kh_init(str);
+        // true UMIs with several reads, and errors of them with one read. UMIs are distinct
+        for ( i = 0; i < n; ) {
+            int ret;
+            umis[i] = (char*)malloc(l+1);
+            if ( i < n/4 || rand()%3 == 0 ) {
+                for ( j = 0; j < l; ++j )
+                    umis[i][j] = "ACGT"[rand()&3];
+                counts[i] = 2 + rand()%20;
+            }
+            else {
+                memcpy(umis[i], umis[rand()%(n/4)], l);
+                j = rand()%l;
+                umis[i][j] = "ACGT"[(strchr("ACGT", umis[i][j]) - "ACGT" + 1 + rand()%3) & 3];
+                counts[i] = 1;
+            }
+            umis[i][l] = 0;
+            kh_put(str, seen, umis[i], &ret);
+            if ( ret == 0 )
+                free(umis[i]);
+            else
+                i++;
+        }
+        kh_destroy(str, seen);
+        double t0 = bench_seconds();
+        int n1 = n <= 10000 ? directional_all_pairs(n, umis, counts, c1, queue) : -1;
+        double t1 = bench_seconds();
+        int n2 = umi_cluster_directional(uc, n, umis, counts, c2);
+        double t2 = bench_seconds();
+        if ( n1 >= 0 && (n1 != n2 || memcmp(c1, c2, n*sizeof(int))) ) {
+            fprintf(stderr, "Clusters are different for %d UMIs.\n", n);
+            failed = 1;
+        }
+        if ( n1 >= 0 )
+            fprintf(stdout, "%d\t%d\t%.3f\t%.3f\t%.1fx\n", n, n2, (t1-t0)*1e3, (t2-t1)*1e3, (t1-t0)/(t2-t1));
+        else
+            fprintf(stdout, "%d\t%d\t-\t%.3f\t-\n", n, n2, (t2-t1)*1e3);
+        for ( i = 0; i < n; ++i )
+            free(umis[i]);
+        free(umis); free(counts); free(c1); free(c2); free(queue);
+    }
+    umi_cluster_destroy(uc);
+    return failed;
+}
+#endif
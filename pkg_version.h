@@ -0,0 +1 @@
+#define PROJECTS_VERSION ""
@@ -4,14 +4,26 @@
  * format_string is a predefined tags string, like CHROM,POS,SEQ,QUAL,AS,...
  */
 
-#include<stdio.h>
-#include<stdlib.h>
-#include<htslib/sam.h>
-#include<htslib/kstring.h>
+#include "utils.h"
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
+#include "htslib/kstring.h"
+#include "htslib/thread_pool.h"
+#include "pkg_version.h"
+
+// the output is written when the buffer is larger than this
+#define FLUSH_SIZE (4<<20)
+
+struct col1;
+typedef void (*col_setter)(const bam_hdr_t *, const bam1_t *, const struct col1 *, kstring_t *);
+
 struct col1 {
-    const char *key; // CHROM, POS, SEQ, ...
-    int id;
-    int (*setter)(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
+    char *key; // CHROM, POS, SEQ, ...
+    char tag[2]; // aux tag
+    col_setter setter;
 };
 struct cols {
     int m, l;
@@ -21,87 +33,380 @@ void cols_clear(struct cols *cols)
 {
     int i;
     for (i = 0; i < cols->l; ++i) {
-	free(cols->a[i].key);
+        free(cols->a[i].key);
     }
-    free(cols->a);    
+    free(cols->a);
 }
 struct args {
     const char *file_in;
+    const char *file_out;
     const char *format_string;
+    int threads;
+    int compress;
+    int print_header;
     htsFile *fp;
     bam_hdr_t *h;
-    struct cols *cols;
+    BGZF *out;
+    hts_tpool *pool;
+    struct cols cols;
 };
 struct args args = {
     .file_in = NULL,
+    .file_out = NULL,
     .format_string = NULL,
+    .threads = 1,
+    .compress = 0,
+    .print_header = 0,
     .fp = NULL,
     .h = NULL,
-    .cols = NULL,
+    .out = NULL,
+    .pool = NULL,
+    .cols = { 0, 0, NULL },
 };
 void args_destroy()
 {
     hts_close(args.fp);
     bam_hdr_destroy(args.h);
-    cols_clear(args.cols);
-}
-int setter_chrom(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
-int setter_pos(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
-int setter_mapq(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
-int setter_queryname(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
-int setter_flag(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
-int setter_cigar(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
-int setter_mchrom(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
-int setter_mpos(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
-int setter_seqs(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
-int setter_quals(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
-int setter_tag(bam_hdr_t *, bam1_t *, struct col*, kstring_t *str);
-
-void format_string_init(const char *_string, struct cols *cols)
+    cols_clear(&args.cols);
+    if ( args.pool )
+        hts_tpool_destroy(args.pool);
+}
+
+// two bases of a byte of the packed sequence at once
+static char seq_nt16_pair[256][2];
+
+static void setter_chrom(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    if ( b->core.tid < 0 )
+        kputc('*', str);
+    else
+        kputs(h->target_name[b->core.tid], str);
+}
+static void setter_pos(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    kputw(b->core.pos + 1, str);
+}
+static void setter_mapq(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    kputw(b->core.qual, str);
+}
+static void setter_queryname(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    kputsn(bam_get_qname(b), b->core.l_qname - 1 - b->core.l_extranul, str);
+}
+static void setter_flag(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    kputw(b->core.flag, str);
+}
+static void setter_cigar(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    const uint32_t *cigar = bam_get_cigar(b);
+    int i;
+    if ( b->core.n_cigar == 0 ) {
+        kputc('*', str);
+        return;
+    }
+    for ( i = 0; i < b->core.n_cigar; ++i ) {
+        kputuw(bam_cigar_oplen(cigar[i]), str);
+        kputc(bam_cigar_opchr(cigar[i]), str);
+    }
+}
+static void setter_mchrom(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    if ( b->core.mtid < 0 )
+        kputc('*', str);
+    else
+        kputs(h->target_name[b->core.mtid], str);
+}
+static void setter_mpos(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    kputw(b->core.mpos + 1, str);
+}
+static void setter_tlen(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    kputw(b->core.isize, str);
+}
+static void setter_seqs(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    const uint8_t *seq = bam_get_seq(b);
+    int i, l = b->core.l_qseq;
+    if ( l == 0 ) {
+        kputc('*', str);
+        return;
+    }
+    ks_resize(str, str->l + l + 2);
+    char *s = str->s + str->l;
+    for ( i = 0; i < l>>1; ++i, s += 2 )
+        memcpy(s, seq_nt16_pair[seq[i]], 2);
+    if ( l & 1 )
+        *s = seq_nt16_str[bam_seqi(seq, l-1)];
+    str->l += l;
+    str->s[str->l] = 0;
+}
+static void setter_quals(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    const uint8_t *qual = bam_get_qual(b);
+    int i, l = b->core.l_qseq;
+    if ( l == 0 || qual[0] == 0xff ) {
+        kputc('*', str);
+        return;
+    }
+    ks_resize(str, str->l + l + 1);
+    char *s = str->s + str->l;
+    for ( i = 0; i < l; ++i )
+        s[i] = qual[i] + 33;
+    str->l += l;
+    str->s[str->l] = 0;
+}
+// the value only, "." if the tag is absent. arrays are separated by commas
+static void setter_tag(const bam_hdr_t *h, const bam1_t *b, const struct col1 *c, kstring_t *str)
+{
+    uint8_t *s = bam_aux_get(b, c->tag);
+    uint32_t i, n;
+    if ( s == NULL ) {
+        kputc('.', str);
+        return;
+    }
+    switch ( *s ) {
+        case 'A':
+            kputc(bam_aux2A(s), str);
+            break;
+        case 'c': case 'C': case 's': case 'S': case 'i':
+            kputw(bam_aux2i(s), str);
+            break;
+        case 'I':
+            kputuw(bam_aux2i(s), str);
+            break;
+        case 'f': case 'd':
+            ksprintf(str, "%g", bam_aux2f(s));
+            break;
+        case 'Z': case 'H':
+            kputs(bam_aux2Z(s), str);
+            break;
+        case 'B':
+            n = bam_auxB_len(s);
+            for ( i = 0; i < n; ++i ) {
+                if ( i )
+                    kputc(',', str);
+                if ( s[1] == 'f' )
+                    ksprintf(str, "%g", bam_auxB2f(s, i));
+                else
+                    kputl(bam_auxB2i(s, i), str);
+            }
+            break;
+        default:
+            kputc('.', str);
+    }
+}
+
+static const struct {
+    const char *key;
+    col_setter setter;
+} predefined_cols[] = {
+    { "CHROM", setter_chrom },
+    { "POS", setter_pos },
+    { "MAPQ", setter_mapq },
+    { "QNAME", setter_queryname },
+    { "FLAG", setter_flag },
+    { "CIGAR", setter_cigar },
+    { "MCHROM", setter_mchrom },
+    { "MPOS", setter_mpos },
+    { "TLEN", setter_tlen },
+    { "SEQ", setter_seqs },
+    { "QUAL", setter_quals },
+};
+
+// the columns are resolved to setters once, other keys of 2 characters are aux tags
+int format_string_init(const char *_string, struct cols *cols)
 {
     char *string = (char*)strdup(_string);
     char *ss = string, *se;
+    int i;
 
     // CHROM,POS,QUAL,SEQ,...,TAG
     while(*ss) {
-	while (*se && *se != ',') se++;
-	char *key =(char*)strndup(ss, se-ss);
-	if (cols->m == cols->l ) {
-	    cols->m = cols->m == 0 ? 2 : cols->m << 1;
-	    cols->a = (struct col1*)realloc(cols->a, cols->m*sizeof(struct col1));
-	}
-	struct col1 *c = &cols->a[cols->l++];
-	c->key = key;
-	c->id = -1;
-	if ( strcmp(key, "CHROM") == 0 ) {
-	    c->setter = setter_chrom;
-	} else if ( strcmp(key, "POS") == 0 ) {
-	} else if ( strcmp(key, "MAPQ") == 0 ) {
-	} else if ( strcmp(key, "QNAME") == 0) {
-	}
-	ss = se + 1;
-    }
-    
-}
-void args_praser(int ac, char**av)
+        for ( se = ss; *se && *se != ','; se++ );
+        char *key =(char*)strndup(ss, se-ss);
+        if (cols->m == cols->l ) {
+            cols->m = cols->m == 0 ? 2 : cols->m << 1;
+            cols->a = (struct col1*)realloc(cols->a, cols->m*sizeof(struct col1));
+        }
+        struct col1 *c = &cols->a[cols->l++];
+        c->key = key;
+        c->setter = NULL;
+        for ( i = 0; i < sizeof(predefined_cols)/sizeof(predefined_cols[0]); ++i ) {
+            if ( strcmp(key, predefined_cols[i].key) == 0 ) {
+                c->setter = predefined_cols[i].setter;
+                break;
+            }
+        }
+        if ( c->setter == NULL ) {
+            if ( strlen(key) != 2 || !isalpha(key[0]) || !isalnum(key[1]) ) {
+                error_print("Unknown column, %s.", key);
+                free(string);
+                return 1;
+            }
+            memcpy(c->tag, key, 2);
+            c->setter = setter_tag;
+        }
+        if ( *se == 0 )
+            break;
+        ss = se + 1;
+    }
+    free(string);
+    if ( cols->l == 0 ) {
+        error_print("No column is specified.");
+        return 1;
+    }
+    return 0;
+}
+
+int usage()
 {
+    fprintf(stderr, "Pick columns from BAM/SAM/CRAM file.\n");
+    fprintf(stderr, "Usage : bam_picker -f CHROM,POS,SEQ,QUAL,AS [options] in.bam\n");
+    fprintf(stderr, "    -f STR        // columns, separated by commas\n");
+    fprintf(stderr, "    -o FILE       // output file, BGZF compressed if ends with .gz [stdout]\n");
+    fprintf(stderr, "    -@ INT        // threads for decompressing and compressing [1]\n");
+    fprintf(stderr, "    -header       // print the column names first\n");
+    fprintf(stderr, "\nColumns are CHROM, POS, MAPQ, QNAME, FLAG, CIGAR, MCHROM, MPOS, TLEN, SEQ, QUAL,\n");
+    fprintf(stderr, "and aux tags of 2 characters. Absent tags are exported as \".\".\n");
+    fprintf(stderr, "\nVersion: %s\n", PROJECTS_VERSION);
+    fprintf(stderr, "Homepage: https://github.com/shiquan/small_projects\n");
+    return 1;
 }
+
+int parse_args(int argc, char **argv)
+{
+    if ( argc == 1 )
+        return usage();
+    int i;
+    const char *threads = NULL;
+    for ( i = 1; i < argc; ) {
+        const char *a = argv[i++];
+        if ( strcmp(a, "-h") == 0 )
+            return usage();
+        const char **var = 0;
+        if ( strcmp(a, "-f") == 0 && args.format_string == NULL )
+            var = &args.format_string;
+        else if ( strcmp(a, "-o") == 0 && args.file_out == NULL )
+            var = &args.file_out;
+        else if ( strcmp(a, "-@") == 0 && threads == NULL )
+            var = &threads;
+        else if ( strcmp(a, "-header") == 0 ) {
+            args.print_header = 1;
+            continue;
+        }
+
+        if ( var != 0 ) {
+            if ( i == argc )
+                error("Missing argument after %s", a);
+            *var = argv[i++];
+            continue;
+        }
+        if ( args.file_in == NULL ) {
+            args.file_in = a;
+            continue;
+        }
+        error("Unknown argument, %s.", a);
+    }
+    if ( args.format_string == NULL )
+        error("No columns specified by -f.");
+    if ( args.file_in == NULL ) {
+        if ( isatty(fileno(stdin)) )
+            return usage();
+        args.file_in = "-";
+    }
+    if ( threads ) {
+        args.threads = atoi(threads);
+        if ( args.threads < 1 )
+            args.threads = 1;
+    }
+    if ( args.file_out == NULL )
+        args.file_out = "-";
+    else if ( strlen(args.file_out) > 3 && strcmp(args.file_out + strlen(args.file_out) - 3, ".gz") == 0 )
+        args.compress = 1;
+
+    if ( format_string_init(args.format_string, &args.cols) )
+        return 1;
+
+    // threads are shared by the input and output files
+    if ( args.threads > 1 ) {
+        args.pool = hts_tpool_init(args.threads);
+        if ( args.pool == NULL )
+            error("Failed to init thread pool.");
+    }
+    args.fp = hts_open(args.file_in, "r");
+    if ( args.fp == NULL )
+        error("%s : %s", args.file_in, strerror(errno));
+    if ( args.pool ) {
+        htsThreadPool p = { args.pool, 0 };
+        if ( hts_set_opt(args.fp, HTS_OPT_THREAD_POOL, &p) )
+            error("Failed to set up threads for %s.", args.file_in);
+    }
+    args.h = sam_hdr_read(args.fp);
+    if ( args.h == NULL )
+        error("Failed to read the header of %s.", args.file_in);
+
+    args.out = bgzf_open(args.file_out, args.compress ? "w" : "wu");
+    if ( args.out == NULL )
+        error("%s : %s", args.file_out, strerror(errno));
+    if ( args.compress && args.pool && bgzf_thread_pool(args.out, args.pool, 0) != 0 )
+        error("Failed to set up threads for %s.", args.file_out);
+
+    for ( i = 0; i < 256; ++i ) {
+        seq_nt16_pair[i][0] = seq_nt16_str[i>>4];
+        seq_nt16_pair[i][1] = seq_nt16_str[i&15];
+    }
+    return 0;
+}
+
 // bam_pick_core convert the bam structure to predefined cols into str
-void bam_pick_core(bam_hdr_t *h, bam1_t *line, int n_cols, struct col *cols, kstring_t *str)
+void bam_pick_core(const bam_hdr_t *h, const bam1_t *line, int n_cols, const struct col1 *cols, kstring_t *str)
 {
     int i;
-    for (i = 0; i < n_cols; ++i)
-	cols[i].setter(h, line, &cols[i], str);
+    cols[0].setter(h, line, &cols[0], str);
+    for (i = 1; i < n_cols; ++i) {
+        kputc('\t', str);
+        cols[i].setter(h, line, &cols[i], str);
+    }
+    kputc('\n', str);
 }
-int main(inta argc, char **argv)
+
+int main(int argc, char **argv)
 {
-    args_praser(argc, argv);
+    if ( parse_args(argc, argv) )
+        return 1;
+
     bam1_t *b = bam_init1();
-    int r;
+    kstring_t str = { 0, 0, 0 };
+    int i, r;
+    if ( args.print_header ) {
+        kputc('#', &str);
+        for ( i = 0; i < args.cols.l; ++i ) {
+            if ( i )
+                kputc('\t', &str);
+            kputs(args.cols.a[i].key, &str);
+        }
+        kputc('\n', &str);
+    }
+    // records are formatted into one large buffer, written once it is full
     while ( (r = sam_read1(args.fp, args.h, b) ) >= 0) {
-	bam_pick_core(args.h, b, );
+        bam_pick_core(args.h, b, args.cols.l, args.cols.a, &str);
+        if ( str.l >= FLUSH_SIZE ) {
+            if ( bgzf_write(args.out, str.s, str.l) < 0 )
+                error("Write error : %d", args.out->errcode);
+            str.l = 0;
+        }
     }
+    if ( r < -1 )
+        error("Failed to read %s.", args.file_in);
+    if ( str.l && bgzf_write(args.out, str.s, str.l) < 0 )
+        error("Write error : %d", args.out->errcode);
+    if ( bgzf_close(args.out) )
+        error("Failed to close %s.", args.file_out);
 
+    free(str.s);
     bam_destroy1(b);
     args_destroy();
     return 0;
@@ -0,0 +1,647 @@
+/* group reads of a coordinate-sorted BAM into UMI families, and mark or remove duplicates
+ * shiquan@link.cuhk.edu.hk
+ * Usage: bam_umi_group -o out.bam in.bam
+ *
+ * Reads are bucketed by the 5' unclipped position, strand, mate position and
+ * strand of the leading read of the template. Reads of a bucket with the same
+ * UMI are one family, and the families of UMIs one base apart are merged by the
+ * directional adjacency of UMI-tools. The family ID is kept in the MI tag, and
+ * all reads but the one with the highest base qualities are duplicates. The mate
+ * read follows the decision of its leading read.
+ *
+ * Records are kept in a queue in the input order. A bucket is decided when the
+ * input has moved past its position by the window, so the memory is bounded by
+ * the reads of a window, and the pending mates.
+ */
+
+#include "utils.h"
+#include <string.h>
+#include <unistd.h>
+#include "htslib/sam.h"
+#include "htslib/khash.h"
+#include "htslib/kstring.h"
+#include "htslib/thread_pool.h"
+#include "number.h"
+#include "umi_cluster.h"
+#include "pkg_version.h"
+
+// bases of lower qualities are not counted in the score of a read
+#define MIN_SCORE_QUAL 15
+
+struct family {
+    char *umi;
+    int n;            // reads
+    uint64_t best;    // serial of the read with the highest score
+    int best_score;
+    int cluster;      // the family this one is merged into, itself by default
+    long id;          // MI of the cluster
+};
+
+KHASH_MAP_INIT_STR(umi, int)
+
+struct bucket_key {
+    int32_t tid;
+    int32_t pos;      // 5' unclipped position of the read
+    int32_t mtid;
+    int32_t mpos;
+    uint32_t flag;    // strand of the read and its mate, and read 1 or 2
+};
+
+struct bucket {
+    struct bucket_key key;
+    int done;         // families are decided
+    int n_reads;      // reads not written yet
+    int n, m;
+    struct family *a;
+    khash_t(umi) *umis;
+};
+
+static inline khint_t bucket_key_hash(struct bucket_key k)
+{
+    uint64_t x = (uint64_t)(uint32_t)k.tid << 32 | (uint32_t)k.pos;
+    uint64_t y = (uint64_t)(uint32_t)k.mtid << 32 | (uint32_t)k.mpos;
+    return kh_int64_hash_func(x ^ (y * 0x9E3779B97F4A7C15ULL) ^ k.flag);
+}
+static inline int bucket_key_equal(struct bucket_key a, struct bucket_key b)
+{
+    return a.tid == b.tid && a.pos == b.pos && a.mtid == b.mtid && a.mpos == b.mpos && a.flag == b.flag;
+}
+KHASH_INIT(bucket, struct bucket_key, struct bucket*, 1, bucket_key_hash, bucket_key_equal)
+
+// decision of a leading read, for its mate read later
+struct mate {
+    char *name;
+    long id;
+    int dup;
+};
+KHASH_MAP_INIT_STR(name, struct mate*)
+
+struct entry {
+    bam1_t *b;            // kept by the slot, reused by the later records
+    uint64_t serial;
+    struct bucket *bucket; // NULL if not grouped by this read
+    int family;
+    struct mate *mate;     // the decision shared with the mate read
+    int follower;          // decided by the leading read
+};
+
+// records in the input order, slot of a record is serial & (m - 1)
+struct queue {
+    int m;
+    uint64_t head, tail;
+    struct entry *a;
+};
+
+struct args {
+    const char *input_fname;
+    const char *output_fname;
+    const char *output_mode;
+    const char *reference;
+    const char *umi_tag;
+    int window;
+    int threads;
+    int remove_dup;
+    int exact;
+    samFile *in;
+    samFile *out;
+    bam_hdr_t *header;
+    hts_tpool *pool;
+    khash_t(bucket) *buckets;
+    khash_t(name) *names;
+    struct queue queue;
+    struct umi_cluster *uc;
+    int m_umis;
+    char **umis;     // UMIs of the bucket to cluster
+    int *counts;
+    int *clusters;
+    int cur_tid;
+    int cur_pos;
+    long n_families;
+    long n_reads;
+    long n_grouped;
+    long n_dup;
+} args = {
+    .input_fname = NULL,
+    .output_fname = NULL,
+    .output_mode = NULL,
+    .reference = NULL,
+    .umi_tag = NULL,
+    .window = 500,
+    .threads = 1,
+    .remove_dup = 0,
+    .exact = 0,
+    .in = NULL,
+    .out = NULL,
+    .header = NULL,
+    .pool = NULL,
+    .buckets = NULL,
+    .names = NULL,
+    .queue = { 0, 0, 0, NULL },
+    .uc = NULL,
+    .m_umis = 0,
+    .umis = NULL,
+    .counts = NULL,
+    .clusters = NULL,
+    .cur_tid = -1,
+    .cur_pos = -1,
+    .n_families = 0,
+    .n_reads = 0,
+    .n_grouped = 0,
+    .n_dup = 0,
+};
+
+int usage()
+{
+    fprintf(stderr,
+            "Group reads of a coordinate-sorted BAM into UMI families, and mark duplicates.\n"
+            "Usage: bam_umi_group [options] in.bam\n"
+            "   -tag BC       tag of the UMI, sam_parse_uid moves _UID: of read names to it [BC]\n"
+            "   -window INT   bases after the 5' position of a bucket before it is decided [500]\n"
+            "   -exact        UMIs are families only if identical, no error correction\n"
+            "   -r            remove duplicates instead of marking them\n"
+            "   -o FILE       output file, BAM or CRAM if ends with .bam or .cram [stdout]\n"
+            "   -O FMT        output format, sam, bam or cram\n"
+            "   -ref FILE     reference sequences for CRAM\n"
+            "   -@ INT        threads for decoding and encoding BAM/CRAM [1]\n"
+            "\n"
+            "Reads are bucketed by the 5' unclipped position, strand, and the mate position of\n"
+            "the leading read of the template. Reads with the same UMI in a bucket are a family.\n"
+            "A family is merged into the one with a UMI one base apart and at least 2n-1 reads,\n"
+            "as the directional method of UMI-tools. Families are tagged by MI. The read with the\n"
+            "highest base qualities of a family is kept, the others are flagged as duplicates.\n"
+            "Mates follow the leading reads. Unmapped, secondary and supplementary records are\n"
+            "passed through. The window should be longer than the soft clips at the 5' end of\n"
+            "reads.\n"
+            "\n"
+            "Version: %s\n"
+            "Homepage: https://github.com/shiquan/small_projects\n"
+            , PROJECTS_VERSION
+        );
+    return 1;
+}
+
+int parse_args(int argc, char **argv)
+{
+    int i;
+    const char *fn = NULL;
+    const char *format = NULL;
+    const char *threads = NULL;
+    const char *window = NULL;
+    for ( i = 1; i < argc; ) {
+        const char *a = argv[i++];
+        if ( strcmp(a, "-h") == 0 )
+            return usage();
+
+        const char **var = 0;
+        if ( strcmp(a, "-tag") == 0 && args.umi_tag == NULL )
+            var = &args.umi_tag;
+        else if ( strcmp(a, "-window") == 0 && window == NULL )
+            var = &window;
+        else if ( strcmp(a, "-o") == 0 && args.output_fname == NULL )
+            var = &args.output_fname;
+        else if ( strcmp(a, "-O") == 0 && format == NULL )
+            var = &format;
+        else if ( strcmp(a, "-ref") == 0 && args.reference == NULL )
+            var = &args.reference;
+        else if ( strcmp(a, "-@") == 0 && threads == NULL )
+            var = &threads;
+
+        if ( var != 0 ) {
+            if ( i == argc) {
+                error_print("Miss an argument after %s.", a);
+                return 1;
+            }
+            *var = argv[i++];
+            continue;
+        }
+
+        if ( strcmp(a, "-r") == 0 ) {
+            args.remove_dup = 1;
+            continue;
+        }
+        if ( strcmp(a, "-exact") == 0 ) {
+            args.exact = 1;
+            continue;
+        }
+
+        if ( fn == NULL )
+            fn = a;
+        else
+            error("Unknown parameter %s.", a);
+    }
+
+    if ( args.umi_tag == NULL )
+        args.umi_tag = "BC";
+    if ( strlen(args.umi_tag) != 2 )
+        error("Tag should be 2 characters, %s.", args.umi_tag);
+
+    if ( window ) {
+        args.window = str2int((char*)window);
+        if ( args.window < 0 )
+            error("Window should not be negative, %s.", window);
+    }
+    if ( threads ) {
+        args.threads = str2int((char*)threads);
+        if ( args.threads < 1 )
+            args.threads = 1;
+    }
+
+    // the format is from -O, else from the suffix of -o
+    if ( format == NULL ) {
+        int l = args.output_fname ? strlen(args.output_fname) : 0;
+        if ( l > 4 && strcmp(args.output_fname + l - 4, ".bam") == 0 )
+            format = "bam";
+        else if ( l > 5 && strcmp(args.output_fname + l - 5, ".cram") == 0 )
+            format = "cram";
+        else
+            format = "sam";
+    }
+    if ( strcmp(format, "sam") == 0 )
+        args.output_mode = "w";
+    else if ( strcmp(format, "bam") == 0 )
+        args.output_mode = "wb";
+    else if ( strcmp(format, "cram") == 0 )
+        args.output_mode = "wc";
+    else
+        error("Unknown output format, %s.", format);
+
+    if ( fn == NULL ) {
+        if ( isatty(fileno(stdin)) )
+            return usage();
+        fn = "-";
+    }
+    args.input_fname = fn;
+    if ( args.output_fname == NULL )
+        args.output_fname = "-";
+
+    // one pool is shared by decoding and encoding
+    if ( args.threads > 1 ) {
+        args.pool = hts_tpool_init(args.threads);
+        if ( args.pool == NULL )
+            error("Failed to init thread pool.");
+    }
+    htsThreadPool p = { args.pool, 0 };
+
+    args.in = sam_open(fn, "r");
+    if ( args.in == NULL )
+        error("%s : %s.", fn, strerror(errno));
+    if ( args.pool && hts_set_opt(args.in, HTS_OPT_THREAD_POOL, &p) )
+        error("Failed to set up threads for %s.", fn);
+    args.header = sam_hdr_read(args.in);
+    if ( args.header == NULL )
+        error("Failed to read the header of %s.", fn);
+
+    args.out = sam_open(args.output_fname, args.output_mode);
+    if ( args.out == NULL )
+        error("%s : %s.", args.output_fname, strerror(errno));
+    if ( args.reference && hts_set_fai_filename(args.out, args.reference) )
+        error("Failed to load reference %s.", args.reference);
+    if ( args.pool && hts_set_opt(args.out, HTS_OPT_THREAD_POOL, &p) )
+        error("Failed to set up threads for %s.", args.output_fname);
+    if ( sam_hdr_write(args.out, args.header) )
+        error("Failed to write the header.");
+
+    args.buckets = kh_init(bucket);
+    args.names = kh_init(name);
+    args.uc = umi_cluster_init();
+    return 0;
+}
+
+static void bucket_destroy(struct bucket *bk)
+{
+    int i;
+    for ( i = 0; i < bk->n; ++i )
+        free(bk->a[i].umi);
+    free(bk->a);
+    kh_destroy(umi, bk->umis);
+    free(bk);
+}
+
+// the families of a bucket are merged into clusters, and the reads are decided
+static void bucket_finish(struct bucket *bk)
+{
+    khint_t k = kh_get(bucket, args.buckets, bk->key);
+    if ( k != kh_end(args.buckets) && kh_val(args.buckets, k) == bk )
+        kh_del(bucket, args.buckets, k);
+
+    int i;
+    if ( !args.exact && bk->n > 1 ) {
+        if ( bk->n > args.m_umis ) {
+            args.m_umis = bk->n;
+            kroundup32(args.m_umis);
+            args.umis = (char**)realloc(args.umis, args.m_umis*sizeof(char*));
+            args.counts = (int*)realloc(args.counts, args.m_umis*sizeof(int));
+            args.clusters = (int*)realloc(args.clusters, args.m_umis*sizeof(int));
+        }
+        for ( i = 0; i < bk->n; ++i ) {
+            args.umis[i] = bk->a[i].umi;
+            args.counts[i] = bk->a[i].n;
+        }
+        umi_cluster_directional(args.uc, bk->n, args.umis, args.counts, args.clusters);
+        for ( i = 0; i < bk->n; ++i )
+            bk->a[i].cluster = args.clusters[i];
+    }
+    // the read with the highest score of a cluster is kept, the earliest of ties
+    for ( i = 0; i < bk->n; ++i ) {
+        struct family *f = &bk->a[i];
+        struct family *c = &bk->a[f->cluster];
+        if ( f == c )
+            continue;
+        if ( f->best_score > c->best_score || (f->best_score == c->best_score && f->best < c->best) ) {
+            c->best_score = f->best_score;
+            c->best = f->best;
+        }
+    }
+    for ( i = 0; i < bk->n; ++i )
+        if ( bk->a[i].cluster == i )
+            bk->a[i].id = args.n_families++;
+    bk->done = 1;
+}
+
+static int read_score(const bam1_t *b)
+{
+    const uint8_t *qual = bam_get_qual(b);
+    int i, score = 0;
+    for ( i = 0; i < b->core.l_qseq; ++i )
+        if ( qual[i] >= MIN_SCORE_QUAL && qual[i] != 0xff )
+            score += qual[i];
+    return score;
+}
+
+static int unclipped_5p(const bam1_t *b)
+{
+    const uint32_t *cigar = bam_get_cigar(b);
+    int i, clip = 0;
+    if ( b->core.flag & BAM_FREVERSE ) {
+        for ( i = b->core.n_cigar - 1; i >= 0; --i ) {
+            int op = bam_cigar_op(cigar[i]);
+            if ( op != BAM_CSOFT_CLIP && op != BAM_CHARD_CLIP )
+                break;
+            clip += bam_cigar_oplen(cigar[i]);
+        }
+        return bam_endpos(b) - 1 + clip;
+    }
+    for ( i = 0; i < b->core.n_cigar; ++i ) {
+        int op = bam_cigar_op(cigar[i]);
+        if ( op != BAM_CSOFT_CLIP && op != BAM_CHARD_CLIP )
+            break;
+        clip += bam_cigar_oplen(cigar[i]);
+    }
+    return b->core.pos - clip;
+}
+
+// put the read into its bucket and family, or link it to its leading read
+static void group_read(struct entry *e)
+{
+    bam1_t *b = e->b;
+    const bam1_core_t *c = &b->core;
+    e->bucket = NULL;
+    e->mate = NULL;
+    e->follower = 0;
+    if ( c->flag & (BAM_FUNMAP | BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FQCFAIL) )
+        return;
+
+    int paired = (c->flag & BAM_FPAIRED) && !(c->flag & BAM_FMUNMAP);
+    struct bucket_key key;
+    khint_t k;
+    int ret;
+    key.tid = c->tid;
+    key.pos = unclipped_5p(b);
+    key.mtid = -1;
+    key.mpos = -1;
+    key.flag = c->flag & BAM_FREVERSE ? 1 : 0;
+    if ( paired ) {
+        // the leftmost read leads the template, or the first one at the same position
+        k = kh_get(name, args.names, bam_get_qname(b));
+        int leader = c->tid < c->mtid || (c->tid == c->mtid && c->pos < c->mpos) ||
+            (c->tid == c->mtid && c->pos == c->mpos && k == kh_end(args.names));
+        if ( !leader && k != kh_end(args.names) ) {
+            e->mate = kh_val(args.names, k);
+            e->follower = 1;
+            kh_del(name, args.names, k);
+            return;
+        }
+        // the mate is not seen before, this read is grouped by itself
+        if ( leader ) {
+            struct mate *m = (struct mate*)malloc(sizeof(struct mate));
+            m->name = strdup(bam_get_qname(b));
+            m->id = -1;
+            m->dup = 0;
+            k = kh_put(name, args.names, m->name, &ret);
+            if ( ret == 0 ) {
+                warnings("Duplicated read name, %s.", m->name);
+                free(m->name);
+                free(m);
+            }
+            else {
+                kh_val(args.names, k) = m;
+                e->mate = m;
+            }
+        }
+        key.mtid = c->mtid;
+        key.mpos = c->mpos;
+        key.flag |= (c->flag & BAM_FMREVERSE ? 2 : 0) | (c->flag & BAM_FREAD1 ? 4 : 0);
+    }
+
+    k = kh_put(bucket, args.buckets, key, &ret);
+    if ( ret != 0 ) {
+        struct bucket *bk = (struct bucket*)calloc(1, sizeof(struct bucket));
+        bk->key = key;
+        bk->umis = kh_init(umi);
+        kh_val(args.buckets, k) = bk;
+    }
+    struct bucket *bk = kh_val(args.buckets, k);
+
+    uint8_t *tag = bam_aux_get(b, args.umi_tag);
+    char *umi = tag && *tag == 'Z' ? bam_aux2Z(tag) : "";
+    k = kh_get(umi, bk->umis, umi);
+    if ( k == kh_end(bk->umis) ) {
+        if ( bk->n == bk->m ) {
+            bk->m = bk->m == 0 ? 2 : bk->m << 1;
+            bk->a = (struct family*)realloc(bk->a, bk->m*sizeof(struct family));
+        }
+        struct family *f = &bk->a[bk->n];
+        f->umi = strdup(umi);
+        f->n = 0;
+        f->best = 0;
+        f->best_score = -1;
+        f->cluster = bk->n;
+        f->id = -1;
+        k = kh_put(umi, bk->umis, f->umi, &ret);
+        kh_val(bk->umis, k) = bk->n++;
+    }
+    struct family *f = &bk->a[kh_val(bk->umis, k)];
+    int score = read_score(b);
+    f->n++;
+    if ( score > f->best_score ) {
+        f->best_score = score;
+        f->best = e->serial;
+    }
+    bk->n_reads++;
+    e->bucket = bk;
+    e->family = kh_val(bk->umis, k);
+}
+
+static int write_entry(struct entry *e)
+{
+    bam1_t *b = e->b;
+    long id = -1;
+    int dup = 0;
+    if ( e->bucket ) {
+        struct bucket *bk = e->bucket;
+        struct family *f = &bk->a[bk->a[e->family].cluster];
+        id = f->id;
+        dup = e->serial != f->best;
+        if ( e->mate ) {
+            e->mate->id = id;
+            e->mate->dup = dup;
+        }
+        if ( --bk->n_reads == 0 )
+            bucket_destroy(bk);
+    }
+    else if ( e->follower ) {
+        id = e->mate->id;
+        dup = e->mate->dup;
+        free(e->mate->name);
+        free(e->mate);
+    }
+    e->bucket = NULL;
+    e->mate = NULL;
+
+    if ( id >= 0 ) {
+        args.n_grouped++;
+        if ( dup ) {
+            args.n_dup++;
+            if ( args.remove_dup )
+                return 0;
+            b->core.flag |= BAM_FDUP;
+        }
+        else {
+            b->core.flag &= ~BAM_FDUP;
+        }
+        char mi[24];
+        int l = snprintf(mi, sizeof(mi), "%ld", id);
+        uint8_t *tag = bam_aux_get(b, "MI");
+        if ( tag )
+            bam_aux_del(b, tag);
+        if ( bam_aux_append(b, "MI", 'Z', l + 1, (uint8_t*)mi) )
+            return -1;
+    }
+    return sam_write1(args.out, args.header, b) < 0 ? -1 : 0;
+}
+
+// write the records at the head of the queue, until one waits for its bucket
+static int queue_flush(int eof)
+{
+    struct queue *q = &args.queue;
+    for ( ; q->head < q->tail; q->head++ ) {
+        struct entry *e = &q->a[q->head & (q->m - 1)];
+        struct bucket *bk = e->bucket;
+        if ( bk && !bk->done ) {
+            if ( !eof && bk->key.tid == args.cur_tid && bk->key.pos + args.window >= args.cur_pos )
+                break;
+            bucket_finish(bk);
+        }
+        if ( write_entry(e) ) {
+            error_print("Failed to write %s.", args.output_fname);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// the tail slot for the next record, the slots are kept by their serials
+static struct entry *queue_push()
+{
+    struct queue *q = &args.queue;
+    // all slots are in use if full
+    if ( q->tail - q->head == q->m ) {
+        int m = q->m == 0 ? 1024 : q->m << 1;
+        struct entry *a = (struct entry*)calloc(m, sizeof(struct entry));
+        uint64_t s;
+        for ( s = q->head; s < q->tail; ++s )
+            a[s & (m - 1)] = q->a[s & (q->m - 1)];
+        free(q->a);
+        q->a = a;
+        q->m = m;
+    }
+    struct entry *e = &q->a[q->tail & (q->m - 1)];
+    if ( e->b == NULL )
+        e->b = bam_init1();
+    e->serial = q->tail;
+    return e;
+}
+
+int bam_umi_group()
+{
+    struct queue *q = &args.queue;
+    struct entry *e;
+    int r, started = 0;
+    while ( (r = sam_read1(args.in, args.header, (e = queue_push())->b)) >= 0 ) {
+        const bam1_core_t *c = &e->b->core;
+        args.n_reads++;
+        if ( started && (c->tid >= 0 && (args.cur_tid == -1 || c->tid < args.cur_tid || (c->tid == args.cur_tid && c->pos < args.cur_pos))) ) {
+            error_print("%s is not sorted by coordinates, %s.", args.input_fname, bam_get_qname(e->b));
+            return 1;
+        }
+        started = 1;
+        args.cur_tid = c->tid;
+        args.cur_pos = c->pos;
+        group_read(e);
+        q->tail++;
+        if ( queue_flush(0) )
+            return 1;
+    }
+    if ( r < -1 ) {
+        error_print("Failed to read %s.", args.input_fname);
+        return 1;
+    }
+    if ( queue_flush(1) )
+        return 1;
+
+    fprintf(stderr, "n_reads : %ld\n", args.n_reads);
+    fprintf(stderr, "n_grouped : %ld\n", args.n_grouped);
+    fprintf(stderr, "n_families : %ld\n", args.n_families);
+    fprintf(stderr, "n_duplicates : %ld\n", args.n_dup);
+    return 0;
+}
+
+void release_memory()
+{
+    khint_t k;
+    int i;
+    // leading reads whose mates are never seen
+    for ( k = kh_begin(args.names); k != kh_end(args.names); ++k ) {
+        if ( !kh_exist(args.names, k) )
+            continue;
+        struct mate *m = kh_val(args.names, k);
+        free(m->name);
+        free(m);
+    }
+    kh_destroy(name, args.names);
+    kh_destroy(bucket, args.buckets);
+    umi_cluster_destroy(args.uc);
+    free(args.umis);
+    free(args.counts);
+    free(args.clusters);
+    for ( i = 0; i < args.queue.m; ++i )
+        if ( args.queue.a[i].b )
+            bam_destroy1(args.queue.a[i].b);
+    free(args.queue.a);
+    bam_hdr_destroy(args.header);
+    sam_close(args.in);
+    if ( sam_close(args.out) )
+        error("Failed to close %s.", args.output_fname);
+    if ( args.pool )
+        hts_tpool_destroy(args.pool);
+}
+
+int main(int argc, char **argv)
+{
+    if ( parse_args(argc, argv) )
+        return 1;
+    if ( bam_umi_group() )
+        return 1;
+    release_memory();
+    return 0;
+}
@@ -2,11 +2,13 @@
 #include "htslib/sam.h"
 #include "htslib/kstring.h"
 #include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
 // #include "htslib/hts.h"
 #include <unistd.h>
 #include "pkg_version.h"
 #include "number.h"
 #include "sequence.h"
+#include "bam_region.h"
 
 int usage()
 {
@@ -17,6 +19,16 @@ int usage()
             "   -start INT    start position of the UID sequence\n"
             "   -end   INT    end position of the UID sequence\n"
             "   -comp         complementary strand of UID sequence\n"
+            "   -o FILE       output file, BAM or CRAM if ends with .bam or .cram\n"
+            "   -O FMT        output format, sam, bam or cram\n"
+            "   -ref FILE     reference sequences for CRAM\n"
+            "   -@ INT        threads for decoding and encoding BAM/CRAM [1]\n"
+            "   -split PREFIX write each shard of an indexed input to PREFIX.NNNNN.bam, for merging later\n"
+            "\n"
+            "Without -o or -O, records are printed as SAM text to stdout. Otherwise the\n"
+            "read names are shortened and tagged on the binary records, without text\n"
+            "conversion. With -@, an indexed input is split into shards by the index and\n"
+            "processed in parallel, the output keeps the order of the input.\n"
             "\n"
             "Version: %s\n"
             "Homepage: https://github.com/shiquan/small_projects\n"
@@ -27,16 +39,32 @@ int usage()
 }
 
 struct args {
+    const char *input_fname;
+    const char *split_prefix;
     samFile *in;
+    samFile *out;
     bam_hdr_t *header;
+    hts_tpool *pool;
+    const char *output_fname;
+    const char *output_mode; // NULL for the text mode
+    const char *reference;
+    int threads;
     const char *bc_tag;
     //int length;
     int start;
     int end;
     int barcode_compl;
 } args = {
+    .input_fname = NULL,
+    .split_prefix = NULL,
     .in = NULL,
+    .out = NULL,
     .header = NULL,
+    .pool = NULL,
+    .output_fname = NULL,
+    .output_mode = NULL,
+    .reference = NULL,
+    .threads = 1,
     .bc_tag = NULL,
     //.length = 0,
     .start = -1,
@@ -50,6 +78,8 @@ int parse_args(int argc, char **argv)
     //const char *length = NULL;
     const char *start = NULL;
     const char *end = NULL;
+    const char *format = NULL;
+    const char *threads = NULL;
     for ( i = 1; i < argc; ) {
         const char *a = argv[i++];
         if ( strcmp(a, "-h") == 0 )
@@ -64,6 +94,16 @@ int parse_args(int argc, char **argv)
             var = &start;
         else if ( strcmp(a, "-end") == 0 && end == NULL )
             var = &end;
+        else if ( strcmp(a, "-o") == 0 && args.output_fname == NULL )
+            var = &args.output_fname;
+        else if ( strcmp(a, "-O") == 0 && format == NULL )
+            var = &format;
+        else if ( strcmp(a, "-ref") == 0 && args.reference == NULL )
+            var = &args.reference;
+        else if ( strcmp(a, "-@") == 0 && threads == NULL )
+            var = &threads;
+        else if ( strcmp(a, "-split") == 0 && args.split_prefix == NULL )
+            var = &args.split_prefix;
                 
         if ( var != 0 ) {
             if ( i == argc) {
@@ -101,25 +141,82 @@ int parse_args(int argc, char **argv)
         args.end--;
     }
     
-    if ( fn == NULL ) {
-        if (!isatty(fileno(stdin)) )
-            args.in =sam_open("-", "r");
+    if ( strlen(args.bc_tag) != 2 )
+        error("Tag should be 2 characters, %s.", args.bc_tag);
+
+    if ( threads ) {
+        args.threads = str2int((char*)threads);
+        if ( args.threads < 1 )
+            args.threads = 1;
+    }
+
+    // the format is from -O, else from the suffix of -o
+    if ( format == NULL && args.output_fname ) {
+        int l = strlen(args.output_fname);
+        if ( l > 4 && strcmp(args.output_fname + l - 4, ".bam") == 0 )
+            format = "bam";
+        else if ( l > 5 && strcmp(args.output_fname + l - 5, ".cram") == 0 )
+            format = "cram";
+        else
+            format = "sam";
+    }
+    if ( format ) {
+        if ( strcmp(format, "sam") == 0 )
+            args.output_mode = "w";
+        else if ( strcmp(format, "bam") == 0 )
+            args.output_mode = "wb";
+        else if ( strcmp(format, "cram") == 0 )
+            args.output_mode = "wc";
         else
+            error("Unknown output format, %s.", format);
+    }
+
+    if ( fn == NULL ) {
+        if ( isatty(fileno(stdin)) )
             return usage();
+        fn = "-";
     }
+    args.input_fname = fn;
     
     args.in = sam_open(fn, "r");
     
 
     if ( args.in == 0 ) {
-        error_print("Failed to open %s.", argc == 1 ? "-" : argv[1]);
+        error_print("Failed to open %s.", fn);
         return 1;
     }
 
+    // one pool is shared by decoding and encoding
+    if ( args.output_mode && args.threads > 1 ) {
+        args.pool = hts_tpool_init(args.threads);
+        if ( args.pool == NULL )
+            error("Failed to init thread pool.");
+        htsThreadPool p = { args.pool, 0 };
+        if ( hts_set_opt(args.in, HTS_OPT_THREAD_POOL, &p) )
+            error("Failed to set up threads for %s.", fn);
+    }
+
     if ( (args.header = sam_hdr_read(args.in)) == 0 ) {
         error_print("Failed to read the header.");
         return 1;
     }                    
+
+    if ( args.output_mode && args.split_prefix == NULL ) {
+        if ( args.output_fname == NULL )
+            args.output_fname = "-";
+        args.out = sam_open(args.output_fname, args.output_mode);
+        if ( args.out == NULL )
+            error("%s : %s.", args.output_fname, strerror(errno));
+        if ( args.reference && hts_set_fai_filename(args.out, args.reference) )
+            error("Failed to load reference %s.", args.reference);
+        if ( args.pool ) {
+            htsThreadPool p = { args.pool, 0 };
+            if ( hts_set_opt(args.out, HTS_OPT_THREAD_POOL, &p) )
+                error("Failed to set up threads for %s.", args.output_fname);
+        }
+        if ( sam_hdr_write(args.out, args.header) )
+            error("Failed to write the header.");
+    }
     return 0;
 }
 
@@ -159,15 +256,12 @@ int sam_parse_UID()
 
                 char *s = strndup(p, l);
                 memmove(string.s+i, string.s+j, string.l -j + 1);
-                string.l = string.l - ( j - i + 1);
+                string.l = string.l - ( j - i );
                 kputc('\t', &string);
                 kputsn((char*)args.bc_tag, 2, &string); kputs(":Z:", &string);
 
-                if ( args.barcode_compl ) {
-                    char *r = rev_seqs(s, l);
-                    free(s);
-                    s = r;
-                }
+                if ( args.barcode_compl )
+                    seq_revcomp(s, s, l);
                     
                 kputsn(s, l, &string);
                 free(s);
@@ -189,17 +283,148 @@ int sam_parse_UID()
     //hts_close(fp);
     return 1;
 }
+// move the UID at the end of read name to the barcode tag, on the binary record
+static int parse_UID_bam(bam1_t *b)
+{
+    // read names are shorter than 255
+    char uid[256];
+    char *qname = bam_get_qname(b);
+    char *p = strstr(qname, "_UID:");
+    if ( p == NULL )
+        return 0;
+
+    char *s = p + 5;
+    char *e = s + strlen(s);
+    int l = e - s;
+    if ( args.start > 0 ) {
+        s += args.start;
+        l -= args.start;
+    }
+    if ( args.end > 0 )
+        l = args.start > 0 ?  args.end - args.start + 1 : args.end + 1;
+    // capped to the name
+    if ( s + l > e )
+        l = e - s;
+    if ( l < 0 )
+        l = 0;
+    memcpy(uid, s, l);
+    uid[l] = 0;
+    if ( args.barcode_compl )
+        seq_revcomp(uid, uid, l);
+
+    // the name is shortened in place, and padded by NULs to keep the 4-byte alignment
+    int l_qname = p - qname + 1;
+    int l_extranul = (4 - (l_qname & 3)) & 3;
+    int shift = b->core.l_qname - l_qname - l_extranul;
+    memset(p, 0, 1 + l_extranul);
+    memmove(b->data + l_qname + l_extranul, b->data + b->core.l_qname, b->l_data - b->core.l_qname);
+    b->l_data -= shift;
+    b->core.l_qname = l_qname + l_extranul;
+    b->core.l_extranul = l_extranul;
+
+    return bam_aux_append(b, args.bc_tag, 'Z', l + 1, (uint8_t*)uid);
+}
+
+int sam_parse_UID_bam()
+{
+    bam1_t *b = bam_init1();
+    int r, ret = 0;
+    while ( (r = sam_read1(args.in, args.header, b)) >= 0 ) {
+        if ( parse_UID_bam(b) ) {
+            error_print("Failed to add the barcode tag. %s", bam_get_qname(b));
+            ret = 1;
+            break;
+        }
+        if ( sam_write1(args.out, args.header, b) < 0 ) {
+            error_print("Failed to write %s.", args.output_fname);
+            ret = 1;
+            break;
+        }
+    }
+    if ( r < -1 ) {
+        error_print("Failed to read record.");
+        ret = 1;
+    }
+    bam_destroy1(b);
+    return ret;
+}
+
+// records of a shard, the text is formatted from the binary record
+static int parse_UID_shard(void *data, bam1_t *b, const bam_hdr_t *h, kstring_t *str)
+{
+    if ( parse_UID_bam(b) ) {
+        error_print("Failed to add the barcode tag. %s", bam_get_qname(b));
+        return -1;
+    }
+    if ( args.output_mode == NULL && args.split_prefix == NULL ) {
+        kstring_t rec = { 0, 0, 0};
+        int ret = sam_format1(h, b, &rec);
+        if ( ret >= 0 ) {
+            kputsn(rec.s, rec.l, str);
+            kputc('\n', str);
+        }
+        free(rec.s);
+        return ret < 0 ? -1 : 0;
+    }
+    return 1;
+}
+
+// the shards of an indexed input are processed on the threads
+int sam_parse_UID_shards(struct bam_shard *shards, int n)
+{
+    struct bam_shard_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.n_threads = args.threads;
+    opts.func = parse_UID_shard;
+    if ( args.split_prefix ) {
+        opts.prefix = args.split_prefix;
+        opts.mode = args.output_mode ? args.output_mode : "wb";
+        if ( opts.mode[1] == 0 )
+            error("-split only writes BAM or CRAM.");
+    }
+    else if ( args.output_mode ) {
+        opts.out = args.out;
+        opts.out_hdr = args.header;
+    }
+    else {
+        fprintf(stdout, "%s", args.header->text);
+        fflush(stdout);
+        opts.text = bgzf_dopen(fileno(stdout), "wu");
+        if ( opts.text == NULL )
+            error("Failed to open stdout.");
+    }
+    int ret = bam_shards_run(args.input_fname, shards, n, &opts);
+    if ( opts.text && bgzf_close(opts.text) )
+        ret = -1;
+    return ret ? 1 : 0;
+}
 void release_memory()
 {
     bam_hdr_destroy(args.header);
     sam_close(args.in);
+    if ( args.out && sam_close(args.out) )
+        error("Failed to close %s.", args.output_fname);
+    if ( args.pool )
+        hts_tpool_destroy(args.pool);
 }
 int main (int argc, char **argv)
 {
     if ( parse_args ( argc, argv) )
         return 1;
 
-    if ( sam_parse_UID() )
+    struct bam_shard *shards = NULL;
+    int n = 0, ret;
+    if ( (args.threads > 1 || args.split_prefix) && strcmp(args.input_fname, "-") != 0 )
+        shards = bam_shards_build(args.input_fname, BAM_SHARD_SIZE, &n);
+    if ( args.split_prefix && shards == NULL )
+        error("-split requires an indexed input.");
+
+    if ( shards )
+        ret = sam_parse_UID_shards(shards, n);
+    else
+        ret = args.output_mode ? sam_parse_UID_bam() : sam_parse_UID();
+    free(shards);
+    if ( ret )
         return 1;
 
     release_memory();
@@ -4,17 +4,22 @@
  *  Author: shiquan@genomics.cn 2015/10/21
  *  
  */
-#include <stdio.h>
+#include "utils.h"
 #include <string.h>
-#include <stdlib.h>
-#include <assert.h>
-#include <errno.h>
-#include <htslib/sam.h>
-#include <htslib/kstring.h>
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
+#include "htslib/kstring.h"
+#include "htslib/thread_pool.h"
+#include "kthread.h"
+#include "bam_region.h"
+#include "pkg_version.h"
 
 #define SKIP_LENGTH 30
 #define BARCODE_GAP 12 // 9+ 3
 #define MAXTAIL 25
+// records read at a time, and trimmed by blocks on the threads
+#define BATCH_SIZE 65536
+#define BLOCK_SIZE 1024
 
 /*
   struct of adaptors:
@@ -29,57 +34,123 @@ const uint8_t tail3l[] = {8, 4, 1};
 const uint8_t tail3r[] = {4, 8, 8};
 
 uint8_t seq_nt16_rev_table[] = { 0, 8, 4, 0, 2,  0, 0, 0, 1 };
+
+struct args {
+    const char *input_fname;
+    const char *output_fname;
+    int threads;
+    int compress;
+    samFile *fp;
+    bam_hdr_t *hdr;
+    BGZF *out;
+    hts_tpool *pool;
+    uint64_t n_reads;
+    uint64_t n_skip;
+    uint64_t n_trim;
+} args = {
+    .input_fname = NULL,
+    .output_fname = NULL,
+    .threads = 1,
+    .compress = 0,
+    .fp = NULL,
+    .hdr = NULL,
+    .out = NULL,
+    .pool = NULL,
+    .n_reads = 0,
+    .n_skip = 0,
+    .n_trim = 0,
+};
+
 int usage()
 {
     fprintf(stderr, "Usage: \n");
-    fprintf(stderr, "hpvmeth_trimtail in.bam out.fq\n");
+    fprintf(stderr, "hpvmeth_trimtail [options] in.bam out.fq\n");
+    fprintf(stderr, "    -@ INT        // threads for decoding BAM, trimming and compressing [1]\n");
+    fprintf(stderr, "Output is BGZF compressed if ends with .gz, - for stdout. An indexed input is\n");
+    fprintf(stderr, "trimmed by the shards of the index in parallel with -@.\n");
     fprintf(stderr, "This program was designed to cut library prepare tails in the HPV-methylation project.\n");
     fprintf(stderr, "shiquan@genomics.cn\n");
     return 1;
 }
-void reverse(uint8_t *seq, int qlen)
+
+int parse_args(int argc, char **argv)
 {
+    if ( argc == 1 )
+        return usage();
     int i;
-    for (i=0; i<qlen;++i)
-    {
-	uint8_t t = seq[i];
-	seq[i] = seq[qlen-i-1];
-	seq[qlen-i-1] = t;
+    const char *threads = NULL;
+    for ( i = 1; i < argc; ) {
+        const char *a = argv[i++];
+        if ( strcmp(a, "-h") == 0 )
+            return usage();
+        if ( strcmp(a, "-@") == 0 && threads == NULL ) {
+            if ( i == argc )
+                error("Missing argument after %s", a);
+            threads = argv[i++];
+            continue;
+        }
+        if ( args.input_fname == NULL ) {
+            args.input_fname = a;
+            continue;
+        }
+        if ( args.output_fname == NULL ) {
+            args.output_fname = a;
+            continue;
+        }
+        error("Unknown argument, %s.", a);
     }
+    if ( args.output_fname == NULL )
+        return usage();
+    if ( threads ) {
+        args.threads = atoi(threads);
+        if ( args.threads < 1 )
+            args.threads = 1;
+    }
+    int l = strlen(args.output_fname);
+    if ( l > 3 && strcmp(args.output_fname + l - 3, ".gz") == 0 )
+        args.compress = 1;
+    return 0;
+}
+
+// tail base a at i and b after the barcode, b is not checked out of the read
+static inline int match_tail(const uint8_t *seq, int qlen, int i, uint8_t a, uint8_t b)
+{
+    return bam_seqi(seq, i) == a && (i+BARCODE_GAP > qlen-1 ? 1 : bam_seqi(seq, i+BARCODE_GAP) == b);
 }
-int trim_tail(uint8_t *buf, uint8_t *qual, int qlen, kstring_t *string)
+
+/*
+ * The tails are searched on the 4 bits codes of BAM directly, without unpacking.
+ * The old reverse() swapped every pair twice and left the buffer unchanged, so
+ * the end tail is also searched from the 5' end, kept for the same results.
+ * The kept region is returned in start and length. Return 1 if trimmed, 0 if
+ * not, -1 if the rest is too short.
+ */
+int trim_tail(const uint8_t *seq, int qlen, int *start, int *length)
 {
     int i, j1, j2;
     int t1, t2;
     int l = 5;
-    int b = 0;
-    for (i=0, j1=0; i<MAXTAIL;)
+    for (i=0, j1=0; i<MAXTAIL; ++i)
     {
-
-	if ( ((buf[i] ==tail5l[j1]) && (i+BARCODE_GAP>qlen-1 ? 1 : buf[i+BARCODE_GAP]==tail5r[j1]))
-	    || ((buf[i] ==seq_nt16_rev_table[tail5l[j1]]) && (i+BARCODE_GAP>qlen-1 ? 1 : buf[i+BARCODE_GAP]==seq_nt16_rev_table[tail5r[j1]]))) {
+	if ( match_tail(seq, qlen, i, tail5l[j1], tail5r[j1])
+	     || match_tail(seq, qlen, i, seq_nt16_rev_table[tail5l[j1]], seq_nt16_rev_table[tail5r[j1]]) ) {
 	    j1++;
 	    if (j1==3) break;
-
 	}
 	else {
-	    i = j1 > 0? i--: i;
 	    j1=0;
 	}
-	i++;
     }
-    for (i=0, j2=0; j1 != 3 && i<MAXTAIL;)
+    for (i=0, j2=0; j1 != 3 && i<MAXTAIL; ++i)
     {
-	if ( ((buf[i] ==tail3l[j1]) && (i+BARCODE_GAP>qlen-1 ? 1 : buf[i+BARCODE_GAP]==tail3r[j2]))
-	    || ((buf[i] ==seq_nt16_rev_table[tail5l[j1]]) && (i+BARCODE_GAP>qlen-1 ? 1 : buf[i+BARCODE_GAP]==seq_nt16_rev_table[tail3r[j2]]))) {
+	if ( match_tail(seq, qlen, i, tail3l[j1], tail3r[j2])
+	     || match_tail(seq, qlen, i, seq_nt16_rev_table[tail5l[j1]], seq_nt16_rev_table[tail3r[j2]]) ) {
 	    j2++;
 	    if (j2==3) break;
 	}
 	else {
-	    i = j2 > 0? i-- : i;
 	    j2=0;
 	}
-	++i;
     }
 
     if (j1>j2) {
@@ -93,125 +164,222 @@ int trim_tail(uint8_t *buf, uint8_t *qual, int qlen, kstring_t *string)
 	
     t1 = t1==0 ? 0 : i-t1+BARCODE_GAP;
 
-    reverse(buf, qlen);
-    for (i=0, j1=0; i<MAXTAIL;)
+    for (i=0, j1=0; i<MAXTAIL; ++i)
     {
-	if ( l==5 && (((buf[i] ==tail5l[j1]) && (i+BARCODE_GAP>qlen-1 ? 1 : buf[i+BARCODE_GAP]==tail5r[j1]))
-		      || ((buf[i] ==seq_nt16_rev_table[tail5l[j1]]) && (i+BARCODE_GAP>qlen-1 ? 1 : buf[i+BARCODE_GAP]==seq_nt16_rev_table[tail5r[j1]])))) {
+	if ( l==5 && (match_tail(seq, qlen, i, tail5l[j1], tail5r[j1])
+		      || match_tail(seq, qlen, i, seq_nt16_rev_table[tail5l[j1]], seq_nt16_rev_table[tail5r[j1]])) ) {
 	    j1++;
 	    if (j1==3) break;
 	}
 	else {
-	    i = j1>0 ? i-- : i;
 	    j1=0;
 	}
-	i++;
     }
-    for (i=0, j2=0; j1 != 3 && i<MAXTAIL;)
+    for (i=0, j2=0; j1 != 3 && i<MAXTAIL; ++i)
     {
-	if ( l==3 && (((buf[i] ==tail3l[j1]) && (i+BARCODE_GAP>qlen-1 ? 1 : buf[i+BARCODE_GAP]==tail3r[j2]))
-		      || ((buf[i] ==seq_nt16_rev_table[tail5l[j1]]) && (i+BARCODE_GAP>qlen-1 ? 1 : buf[i+BARCODE_GAP]==seq_nt16_rev_table[tail3r[j2]])))) {
+	if ( l==3 && (match_tail(seq, qlen, i, tail3l[j1], tail3r[j2])
+		      || match_tail(seq, qlen, i, seq_nt16_rev_table[tail5l[j1]], seq_nt16_rev_table[tail3r[j2]])) ) {
 	    j2++;
 	    if (j2==3) break;
 	}
 	else {
-	    i = j2 > 0 ? i-- : i;
 	    j2=0;
 	}
-	i++;
     }
     t2 = j1>j2 ? j1 :j2;
     t2 = t2==0 ? 0 : qlen -i+t2-BARCODE_GAP;
-    reverse(buf, qlen);
-    int length = t2 > t1 ? t2-t1 : qlen - t1;
-    if (length<SKIP_LENGTH) {
+    *start = t1;
+    *length = t2 > t1 ? t2-t1 : qlen - t1;
+    if (*length<SKIP_LENGTH) {
 	return -1;
     }
+    return *length==qlen ? 0 : 1;
+}
+
+// the last base is not exported, and the qualities of the first start bases are
+// filled by the bases, the same as the previous versions
+static void format_record(bam1_t *b, int start, int length, kstring_t *str)
+{
+    const uint8_t *seq = bam_get_seq(b);
+    const uint8_t *qual = bam_get_qual(b);
+    int i, l = length - 1;
+    kputc('@', str);
+    kputs(bam_get_qname(b), str);
+    kputc('\n', str);
+    ks_resize(str, str->l + 2*l + 5);
+    char *s = str->s + str->l;
+    for ( i = 0; i < l; ++i )
+        s[i] = seq_nt16_str[bam_seqi(seq, start+i)];
+    s[l] = '\n';
+    s[l+1] = '+';
+    s[l+2] = '\n';
+    char *q = s + l + 3;
+    for ( i = 0; i < l; ++i )
+        q[i] = i < start ? s[i] : qual[i] + 33;
+    q[l] = '\n';
+    str->l += 2*l + 4;
+}
 
-    if (t1==0) {
-	    for (i=0; i<length; ++i) buf[i] = seq_nt16_str[buf[i]];
-	    kputsn((char*)buf, length-1, string);kputs("\n+\n",string);
-	    for (i=0; i<length; ++i) buf[i] = qual[i]+33;
-	    kputsn((char*)buf, length-1, string);kputc('\n',string);
+struct batch {
+    int n;
+    bam1_t *b[BATCH_SIZE];
+    int ret[BATCH_SIZE]; // returned by trim_tail(), -2 for the short reads
+    kstring_t out[(BATCH_SIZE+BLOCK_SIZE-1)/BLOCK_SIZE];
+};
+
+static void trim_block(void *_b, long k, int tid)
+{
+    struct batch *batch = (struct batch*)_b;
+    kstring_t *str = &batch->out[k];
+    int i, start, length;
+    int end = (k+1)*BLOCK_SIZE < batch->n ? (k+1)*BLOCK_SIZE : batch->n;
+    str->l = 0;
+    for ( i = k*BLOCK_SIZE; i < end; ++i ) {
+        bam1_t *b = batch->b[i];
+        if ( b->core.l_qseq < SKIP_LENGTH ) {
+            batch->ret[i] = -2;
+            continue;
+        }
+        batch->ret[i] = trim_tail(bam_get_seq(b), b->core.l_qseq, &start, &length);
+        if ( batch->ret[i] != -1 )
+            format_record(b, start, length, str);
     }
-    else {
-	memmove(buf, buf+t1, length);
-	buf[length]='\0';
-	for (i=0; i<length; ++i) buf[i] = seq_nt16_str[buf[i]];
-	kputsn((char*)buf, length-1, string);kputs("\n+\n",string);
-	for (i=t1; i<length; ++i) buf[i] = qual[i]+33;
-	kputsn((char*)buf, length-1, string);kputc('\n',string);
-    }
-    return length==qlen ? 0 : 1;
 }
-int main(int argc, char **argv)
+
+// records of a shard of the indexed input, counted atomically
+static int trim_shard(void *data, bam1_t *b, const bam_hdr_t *h, kstring_t *str)
+{
+    int ret, start, length;
+    __sync_fetch_and_add(&args.n_reads, 1);
+    if ( b->core.l_qseq < SKIP_LENGTH ) {
+        __sync_fetch_and_add(&args.n_skip, 1);
+        return 0;
+    }
+    ret = trim_tail(bam_get_seq(b), b->core.l_qseq, &start, &length);
+    if ( ret == -1 ) {
+        __sync_fetch_and_add(&args.n_skip, 1);
+        return 0;
+    }
+    if ( ret == 1 )
+        __sync_fetch_and_add(&args.n_trim, 1);
+    format_record(b, start, length, str);
+    return 0;
+}
+
+static void batch_destroy(struct batch *batch)
 {
-    if (argc != 3) return usage();
-    samFile *fp = NULL;
-    FILE *fq = NULL;
-    bam_hdr_t *h;
-    bam1_t *b;
-    fp = sam_open(argv[1], "r");
-    if ( fp == NULL ) {
-	fprintf(stderr, "%s : %s\n", argv[1], strerror(errno));
-	exit(1);
-    }
-    if (!strcmp(argv[2],"-")) fq = stdout;
-    else fq = fopen(argv[2], "w");
-    if ( fq == NULL )  {
-	fprintf(stderr, "%s : %s\n", argv[2], strerror(errno));
-	exit(1);
-    }
-    h = sam_hdr_read(fp);
-    b = bam_init1();
-    kstring_t string = {0, 0, NULL};
-    uint64_t n_reads = 0;
-    uint64_t n_skip = 0;
-    uint64_t n_trim = 0;
     int i;
-    uint8_t *buf=NULL;
-    uint32_t max_buf=0;
-    while ( sam_read1(fp, h, b)>=0 )
-    {
-	n_reads++;
-	int32_t qlen = b->core.l_qseq;
-	assert(qlen>0);
-	if ( qlen < SKIP_LENGTH ) {
-	    n_skip++;
-	    continue;
-	}
-	uint8_t *seq;
-	uint8_t *qual = bam_get_qual(b);
-	if (max_buf<qlen+1) {
-	    max_buf=qlen+1;
-	    kroundup32(max_buf);
-	    buf = realloc(buf, max_buf);
-	    if ( buf==NULL) {
-		fprintf(stderr, "Out of memory\n");
-		return 1;
-	    }
-	}
-	buf[qlen] = '\0';
-	
-	string.l = 0;
-	kputc('@', &string);
-	kputs(bam_get_qname(b), &string);
-	kputc('\n', &string);
-	seq = bam_get_seq(b);
-	for (i=0; i<qlen; i++) buf[i] = bam_seqi(seq, i);
-	int ret = trim_tail(buf,qual,qlen,&string);
-	if (ret == 1) n_trim++;
-	else if ( ret == -1) {
-	    n_skip++;
-	    continue;
-	}
-	fputs(string.s,fq);
-    }
-    free(string.s);
-    free(buf);
-    bam_destroy1(b);
-    bam_hdr_destroy(h);
-    sam_close(fp);
-    fprintf(stderr,"n_reads : %lld\nn_skip : %lld\nn_trim : %lld\n",n_reads, n_skip, n_trim);
+    for ( i = 0; i < BATCH_SIZE; ++i )
+        if ( batch->b[i] )
+            bam_destroy1(batch->b[i]);
+    for ( i = 0; i < (BATCH_SIZE+BLOCK_SIZE-1)/BLOCK_SIZE; ++i )
+        free(batch->out[i].s);
+    free(batch);
+}
+
+// decoding runs on the thread pool, reading overlaps trimming and writing
+static void *trim_pipeline(void *shared, int step, void *_data)
+{
+    if ( step == 0 ) {
+        struct batch *batch = (struct batch*)calloc(1, sizeof(struct batch));
+        int ret = 0;
+        while ( batch->n < BATCH_SIZE ) {
+            if ( batch->b[batch->n] == NULL )
+                batch->b[batch->n] = bam_init1();
+            ret = sam_read1(args.fp, args.hdr, batch->b[batch->n]);
+            if ( ret < 0 )
+                break;
+            batch->n++;
+        }
+        if ( ret < -1 )
+            error("Failed to read %s.", args.input_fname);
+        if ( batch->n == 0 ) {
+            batch_destroy(batch);
+            return 0;
+        }
+        return batch;
+    }
+    else if ( step == 1 ) {
+        struct batch *batch = (struct batch*)_data;
+        kt_for(args.threads, trim_block, batch, (batch->n+BLOCK_SIZE-1)/BLOCK_SIZE);
+        return batch;
+    }
+    else if ( step == 2 ) {
+        struct batch *batch = (struct batch*)_data;
+        int i;
+        for ( i = 0; i < batch->n; ++i ) {
+            args.n_reads++;
+            if ( batch->ret[i] < 0 )
+                args.n_skip++;
+            else if ( batch->ret[i] == 1 )
+                args.n_trim++;
+        }
+        for ( i = 0; i < (batch->n+BLOCK_SIZE-1)/BLOCK_SIZE; ++i ) {
+            kstring_t *str = &batch->out[i];
+            if ( str->l && bgzf_write(args.out, str->s, str->l) < 0 )
+                error("Write error : %d", args.out->errcode);
+        }
+        batch_destroy(batch);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if ( parse_args(argc, argv) )
+        return 1;
+
+    // threads are shared by the BAM decoding and FASTQ compressing
+    if ( args.threads > 1 ) {
+        args.pool = hts_tpool_init(args.threads);
+        if ( args.pool == NULL )
+            error("Failed to init thread pool.");
+    }
+
+    args.fp = sam_open(args.input_fname, "r");
+    if ( args.fp == NULL )
+        error("%s : %s", args.input_fname, strerror(errno));
+    if ( args.pool ) {
+        htsThreadPool p = { args.pool, 0 };
+        if ( hts_set_opt(args.fp, HTS_OPT_THREAD_POOL, &p) )
+            error("Failed to set up threads for %s.", args.input_fname);
+    }
+    args.hdr = sam_hdr_read(args.fp);
+    if ( args.hdr == NULL )
+        error("Failed to read the header of %s.", args.input_fname);
+
+    args.out = bgzf_open(args.output_fname, args.compress ? "w" : "wu");
+    if ( args.out == NULL )
+        error("%s : %s", args.output_fname, strerror(errno));
+    if ( args.compress && args.pool && bgzf_thread_pool(args.out, args.pool, 0) != 0 )
+        error("Failed to set up threads for %s.", args.output_fname);
+
+    // an indexed input is split by the index, and the shards are trimmed in parallel
+    struct bam_shard *shards = NULL;
+    int n = 0;
+    if ( args.threads > 1 && strcmp(args.input_fname, "-") != 0 )
+        shards = bam_shards_build(args.input_fname, BAM_SHARD_SIZE, &n);
+    if ( shards ) {
+        struct bam_shard_opts opts;
+        memset(&opts, 0, sizeof(opts));
+        opts.n_threads = args.threads;
+        opts.func = trim_shard;
+        opts.text = args.out;
+        if ( bam_shards_run(args.input_fname, shards, n, &opts) )
+            error("Failed to trim %s.", args.input_fname);
+        free(shards);
+    }
+    else {
+        kt_pipeline(args.threads > 1 ? 2 : 1, trim_pipeline, &args, 3);
+    }
+
+    if ( bgzf_close(args.out) )
+        error("Failed to close %s.", args.output_fname);
+    bam_hdr_destroy(args.hdr);
+    sam_close(args.fp);
+    if ( args.pool )
+        hts_tpool_destroy(args.pool);
+    fprintf(stderr,"n_reads : %llu\nn_skip : %llu\nn_trim : %llu\n", (unsigned long long)args.n_reads,
+            (unsigned long long)args.n_skip, (unsigned long long)args.n_trim);
     return 0;
 }
@@ -0,0 +1,325 @@
+#include "utils.h"
+#include <string.h>
+#include <stdint.h>
+#include "htslib/kstring.h"
+#include "htslib/bgzf.h"
+#include "number.h"
+#include "fastq.h"
+#include "pkg_version.h"
+
+int usage()
+{
+    fprintf(stderr,
+            "Generate deterministic paired reads for benchmarking the read tools.\n"
+            "Usage : fastq_simulate [options] -out prefix\n"
+            "    -n         // number of read pairs [1000000]\n"
+            "    -len       // length of read 1, read 2 is followed by barcode and UMI [100]\n"
+            "    -barcodes  // number of samples [96]\n"
+            "    -bc_len    // barcode length [8]\n"
+            "    -umi_len   // UMI length [6]\n"
+            "    -adaptor   // adaptor sequence [AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC]\n"
+            "    -through   // rate of reads with adaptor read-through [0.2]\n"
+            "    -error     // sequencing error rate per base [0.005]\n"
+            "    -seed      // random seed [1]\n"
+            "    -bgzf      // compress the reads by BGZF instead of gzip\n"
+            "\nOutput files are prefix_1.fq.gz, prefix_2.fq.gz, prefix_barcode.txt and prefix.info. Barcodes\n"
+            "start at position len+1 of read 2 and UMI follows the barcode. The same options always generate\n"
+            "the same reads.\n"
+            "Version: %s\n"
+            "Homepage: https://github.com/shiquan/small_projects\n",
+            PROJECTS_VERSION
+        );
+    return 1;
+}
+
+struct args {
+    const char *prefix;
+    const char *adaptor;
+    long n_reads;
+    int length;
+    int n_barcodes;
+    int bc_length;
+    int umi_length;
+    double through;
+    double error;
+    uint64_t seed;
+    int bgzf;
+} args = {
+    .prefix = NULL,
+    .adaptor = "AGATCGGAAGAGCACACGTCTGAACTCCAGTCAC",
+    .n_reads = 1000000,
+    .length = 100,
+    .n_barcodes = 96,
+    .bc_length = 8,
+    .umi_length = 6,
+    .through = 0.2,
+    .error = 0.005,
+    .seed = 1,
+    .bgzf = 0,
+};
+
+static int parse_args(int ac, char **av)
+{
+    if ( ac == 1 )
+        return usage();
+
+    int i;
+    const char *n_reads = NULL;
+    const char *length = NULL;
+    const char *n_barcodes = NULL;
+    const char *bc_length = NULL;
+    const char *umi_length = NULL;
+    const char *through = NULL;
+    const char *error_rate = NULL;
+    const char *seed = NULL;
+    for ( i = 1; i < ac; ) {
+        const char *a = av[i++];
+        if ( strcmp(a, "-h") == 0 )
+            return usage();
+
+        const char **var = 0;
+        if ( strcmp(a, "-out") == 0 && args.prefix == NULL )
+            var = &args.prefix;
+        else if ( strcmp(a, "-n") == 0 && n_reads == NULL )
+            var = &n_reads;
+        else if ( strcmp(a, "-len") == 0 && length == NULL )
+            var = &length;
+        else if ( strcmp(a, "-barcodes") == 0 && n_barcodes == NULL )
+            var = &n_barcodes;
+        else if ( strcmp(a, "-bc_len") == 0 && bc_length == NULL )
+            var = &bc_length;
+        else if ( strcmp(a, "-umi_len") == 0 && umi_length == NULL )
+            var = &umi_length;
+        else if ( strcmp(a, "-adaptor") == 0 )
+            var = &args.adaptor;
+        else if ( strcmp(a, "-through") == 0 && through == NULL )
+            var = &through;
+        else if ( strcmp(a, "-error") == 0 && error_rate == NULL )
+            var = &error_rate;
+        else if ( strcmp(a, "-seed") == 0 && seed == NULL )
+            var = &seed;
+
+        if ( var != 0 ) {
+            if ( i == ac )
+                error("Miss an argument after %s.", a);
+            *var = av[i++];
+            continue;
+        }
+        if ( strcmp(a, "-bgzf") == 0 ) {
+            args.bgzf = 1;
+            continue;
+        }
+        error("Unknown argument, %s.", a);
+    }
+
+    if ( args.prefix == NULL )
+        error("Output prefix should be specified by -out.");
+    if ( n_reads )
+        args.n_reads = atol(n_reads);
+    if ( length )
+        args.length = str2int((char*)length);
+    if ( n_barcodes )
+        args.n_barcodes = str2int((char*)n_barcodes);
+    if ( bc_length )
+        args.bc_length = str2int((char*)bc_length);
+    if ( umi_length )
+        args.umi_length = str2int((char*)umi_length);
+    if ( through )
+        args.through = atof(through);
+    if ( error_rate )
+        args.error = atof(error_rate);
+    if ( seed )
+        args.seed = atol(seed);
+
+    if ( args.n_reads < 1 || args.length < 20 || args.n_barcodes < 1 || args.bc_length < 4 || args.bc_length > 24 || args.umi_length < 0 )
+        error("Bad parameters.");
+    if ( args.through < 0 || args.through > 1 || args.error < 0 || args.error > 1 )
+        error("-through and -error should be defined between [0,1].");
+    if ( check_acgt(args.adaptor, strlen(args.adaptor)) )
+        error("%s looks not like an adaptor sequence.", args.adaptor);
+    return 0;
+}
+
+// xorshift64*, reads only depend on the seed, not on the C library
+static uint64_t rng_state;
+
+static uint64_t rng_next()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_double()
+{
+    return (rng_next() >> 11) * (1.0/9007199254740992.0);
+}
+
+static int rng_int(int n)
+{
+    return rng_next() % n;
+}
+
+static void random_seq(char *s, int l)
+{
+    int i;
+    for ( i = 0; i < l; ++i )
+        s[i] = "ACGT"[rng_int(4)];
+}
+
+// barcodes differ from each other by at least 3 bases, so one mismatch is still unique
+static char *make_barcodes(int n, int l)
+{
+    char *bc = (char*)malloc(n*l);
+    int i, j, k, tries = 0;
+    for ( i = 0; i < n; ) {
+        random_seq(bc + i*l, l);
+        for ( j = 0; j < i; ++j ) {
+            int d = 0;
+            for ( k = 0; k < l; ++k )
+                if ( bc[i*l+k] != bc[j*l+k] )
+                    d++;
+            if ( d < 3 )
+                break;
+        }
+        if ( j == i || ++tries > 1000 ) {
+            tries = 0;
+            ++i;
+        }
+    }
+    return bc;
+}
+
+static void revcomp(char *dst, const char *src, int l)
+{
+    int i;
+    for ( i = 0; i < l; ++i ) {
+        switch ( src[l-1-i] ) {
+            case 'A': dst[i] = 'T'; break;
+            case 'C': dst[i] = 'G'; break;
+            case 'G': dst[i] = 'C'; break;
+            case 'T': dst[i] = 'A'; break;
+            default: dst[i] = 'N';
+        }
+    }
+}
+
+// add substitutions and make up the qualities, errors get low qualities
+static void sequencing(char *seq, char *qual, int l)
+{
+    int i;
+    for ( i = 0; i < l; ++i ) {
+        if ( rng_double() < args.error ) {
+            seq[i] = "ACGT"[(strchr("ACGT", seq[i]) - "ACGT" + 1 + rng_int(3)) & 3];
+            qual[i] = 33 + 2 + rng_int(10);
+        }
+        else {
+            qual[i] = 33 + 25 + rng_int(16);
+        }
+    }
+}
+
+static void write_read(BGZF *fp, long id, int end, const char *seq, const char *qual, int l, kstring_t *str)
+{
+    str->l = 0;
+    ksprintf(str, "@sim%ld/%d\n", id, end);
+    kputsn(seq, l, str);
+    kputsn("\n+\n", 3, str);
+    kputsn(qual, l, str);
+    kputc('\n', str);
+    if ( bgzf_write(fp, str->s, str->l) < 0 )
+        error("Write error : %d", fp->errcode);
+}
+
+static BGZF *open_output(const char *suffix)
+{
+    kstring_t str = {0, 0, 0};
+    ksprintf(&str, "%s%s", args.prefix, suffix);
+    // fast compression, the benchmark only depends on the uncompressed reads
+    BGZF *fp = bgzf_open(str.s, args.bgzf ? "w1" : "wg1");
+    if ( fp == NULL )
+        error("%s : %s.", str.s, strerror(errno));
+    free(str.s);
+    return fp;
+}
+
+int fastq_simulate()
+{
+    int i;
+    long n;
+    kstring_t str = {0, 0, 0};
+    int l_ada = strlen(args.adaptor);
+    int l1 = args.length;
+    int l2 = args.length + args.bc_length + args.umi_length;
+    char *insert = (char*)malloc(l2);
+    char *seq1 = (char*)malloc(l2);
+    char *seq2 = (char*)malloc(l2);
+    char *qual = (char*)malloc(l2);
+
+    rng_state = args.seed * 0x9E3779B97F4A7C15ULL + 1;
+    char *bc = make_barcodes(args.n_barcodes, args.bc_length);
+
+    ksprintf(&str, "%s_barcode.txt", args.prefix);
+    FILE *fp = fopen(str.s, "w");
+    if ( fp == NULL )
+        error("%s : %s.", str.s, strerror(errno));
+    for ( i = 0; i < args.n_barcodes; ++i )
+        fprintf(fp, "S%d\t%.*s\n", i, args.bc_length, bc + i*args.bc_length);
+    fclose(fp);
+
+    // parameters for the benchmark harness
+    str.l = 0;
+    ksprintf(&str, "%s.info", args.prefix);
+    fp = fopen(str.s, "w");
+    if ( fp == NULL )
+        error("%s : %s.", str.s, strerror(errno));
+    fprintf(fp, "reads\t%ld\nlength\t%d\nbc_len\t%d\numi_len\t%d\nadaptor\t%s\nseed\t%llu\n",
+            args.n_reads, args.length, args.bc_length, args.umi_length, args.adaptor, (unsigned long long)args.seed);
+    fclose(fp);
+
+    BGZF *fp1 = open_output("_1.fq.gz");
+    BGZF *fp2 = open_output("_2.fq.gz");
+    for ( n = 0; n < args.n_reads; ++n ) {
+        // short inserts are read through into the adaptor
+        int l_ins = l1;
+        if ( rng_double() < args.through )
+            l_ins = l1/4 + rng_int(l1 - l1/4);
+        random_seq(insert, l_ins);
+
+        memcpy(seq1, insert, l_ins);
+        for ( i = l_ins; i < l1; ++i )
+            seq1[i] = i - l_ins < l_ada ? args.adaptor[i-l_ins] : 'A';
+
+        revcomp(seq2, insert, l_ins);
+        random_seq(seq2 + l_ins, l1 - l_ins);
+        memcpy(seq2 + l1, bc + rng_int(args.n_barcodes)*args.bc_length, args.bc_length);
+        random_seq(seq2 + l1 + args.bc_length, args.umi_length);
+
+        sequencing(seq1, qual, l1);
+        write_read(fp1, n, 1, seq1, qual, l1, &str);
+        sequencing(seq2, qual, l2);
+        write_read(fp2, n, 2, seq2, qual, l2, &str);
+    }
+    if ( bgzf_close(fp1) || bgzf_close(fp2) )
+        error("Failed to close the read files.");
+
+    free(str.s);
+    free(bc);
+    free(insert);
+    free(seq1);
+    free(seq2);
+    free(qual);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if ( parse_args(argc, argv) )
+        return 1;
+
+    if ( fastq_simulate() )
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,523 @@
+#include "utils.h"
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <zlib.h>
+#include "htslib/kstring.h"
+#include "number.h"
+#include "pkg_version.h"
+
+int usage()
+{
+    fprintf(stderr,
+            "Run the read tools on the reads generated by fastq_simulate and report the throughput.\n"
+            "Usage : read_bench [options] -in prefix\n"
+            "    -in        // prefix of fastq_simulate outputs\n"
+            "    -bin       // directory of the programs [bin]\n"
+            "    -out       // working directory [prefix_bench]\n"
+            "    -t         // threads of the programs, passed as -t, or -@ to seqtrim and nextera_dyncutadaptor.\n"
+            "               // dyncut_adaptor is single-threaded and reported with 1 thread [1]\n"
+            "    -tools     // comma separated programs to run [all]\n"
+            "    -expect    // report of a previous run, exit with 1 if any checksum is different\n"
+            "\nPrograms : split_barcode, dyncut_adaptor, umi_parser, seqtrim, fastq_preprocess,\n"
+            "nextera_dyncutadaptor.\n"
+            "The report has columns of program, threads, seconds, reads/s, MB/s of uncompressed input,\n"
+            "peak RSS in MB and the CRC32 of the uncompressed outputs. Checksums only depend on the\n"
+            "output records, so a faster version can be validated against the current one.\n"
+            "Version: %s\n"
+            "Homepage: https://github.com/shiquan/small_projects\n",
+            PROJECTS_VERSION
+        );
+    return 1;
+}
+
+struct args {
+    const char *prefix;
+    const char *bin;
+    const char *out;
+    const char *tools;
+    const char *expect;
+    int n_threads;
+    // from prefix.info
+    long n_reads;
+    int length;
+    int bc_length;
+    int umi_length;
+    char *adaptor;
+    kstring_t read1;
+    kstring_t read2;
+    kstring_t barcode;
+    double input_mb;
+    double read1_mb;
+} args = {
+    .prefix = NULL,
+    .bin = "bin",
+    .out = NULL,
+    .tools = NULL,
+    .expect = NULL,
+    .n_threads = 1,
+    .n_reads = 0,
+    .length = 0,
+    .bc_length = 0,
+    .umi_length = 0,
+    .adaptor = NULL,
+    .read1 = {0, 0, 0},
+    .read2 = {0, 0, 0},
+    .barcode = {0, 0, 0},
+    .input_mb = 0,
+    .read1_mb = 0,
+};
+
+static void read_info()
+{
+    kstring_t str = {0, 0, 0};
+    ksprintf(&str, "%s.info", args.prefix);
+    FILE *fp = fopen(str.s, "r");
+    if ( fp == NULL )
+        error("%s : %s.", str.s, strerror(errno));
+
+    char key[64], val[1024];
+    while ( fscanf(fp, "%63s %1023s", key, val) == 2 ) {
+        if ( strcmp(key, "reads") == 0 )
+            args.n_reads = atol(val);
+        else if ( strcmp(key, "length") == 0 )
+            args.length = atoi(val);
+        else if ( strcmp(key, "bc_len") == 0 )
+            args.bc_length = atoi(val);
+        else if ( strcmp(key, "umi_len") == 0 )
+            args.umi_length = atoi(val);
+        else if ( strcmp(key, "adaptor") == 0 )
+            args.adaptor = strdup(val);
+    }
+    fclose(fp);
+    if ( args.n_reads == 0 || args.length == 0 || args.adaptor == NULL )
+        error("%s is not generated by fastq_simulate.", str.s);
+    free(str.s);
+
+    ksprintf(&args.read1, "%s_1.fq.gz", args.prefix);
+    ksprintf(&args.read2, "%s_2.fq.gz", args.prefix);
+    ksprintf(&args.barcode, "%s_barcode.txt", args.prefix);
+}
+
+static int parse_args(int ac, char **av)
+{
+    if ( ac == 1 )
+        return usage();
+
+    int i;
+    const char *n_threads = NULL;
+    for ( i = 1; i < ac; ) {
+        const char *a = av[i++];
+        if ( strcmp(a, "-h") == 0 )
+            return usage();
+
+        const char **var = 0;
+        if ( strcmp(a, "-in") == 0 && args.prefix == NULL )
+            var = &args.prefix;
+        else if ( strcmp(a, "-bin") == 0 )
+            var = &args.bin;
+        else if ( strcmp(a, "-out") == 0 && args.out == NULL )
+            var = &args.out;
+        else if ( strcmp(a, "-t") == 0 && n_threads == NULL )
+            var = &n_threads;
+        else if ( strcmp(a, "-tools") == 0 && args.tools == NULL )
+            var = &args.tools;
+        else if ( strcmp(a, "-expect") == 0 && args.expect == NULL )
+            var = &args.expect;
+
+        if ( var != 0 ) {
+            if ( i == ac )
+                error("Miss an argument after %s.", a);
+            *var = av[i++];
+            continue;
+        }
+        error("Unknown argument, %s.", a);
+    }
+
+    if ( args.prefix == NULL )
+        error("Reads should be specified by -in.");
+    if ( n_threads ) {
+        args.n_threads = str2int((char*)n_threads);
+        if ( args.n_threads < 1 )
+            error("Bad thread number, %s.", n_threads);
+    }
+    if ( args.out == NULL ) {
+        kstring_t str = {0, 0, 0};
+        ksprintf(&str, "%s_bench", args.prefix);
+        args.out = str.s;
+    }
+    if ( mkdir(args.out, 0755) && errno != EEXIST )
+        error("%s : %s.", args.out, strerror(errno));
+
+    read_info();
+    return 0;
+}
+
+static double bench_seconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+// gzread() reads gzip, BGZF and plain files
+static int checksum_file(const char *fn, uLong *crc, uint64_t *bytes)
+{
+    gzFile fp = gzopen(fn, "rb");
+    if ( fp == NULL )
+        return -1;
+    static char buf[1<<16];
+    int l;
+    while ( (l = gzread(fp, buf, sizeof(buf))) > 0 ) {
+        *crc = crc32(*crc, (Bytef*)buf, l);
+        *bytes += l;
+    }
+    gzclose(fp);
+    return l < 0 ? -1 : 0;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+// CRC32 of the file names and the uncompressed contents, in the order of names
+static uLong checksum_dir(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if ( d == NULL )
+        error("%s : %s.", dir, strerror(errno));
+
+    int n = 0, m = 0, i;
+    char **names = NULL;
+    struct dirent *e;
+    while ( (e = readdir(d)) != NULL ) {
+        if ( e->d_name[0] == '.' )
+            continue;
+        if ( n == m ) {
+            m = m == 0 ? 32 : m << 1;
+            names = (char**)realloc(names, m*sizeof(char*));
+        }
+        names[n++] = strdup(e->d_name);
+    }
+    closedir(d);
+    qsort(names, n, sizeof(char*), cmp_str);
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    kstring_t str = {0, 0, 0};
+    for ( i = 0; i < n; ++i ) {
+        uint64_t bytes = 0;
+        str.l = 0;
+        ksprintf(&str, "%s/%s", dir, names[i]);
+        crc = crc32(crc, (Bytef*)names[i], strlen(names[i]));
+        if ( checksum_file(str.s, &crc, &bytes) )
+            error("Failed to read %s.", str.s);
+        free(names[i]);
+    }
+    free(names);
+    free(str.s);
+    return crc;
+}
+
+struct command {
+    int argc, m;
+    char **argv;
+};
+
+static void command_add(struct command *c, const char *fmt, ...)
+{
+    kstring_t str = {0, 0, 0};
+    va_list ap;
+    va_start(ap, fmt);
+    kvsprintf(&str, fmt, ap);
+    va_end(ap);
+    // keep a NULL at the end for execv()
+    if ( c->argc + 1 >= c->m ) {
+        c->m = c->m == 0 ? 32 : c->m << 1;
+        c->argv = (char**)realloc(c->argv, c->m*sizeof(char*));
+    }
+    c->argv[c->argc++] = str.s;
+    c->argv[c->argc] = NULL;
+}
+
+static void command_destroy(struct command *c)
+{
+    int i;
+    for ( i = 0; i < c->argc; ++i )
+        free(c->argv[i]);
+    free(c->argv);
+}
+
+// run the program with stdout redirected, return the wall time, peak RSS in kilobytes
+static double run_command(struct command *c, const char *stdout_fn, const char *log_fn, long *max_rss)
+{
+    double t = bench_seconds();
+    pid_t pid = fork();
+    if ( pid < 0 )
+        error("fork : %s.", strerror(errno));
+
+    if ( pid == 0 ) {
+        int out = open(stdout_fn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        int log = open(log_fn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if ( out < 0 || log < 0 )
+            _exit(127);
+        dup2(out, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        execv(c->argv[0], c->argv);
+        fprintf(stderr, "%s : %s.\n", c->argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if ( wait4(pid, &status, 0, &usage) < 0 )
+        error("wait4 : %s.", strerror(errno));
+    t = bench_seconds() - t;
+    if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+        error("%s failed, see %s.", c->argv[0], log_fn);
+    *max_rss = usage.ru_maxrss;
+    return t;
+}
+
+enum tool {
+    split_barcode,
+    dyncut_adaptor,
+    umi_parser,
+    seqtrim,
+    fastq_preprocess,
+    nextera_dyncutadaptor,
+    n_tools,
+};
+
+static const char *tool_names[] = {
+    "split_barcode",
+    "dyncut_adaptor",
+    "umi_parser",
+    "seqtrim",
+    "fastq_preprocess",
+    "nextera_dyncutadaptor",
+};
+
+// threads a program runs with, dyncut_adaptor is single-threaded with a given adaptor
+static int tool_threads(int tool)
+{
+    return tool == dyncut_adaptor ? 1 : args.n_threads;
+}
+
+static void build_command(int tool, const char *dir, struct command *c)
+{
+    int l = args.length;
+    int bc_start = l + 1, bc_end = l + args.bc_length;
+    int umi_start = bc_end + 1, umi_end = bc_end + args.umi_length;
+
+    command_add(c, "%s/%s", args.bin, tool_names[tool]);
+    switch ( tool ) {
+        case split_barcode:
+            command_add(c, "-reg");
+            command_add(c, "2:%d-%d", bc_start, bc_end);
+            command_add(c, "-barcode");
+            command_add(c, "%s", args.barcode.s);
+            command_add(c, "-out");
+            command_add(c, "%s", dir);
+            break;
+
+        case dyncut_adaptor:
+            command_add(c, "-adaptor");
+            command_add(c, "%s", args.adaptor);
+            command_add(c, "-trim");
+            command_add(c, "5");
+            command_add(c, "-out1");
+            command_add(c, "%s/trim_1.fq.gz", dir);
+            command_add(c, "-out2");
+            command_add(c, "%s/trim_2.fq.gz", dir);
+            break;
+
+        case umi_parser:
+            command_add(c, "-umi");
+            command_add(c, "2:%d-%d", umi_start, umi_end);
+            command_add(c, "-out1");
+            command_add(c, "%s/umi_1.fq.gz", dir);
+            command_add(c, "-out2");
+            command_add(c, "%s/umi_2.fq.gz", dir);
+            break;
+
+        case seqtrim:
+            command_add(c, "-start");
+            command_add(c, "1");
+            command_add(c, "-end");
+            command_add(c, "%d", l/2);
+            if ( args.n_threads > 1 ) {
+                command_add(c, "-@");
+                command_add(c, "%d", args.n_threads);
+            }
+            command_add(c, "%s", args.read1.s);
+            return;
+
+        case fastq_preprocess:
+            command_add(c, "-barcode");
+            command_add(c, "%s", args.barcode.s);
+            command_add(c, "-reg");
+            command_add(c, "2:%d-%d", bc_start, bc_end);
+            command_add(c, "-adaptor");
+            command_add(c, "%s", args.adaptor);
+            if ( args.umi_length ) {
+                command_add(c, "-umi");
+                command_add(c, "2:%d-%d", umi_start, umi_end);
+            }
+            command_add(c, "-out");
+            command_add(c, "%s", dir);
+            break;
+
+        case nextera_dyncutadaptor:
+            command_add(c, "-adaptor");
+            command_add(c, "%s", args.adaptor);
+            command_add(c, "-f");
+            command_add(c, "%s", args.read1.s);
+            command_add(c, "-r");
+            command_add(c, "%s", args.read2.s);
+            command_add(c, "-o");
+            command_add(c, "%s/reads1.fq.gz", dir);
+            command_add(c, "-p");
+            command_add(c, "%s/reads2.fq.gz", dir);
+            command_add(c, "-@");
+            command_add(c, "%d", args.n_threads);
+            return;
+
+        default:
+            break;
+    }
+    if ( tool_threads(tool) > 1 ) {
+        command_add(c, "-t");
+        command_add(c, "%d", args.n_threads);
+    }
+    command_add(c, "%s", args.read1.s);
+    command_add(c, "%s", args.read2.s);
+}
+
+static int tool_selected(const char *name)
+{
+    if ( args.tools == NULL )
+        return 1;
+    int l = strlen(name);
+    const char *p = args.tools;
+    while ( (p = strstr(p, name)) != NULL ) {
+        if ( (p == args.tools || p[-1] == ',') && (p[l] == ',' || p[l] == '\0') )
+            return 1;
+        p += l;
+    }
+    return 0;
+}
+
+// checksum of a previous run, or NULL if not found
+static char *expect_checksum(const char *name, int n_threads)
+{
+    static char ret_crc[64];
+    char crc[64];
+    if ( args.expect == NULL )
+        return NULL;
+    FILE *fp = fopen(args.expect, "r");
+    if ( fp == NULL )
+        error("%s : %s.", args.expect, strerror(errno));
+    char line[1024], tool[256];
+    int threads;
+    char *ret = NULL;
+    while ( fgets(line, sizeof(line), fp) ) {
+        if ( line[0] == '#' )
+            continue;
+        if ( sscanf(line, "%255s %d %*s %*s %*s %*s %63s", tool, &threads, crc) != 3 )
+            continue;
+        // outputs do not depend on the threads, take any run of this program
+        if ( strcmp(tool, name) == 0 ) {
+            strcpy(ret_crc, crc);
+            ret = ret_crc;
+            if ( threads == n_threads )
+                break;
+        }
+    }
+    fclose(fp);
+    return ret;
+}
+
+int read_bench()
+{
+    int i, failed = 0;
+    kstring_t dir = {0, 0, 0};
+    kstring_t out = {0, 0, 0};
+    kstring_t log = {0, 0, 0};
+
+    // the throughput is measured by the uncompressed input
+    uint64_t bytes = 0;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    if ( checksum_file(args.read1.s, &crc, &bytes) )
+        error("Failed to read %s.", args.read1.s);
+    args.read1_mb = bytes/1048576.0;
+    if ( checksum_file(args.read2.s, &crc, &bytes) )
+        error("Failed to read %s.", args.read2.s);
+    args.input_mb = bytes/1048576.0;
+
+    fprintf(stdout, "#program\tthreads\tseconds\treads/s\tMB/s\tmax_rss(MB)\tchecksum\n");
+    for ( i = 0; i < n_tools; ++i ) {
+        if ( !tool_selected(tool_names[i]) )
+            continue;
+        if ( i == umi_parser && args.umi_length == 0 )
+            continue;
+
+        dir.l = out.l = log.l = 0;
+        ksprintf(&dir, "%s/%s", args.out, tool_names[i]);
+        ksprintf(&log, "%s/%s.log", args.out, tool_names[i]);
+        if ( mkdir(dir.s, 0755) && errno != EEXIST )
+            error("%s : %s.", dir.s, strerror(errno));
+        // only seqtrim writes the reads to stdout, reports of the others go to the log
+        if ( i == seqtrim )
+            ksprintf(&out, "%s/trimmed.fq", dir.s);
+        else
+            ksprintf(&out, "%s/%s.report", args.out, tool_names[i]);
+
+        struct command c = {0, 0, NULL};
+        build_command(i, dir.s, &c);
+        long max_rss = 0;
+        double t = run_command(&c, out.s, log.s, &max_rss);
+        command_destroy(&c);
+
+        char crc[64];
+        snprintf(crc, sizeof(crc), "%08lx", checksum_dir(dir.s));
+        // ru_maxrss is in kilobytes on Linux
+        // seqtrim only reads read 1
+        double mb = i == seqtrim ? args.read1_mb : args.input_mb;
+        fprintf(stdout, "%s\t%d\t%.3f\t%.0f\t%.2f\t%.1f\t%s\n", tool_names[i], tool_threads(i), t,
+                args.n_reads/t, mb/t, max_rss/1024.0, crc);
+        fflush(stdout);
+
+        char *expect = expect_checksum(tool_names[i], tool_threads(i));
+        if ( expect && strcmp(expect, crc) != 0 ) {
+            warnings("Checksum of %s is %s, but %s expected.", tool_names[i], crc, expect);
+            failed = 1;
+        }
+    }
+    free(dir.s);
+    free(out.s);
+    free(log.s);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    if ( parse_args(argc, argv) )
+        return 1;
+
+    if ( read_bench() )
+        return 1;
+
+    free(args.adaptor);
+    free(args.read1.s);
+    free(args.read2.s);
+    free(args.barcode.s);
+    return 0;
+}
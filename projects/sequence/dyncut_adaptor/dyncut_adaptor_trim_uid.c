@@ -1,13 +1,12 @@
 #include "utils.h"
 #include "number.h"
-#include "htslib/kseq.h"
 #include "htslib/kstring.h"
 #include "htslib/bgzf.h"
 #include "fastq.h"
+#include "sequence.h"
+#include "adaptor_detect.h"
 #include "pkg_version.h"
 
-KSEQ_INIT(gzFile, gzread)
-
 int usage()
 {
     fprintf(stderr,
@@ -15,11 +14,15 @@ int usage()
             "dyncut_adaptor [options] read1.fq [read2.fq]\n"
             "\n"
             "Commom options :\n"
-            "    -adaptor      adaptor pollution sequences for read 1, should be complementary with R2 sequencing primer in BGISEQ500 platform\n"
+            "    -adaptor      adaptor pollution sequences for read 1, should be complementary with R2 sequencing primer in BGISEQ500 platform,\n"
+            "                  set to auto to detect it from the first reads of read 1\n"
+            "    -detect INT   reads sampled for the adaptor detection [1000000]\n"
+            "    -t INT        threads for the adaptor detection [1]\n"
             "    -mis_ada      mismatch allowed in the adaptor sequence alignment\n"
             "    -min_length   minimual sequence length for trimmed reads\n"
             "    -report       specify report file instead of print to stdout\n"            
             "    -dropr2       drop R2 fastq file adaptor pollution is detected in R1\n"
+            "    -qbin STR     bin qualities, illumina8, bin4 or custom bins like 0-9:6,10-29:20,30-93:37\n"
             "\n"
             "Barcode split mode options:\n"
             "    -barcode      barcode file, consist of the barcode name and the sequence columns\n"
@@ -29,8 +32,13 @@ int usage()
             "\n"
             "Trim adaptor mode options:\n"
             "    -trim  INT    trim ends even if partly adaptor detected, conflict with -uid and -barcode\n"
+            "    -overlap INT  find the insert size by the overlap of read 1 and read 2, at least INT bases, and\n"
+            "                  trim both reads to it. the adaptor is only searched if no overlap found, and reads\n"
+            "                  are cut before the adaptor in both cases\n"
             "    -out1         output file for trim read1 [trim adaptor mode] or failed read1[barcode split mode]\n"
             "    -out2         output file for trim read2 [trim adaptor mode] or failed read2[barcode split mode]\n"
+            "    -stdout       write uncompressed interleaved reads to stdout instead of -out1 and -out2, for\n"
+            "                  piping to aligners [trim adaptor mode]\n"
             "\n"
             "Version : %s\n"
             "Homepage : https://github.com/shiquan/small_projects\n",
@@ -50,9 +58,15 @@ struct args {
     int mis_bar;
     int minimual_length;
     const char *report_fname;
+    int barcode_length;
     int rename_uid_flag;
     int trim_tail;
+    int overlap;
+    long n_detect;
+    int n_threads;
     int drop_read2;
+    int stdout_flag;
+    kstring_t out_buf; // records to stdout are written in blocks
     const char *read1_file;
     const char *read2_file;
     const char *out1;
@@ -61,6 +75,9 @@ struct args {
     BGZF *failed_2;
     const char *report;
     struct barcode barcode;    
+    struct adaptor_matcher *matcher;
+    kstring_t rc; // reverse complement of read 2
+    struct adaptor_guess guess;
 } args = {
     .adaptor = NULL,
     .barcode_fname = NULL,
@@ -68,18 +85,27 @@ struct args {
     .adaptor_length = 0,
     .mis_ada = 0,
     .mis_bar = 0,
+    .barcode_length = -1,
     .report_fname = NULL,
     .rename_uid_flag = 0,
     .trim_tail = 5,
+    .overlap = 0,
+    .n_detect = 1000000,
+    .n_threads = 1,
     .read1_file = NULL,
     .read2_file = NULL,
     .drop_read2 = 0,
+    .stdout_flag = 0,
+    .out_buf = {0, 0, 0},
     .out1 = NULL,
     .out2 = NULL,
     .failed_1 = NULL,
     .failed_2 = NULL,
     .report = NULL,
     .barcode = { 0, 0, 0,},
+    .matcher = NULL,
+    .rc = {0, 0, 0},
+    .guess = { 0, 0, 0, 0, 0 },
 };
 
 int parse_args(int argc, char **argv)
@@ -91,6 +117,10 @@ int parse_args(int argc, char **argv)
     const char *mis_bar = NULL;
     const char *minimual_length = NULL;
     const char *trim_tail = NULL;
+    const char *overlap = NULL;
+    const char *n_detect = NULL;
+    const char *n_threads = NULL;
+    const char *qual_bins = NULL;
     int i;
     for ( i = 1; i < argc; ) {
         const char *a = argv[i++];
@@ -118,6 +148,14 @@ int parse_args(int argc, char **argv)
             var = &args.out2;
         else if ( strcmp(a, "-trim") == 0 )
             var = &trim_tail;
+        else if ( strcmp(a, "-overlap") == 0 && overlap == NULL )
+            var = &overlap;
+        else if ( strcmp(a, "-detect") == 0 && n_detect == NULL )
+            var = &n_detect;
+        else if ( strcmp(a, "-t") == 0 && n_threads == NULL )
+            var = &n_threads;
+        else if ( strcmp(a, "-qbin") == 0 && qual_bins == NULL )
+            var = &qual_bins;
         
         
         if ( var != 0 ) {
@@ -134,6 +172,9 @@ int parse_args(int argc, char **argv)
         } else if ( strcmp(a, "-dropr2") == 0 ) {
             args.drop_read2 = 1;
             continue;
+        } else if ( strcmp(a, "-stdout") == 0 ) {
+            args.stdout_flag = 1;
+            continue;
         }
         
         if ( args.read1_file == NULL )
@@ -150,6 +191,27 @@ int parse_args(int argc, char **argv)
     if ( args.adaptor == NULL )
         error("Please specify adaptor sequence with -adaptor");
 
+    if ( n_detect ) {
+        args.n_detect = atol(n_detect);
+        if ( args.n_detect < 1000 )
+            error("At least 1000 reads should be sampled for the adaptor detection.");
+    }
+    if ( n_threads ) {
+        args.n_threads = str2int((char*)n_threads);
+        if ( args.n_threads < 1 )
+            args.n_threads = 1;
+    }
+
+    if ( strcmp(args.adaptor, "auto") == 0 ) {
+        int ret = adaptor_detect(args.read1_file, args.n_detect, args.n_threads, &args.guess);
+        if ( ret == -1 )
+            error("%s : %s.", args.read1_file, strerror(errno));
+        adaptor_guess_print(stderr, &args.guess);
+        if ( ret == 1 )
+            error("Failed to detect the adaptor, please specify it with -adaptor.");
+        args.adaptor = args.guess.seq;
+    }
+
     args.adaptor_length = strlen(args.adaptor);
     if ( check_acgt(args.adaptor, args.adaptor_length) )
         error("%s looks not like an adaptor sequence.", args.adaptor);
@@ -160,11 +222,34 @@ int parse_args(int argc, char **argv)
             args.trim_tail = 5;
     }
 
+    if ( args.stdout_flag ) {
+        if ( args.barcode_fname )
+            error("-stdout only works in the trim adaptor mode.");
+        if ( args.out1 || args.out2 || args.output_dir )
+            error("-stdout conflicts with -out, -out1 and -out2.");
+    }
+
+    if ( qual_bins ) {
+        uint8_t table[QUAL_BINS_SIZE];
+        if ( fastq_qual_bins_parse(qual_bins, table) )
+            error("Unknown quality bins, %s.", qual_bins);
+        fastq_set_qual_bins(table);
+    }
+
+    if ( overlap ) {
+        args.overlap = str2int((char*)overlap);
+        if ( args.overlap < 10 )
+            error("Overlap should be at least 10 bases.");
+        if ( args.barcode_fname || args.read2_file == NULL )
+            error("-overlap only works for paired reads in the trim adaptor mode.");
+    }
+
     if ( mis_ada ) {
         args.mis_ada = str2int((char*)mis_ada);
         if ( args.mis_ada < 0 )
             args.mis_ada = 0;
     }
+    args.matcher = adaptor_matcher_init(args.adaptor, args.mis_ada);
 
     if ( mis_bar ) {
         args.mis_bar = str2int((char*)mis_bar);
@@ -180,6 +265,10 @@ int parse_args(int argc, char **argv)
             error_print("Failed to load barcode file.");
             return 1;
         }
+        // barcodes in different lengths are checked one by one
+        args.barcode_length = barcode_length(&args.barcode);
+        if ( args.barcode_length > 0 )
+            barcode_index_build(&args.barcode, args.barcode_length, args.mis_bar, 1);
     } 
     
     return 0;
@@ -187,36 +276,91 @@ int parse_args(int argc, char **argv)
 
 #define STR_INIT {0, 0, 0}
 
-// trim adaptor mode
-// trim adaptor pollution sequences and export read1 fastq file into output Directory
-int trim_adaptor_barcode()
-{    
-    int l1, l2;
-    int i;
-    gzFile fp1, fp2;
-    kseq_t *seq1 = NULL;
-    kseq_t *seq2 = NULL;
+// return the matched barcode, left is the length of sequence after adaptor
+static int match_barcode(char *seq, int left)
+{
+    if ( args.barcode.index )
+        return left < args.barcode_length ? -1 : barcode_lookup(&args.barcode, seq);
+
+    int j;
+    for ( j = 0; j < args.barcode.n; ++j ) {
+        struct name *name = &args.barcode.names[j];
+        int l = strlen(name->barcode);
+        if ( left < l )
+            continue;
+        if ( check_match2(seq, name->barcode, args.mis_bar, l) != -1 )
+            return j;
+    }
+    return -1;
+}
+
+// open the input files, return the file type, 0 for fastq, 1 for fasta
+static int open_reads(struct fastq_reader **fp1, struct fastq_reader **fp2)
+{
     int file_is_fastq;
     file_is_fastq = check_file_is_fastq(args.read1_file);
     if ( file_is_fastq == -1)
-        return 1;
+        return -1;
 
-    fp1 = gzopen(args.read1_file, "r");
-    if ( fp1 == 0 )
+    *fp1 = fastq_reader_open(args.read1_file, NULL);
+    if ( *fp1 == NULL )
         error ("%s : %s", args.read1_file, strerror(errno));
-    seq1 = kseq_init(fp1);
-    
+    *fp2 = NULL;
+
     if ( args.read2_file != NULL) {
         int check_file = check_file_is_fastq(args.read2_file);
         if ( check_file != file_is_fastq )
             error("Inconsistant file type. %d vs %d.", file_is_fastq, check_file );        
-            
-        fp2 = gzopen(args.read2_file, "r");
-        if ( fp2 == NULL)
+
+        *fp2 = fastq_reader_open(args.read2_file, NULL);
+        if ( *fp2 == NULL)
             error("%s : %s.", args.read2_file, strerror(errno));
-        
-        seq2 = kseq_init(fp2);    
     }
+    return file_is_fastq;
+}
+
+static void write_record(BGZF *fp, struct fastq_record *r, const char *prefix, const char *tag, int l_tag)
+{
+    if ( args.stdout_flag ) {
+        fastq_format(&args.out_buf, r, prefix, tag, l_tag);
+        if ( fastq_flush(fp, &args.out_buf, 0) )
+            error ("Write error : %d", fp->errcode);
+    }
+    else if ( fastq_write(fp, r, prefix, tag, l_tag) )
+        error ("Write error : %d", fp->errcode);
+}
+
+// Reads run through into the adaptor if the insert is shorter than the reads, then read 1
+// and the reverse complement of read 2 are the same in the first bases of insert size.
+// Overlaps are checked from the longest, one mismatch allowed every 10 bases. Return the
+// insert size, or -1 if no overlap found.
+static int overlap_insert(struct fastq_record *r1, struct fastq_record *r2)
+{
+    int l = r1->l_seq < r2->l_seq ? r1->l_seq : r2->l_seq;
+    int i;
+    if ( l <= args.overlap )
+        return -1;
+    ks_resize(&args.rc, r2->l_seq);
+    seq_revcomp(args.rc.s, r2->seq, r2->l_seq);
+    // insert size equal to the read length has no adaptor
+    for ( i = l - 1; i >= args.overlap; --i ) {
+        int max = i/10;
+        if ( count_mismatch(r1->seq, args.rc.s + r2->l_seq - i, i, max) <= max )
+            return i;
+    }
+    return -1;
+}
+
+// trim adaptor mode
+// trim adaptor pollution sequences and export read1 fastq file into output Directory
+int trim_adaptor_barcode()
+{    
+    int l1;
+    int i;
+    struct fastq_reader *fp1, *fp2;
+    int file_is_fastq = open_reads(&fp1, &fp2);
+    if ( file_is_fastq == -1 )
+        return 1;
 
     kstring_t string = STR_INIT;
     for ( i = 0; i < args.barcode.n; ++i ) {
@@ -262,8 +406,9 @@ int trim_adaptor_barcode()
         args.failed_1 = bgzf_open(string.s, "w");
         if ( args.failed_1 == NULL )
             error("%s : %s.", string.s, strerror(errno));
-            
-        if ( args.read2_file == NULL || args.drop_read2 == 0)
+
+        // untrimmed read 2 are kept even if -dropr2 set
+        if ( args.read2_file == NULL )
             break;
         string.l = 0;
 
@@ -288,214 +433,84 @@ int trim_adaptor_barcode()
     } while ( 0 );
     
     if ( args.read2_file == NULL ) {
-        // TODO : improve the efficient of this function.
-        // complexity of this function is O(n*k*(m-l)), n is reads count, k is the barcode count, m is the read length, and  l is the adaptor length
-        BGZF *fp = NULL;
-        do
-        {
-            l1 = kseq_read(seq1);
-            if ( l1 < 0 ) break;                
+        struct fastq_record *r1;
+        while ( (r1 = fastq_read(fp1)) != NULL ) {
+            l1 = r1->l_seq;
             if ( l1 == 0 ) continue;                
             int check_length = l1 - args.adaptor_length;
-            string.l = 0;
-            for ( i = 0; i <  check_length; ++i ) {
-                
-                if ( check_match2(seq1->seq.s+i, args.adaptor, args.mis_ada, args.adaptor_length) < 0 ) { 
-                    continue;
-                } else { // check the barcode, failed barcode reads will also export to failed fastqs.
-                    if ( args.minimual_length &&  i < args.minimual_length )
-                        goto skip_record;
-
-                    int j;
-                    for ( j = 0; j < args.barcode.n; ++j ) {
-                        struct name *name = &args.barcode.names[j];
-                        int l = strlen(name->barcode);
-                        if ( l1 < i + l + args.adaptor_length ) { // export to failed fastqs
-                            continue;
-                        }                             
-                        int m = check_match2(seq1->seq.s+i+args.adaptor_length, name->barcode, args.mis_bar, l);
-                        if ( m == -1 )
-                            continue;
-                        
-                        // export trimmed fastqs
-                        if ( args.rename_uid_flag == 1 ) {
-                            if ( file_is_fastq == 0 ) {
-                                kputc('@', &string); kputs(seq1->name.s, &string);                                
-                                if ( string.s[string.l-2] == '/' && string.s[string.l-1] == '1') string.l -= 2;
-                                kputs("_UID:",&string); kputsn(seq1->seq.s+i+args.adaptor_length, l, &string);                                
-                                kputc('\n', &string); kputsn(seq1->seq.s, i+1, &string);
-                                kputs("\n+\n", &string);kputsn(seq1->qual.s, i+1, &string);kputc('\n', &string);
-                            } else {
-                                kputc('>', &string); kputs(seq1->name.s, &string);                                
-                                if ( string.s[string.l-2] == '/' && string.s[string.l-1] == '1') string.l -= 2;                                    
-                                kputs("_UID:",&string); kputsn(seq1->seq.s+i+args.adaptor_length, l, &string);
-                                kputc('\n', &string); kputsn(seq1->seq.s, i+1, &string); kputc('\n', &string);                                
-                            }
-                        } else {
-                            if ( file_is_fastq == 0 ) {
-                                kputc('@', &string); kputs(seq1->name.s, &string); kputc('\n', &string);
-                                kputsn(seq1->seq.s, i+1, &string); kputs("\n+\n", &string); kputsn(seq1->qual.s, i+1, &string); kputc('\n', &string);
-                            } else {
-                                kputc('>', &string); kputs(seq1->name.s, &string); kputc('\n', &string);
-                                kputsn(seq1->seq.s, i+1, &string); kputc('\n', &string);
-                            }
-                        } // end parse uid
-                        fp = name->fp1;
-                        break;                     
-                    }
-                    if ( j == args.barcode.n ) {
-                        fp = args.failed_1;
-                        break;
-                    }
-                }
-                break;
-            }
+            i = adaptor_search(args.matcher, r1->seq, l1, check_length, 0);
             if ( i == check_length ) {
-                if ( file_is_fastq == 0 ) {
-                    ksprintf(&string, "@%s\n%s\n+\n%s\n", seq1->name.s, seq1->seq.s, seq1->qual.s);                
-                } else {
-                    ksprintf(&string, ">%s\n%s\n", seq1->name.s, seq1->seq.s);
-                }
-                fp = args.failed_1;
+                write_record(args.failed_1, r1, NULL, NULL, 0);
+                continue;
             }
-            if ( fp == NULL )
-                error("Error file handler. Please report this bug to developer.");
-            
-            if ( bgzf_write(fp, string.s, string.l ) != string.l )
-                error ("Write error : %d", fp->errcode);
+            if ( args.minimual_length &&  i < args.minimual_length )
+                continue;
 
-          skip_record:
-            fp = NULL;
-            
-        } while (1);
+            // reads without barcode are dropped
+            int j = match_barcode(r1->seq+i+args.adaptor_length, l1 - i - args.adaptor_length);
+            if ( j == -1 )
+                continue;
+
+            // export trimmed fastqs
+            struct name *name = &args.barcode.names[j];
+            struct fastq_record t1 = *r1;
+            // nothing left before the adaptor
+            if ( fastq_trim_adaptor(&t1, i) )
+                continue;
+            if ( args.rename_uid_flag == 1 ) {
+                fastq_strip_read_number(&t1, '1');
+                write_record(name->fp1, &t1, "_UID:", r1->seq+i+args.adaptor_length, strlen(name->barcode));
+            } else {
+                write_record(name->fp1, &t1, NULL, NULL, 0);
+            }
+        }
         
     } else {
-        kstring_t str1 = STR_INIT;
-        kstring_t str2 = STR_INIT;
-        BGZF *fp1 = NULL, *fp2 = NULL;
-        do
-        {
-            l1 = kseq_read(seq1); l2 = kseq_read(seq2);
-            if ( l1 < 0 || l2 < 0 ) break;
-            str1.l = 0; str2.l = 0;
-            for ( i = 0; i < seq1->name.l -1; ++i )
-                if ( seq1->name.s[i] != seq2->name.s[i])
-                    error("Inconsistant read name. %s vs %s.", seq1->name.s, seq2->name.s);
-
+        struct fastq_record *r1, *r2;
+        while ( fastq_read2(fp1, fp2, &r1, &r2) ) {
             // only check adaptor pollution in the read 1, if success trim read 1 and read 2
+            l1 = r1->l_seq;
             int check_length = l1 - args.adaptor_length;
-            for ( i = 0; i < check_length; ++i ) {
-                if ( check_match2(seq1->seq.s+i, args.adaptor, args.mis_ada, args.adaptor_length) < 0 ) {
+            int j = -1;
+            i = adaptor_search(args.matcher, r1->seq, l1, check_length, 0);
+            if ( i < check_length ) {
+                if ( args.minimual_length &&  i < args.minimual_length )
                     continue;
-                } else {
-                    if ( args.minimual_length &&  i < args.minimual_length )
-                        goto skip_record2;
-
-                    int j;
-                    for ( j = 0; j < args.barcode.n; ++j ) {
-                        struct name *name = &args.barcode.names[j];
-                        int l = strlen(name->barcode);
-                        if ( l1 < i + l )
-                            continue;
-                    
-                        int m;
-                        m = check_match2(seq1->seq.s+i+args.adaptor_length, name->barcode, args.mis_bar, l);
-                        if ( m == -1 )
-                            continue;
-
-                        // export trimed fastqs
-                        if ( args.rename_uid_flag == 1 ) {
-                            if ( file_is_fastq == 0 ) {
-                                kputc('@', &str1); kputs(seq1->name.s, &str1);                                
-                                if ( str1.s[str1.l-2] == '/' && str1.s[str1.l-1] == '1') str1.l -= 2;                                    
-                                kputs("_UID:",&str1); kputsn(seq1->seq.s+i+args.adaptor_length, l, &str1);
-                                kputc('\n', &str1); kputsn(seq1->seq.s, i+1, &str1);
-                                kputs("\n+\n", &str1); kputsn(seq1->qual.s, i+1, &str1); kputc('\n', &str1);                                
-                                if ( args.drop_read2 == 0 ) {
-                                    kputc('@', &str2); kputs(seq1->name.s, &str2);
-                                    if ( str2.s[str2.l-2] == '/' && str2.s[str2.l-1] == '2') str2.l -= 2;
-                                    kputs("_UID:",&str2); kputsn(seq1->seq.s+i+args.adaptor_length, l, &str2);
-                                    kputc('\n', &str2); kputsn(seq1->seq.s, i+1, &str2);                            
-                                    kputs("\n+\n", &str2); kputsn(seq1->qual.s, i+1, &str2); kputc('\n', &str2);
-                                }
-                            } else {
-                                kputc('>', &str1); kputs(seq1->name.s, &str1);
-                                if ( str1.s[str1.l-2] == '/' && str1.s[str1.l-1] == '1') str1.l -= 2;
-                                kputs("_UID:",&str1); kputsn(seq1->seq.s+i+args.adaptor_length, l, &str1);
-                                kputc('\n', &str1); kputsn(seq1->seq.s, i+1, &str1); kputc('\n', &str1);
-                                // read 2
-                                if ( args.drop_read2 == 0 ) {
-                                    kputc('>', &str2); kputs(seq1->name.s, &str2);
-                                    if ( str2.s[str2.l-2] == '/' && str2.s[str2.l-1] == '2') str2.l -= 2;
-                                    kputs("_UID:",&str2); kputsn(seq1->seq.s+i+args.adaptor_length, l, &str2);
-                                    kputc('\n', &str2); kputsn(seq1->seq.s, i+1, &str2); kputc('\n', &str2);                                    
-                                }
-                            }
-                        } else {
-                            if ( file_is_fastq == 0 ) {
-                                kputc('@', &str1); kputs(seq1->name.s, &str1); kputc('\n', &str1); kputsn(seq1->seq.s, i+1, &str1); 
-                                kputs("\n+\n", &str1); kputsn(seq1->qual.s, i+1, &str1); kputc('\n', &str1);
-                                if ( args.drop_read2 == 0 ) {
-                                    // read 2
-                                    kputc('@', &str2); kputs(seq1->name.s, &str2); kputc('\n', &str2);
-                                    kputsn(seq1->seq.s, i+1, &str2); kputs("\n+\n", &str2); kputsn(seq1->qual.s, i+1, &str2); kputc('\n', &str2);
-                                }
-                            } else {
-                                kputc('>', &str1); kputs(seq1->name.s, &str1); kputc('\n', &str1);
-                                kputsn(seq1->seq.s, i+1, &str1); kputc('\n', &str1);
-                                // read 2
-                                if ( args.drop_read2 == 0 ) {
-                                    kputc('>', &str2); kputs(seq1->name.s, &str2); kputc('\n', &str2);
-                                    kputsn(seq1->seq.s, i+1, &str2); kputc('\n', &str2);
-                                }
-                            }                        
-                        } // end uid parse
-                        fp1 = name->fp1;
-
-                        if ( args.drop_read2  == 0 )
-                            fp2 = name->fp2;
-                        break;                    
-                    } // end barcode loop
-                    if ( j == args.barcode.n ) { // if no barcode supported
-                        i = check_length;
-                        break;
-                    }
-                } // end match
-                // i = check_length;
-                break;
+                j = match_barcode(r1->seq+i+args.adaptor_length, l1 - i - args.adaptor_length);
             }
-            if ( i == check_length ) {
-                if ( file_is_fastq == 0 ) {
-                    ksprintf(&str1, "@%s\n%s\n+\n%s\n", seq1->name.s, seq1->seq.s, seq1->qual.s);
-                    ksprintf(&str2, "@%s\n%s\n+\n%s\n", seq2->name.s, seq2->seq.s, seq2->qual.s);                
-                } else {
-                    ksprintf(&str1, ">%s\n%s\n", seq1->name.s, seq1->seq.s);
-                    ksprintf(&str2, ">%s\n%s\n", seq2->name.s, seq2->seq.s);
-                }
-                fp1 = args.failed_1;
-                fp2 = args.failed_2;
+
+            // if no adaptor or barcode found
+            if ( j == -1 ) {
+                write_record(args.failed_1, r1, NULL, NULL, 0);
+                write_record(args.failed_2, r2, NULL, NULL, 0);
+                continue;
             }
-            if ( fp1 == NULL)
-                error("Error file handler. Please report this bug to developer. %s", seq1->name.s);
-            
-            if ( bgzf_write(fp1, str1.s, str1.l ) != str1.l )
-                error ("Write error : %d", fp1->errcode);            
-            if ( fp2 == args.failed_2 && bgzf_write(fp2, str2.s, str2.l ) != str2.l )                
-                error ("Write error : %d", fp1->errcode);
-          skip_record2:
-            fp1 = NULL; fp2 = NULL;            
-        } while (1);
-        if ( l1 != l2 )
-            error("Inconsistant read records. %d vs %d", l1, l2);
-
-        if ( str1.m ) free(str1.s);            
-        if ( str2.m ) free(str2.s);
+
+            // export trimed fastqs
+            struct name *name = &args.barcode.names[j];
+            struct fastq_record t1 = *r1, t2 = *r2;
+            // nothing left before the adaptor
+            if ( fastq_trim_adaptor(&t1, i) || fastq_trim_adaptor(&t2, i) )
+                continue;
+            if ( args.rename_uid_flag == 1 ) {
+                const char *tag = r1->seq+i+args.adaptor_length;
+                int l = strlen(name->barcode);
+                fastq_strip_read_number(&t1, '1');
+                fastq_strip_read_number(&t2, '2');
+                write_record(name->fp1, &t1, "_UID:", tag, l);
+                if ( args.drop_read2 == 0 )
+                    write_record(name->fp2, &t2, "_UID:", tag, l);
+            } else {
+                write_record(name->fp1, &t1, NULL, NULL, 0);
+                if ( args.drop_read2 == 0 )
+                    write_record(name->fp2, &t2, NULL, NULL, 0);
+            }
+        }
     }
 
     if ( string.m ) free(string.s);
-    kseq_destroy(seq1);
-    if ( seq2 )
-        kseq_destroy(seq2);
+    fastq_reader_close(fp1);
+    fastq_reader_close(fp2);
     clean_barcode_struct(&args.barcode);
     if ( args.failed_1 != NULL )
         bgzf_close(args.failed_1);
@@ -509,33 +524,23 @@ int trim_adaptor()
     if ( args.barcode_fname )
         return trim_adaptor_barcode();
     
-    int l1, l2, i;
-    gzFile fp1, fp2;
-    kseq_t *seq1 = NULL, *seq2 = NULL;    
-    int file_is_fastq;
-    file_is_fastq = check_file_is_fastq(args.read1_file);
-    if ( file_is_fastq == -1)
+    int l1, i;
+    struct fastq_reader *fp1, *fp2;
+    int file_is_fastq = open_reads(&fp1, &fp2);
+    if ( file_is_fastq == -1 )
         return 1;
 
-    fp1 = gzopen(args.read1_file, "r");
-    if ( fp1 == 0 )
-        error ("%s : %s", args.read1_file, strerror(errno));
-    seq1 = kseq_init(fp1);
-    
-    if ( args.read2_file != NULL) {
-        int check_file = check_file_is_fastq(args.read2_file);
-        if ( check_file != file_is_fastq )
-            error("Inconsistant file type. %d vs %d.", file_is_fastq, check_file );        
-            
-        fp2 = gzopen(args.read2_file, "r");
-        if ( fp2 == NULL)
-            error("%s : %s.", args.read2_file, strerror(errno));
-        
-        seq2 = kseq_init(fp2);    
-    }
-
     kstring_t string = STR_INIT;
     do {
+        // both ends are interleaved in one stream
+        if ( args.stdout_flag ) {
+            args.failed_1 = fastq_stdout_open();
+            if ( args.failed_1 == NULL )
+                error("Failed to open stdout.");
+            if ( args.read2_file && args.drop_read2 == 0 )
+                args.failed_2 = args.failed_1;
+            break;
+        }
         string.l = 0;        
         if ( args.output_dir ) {
             if ( args.out1 ) {
@@ -576,129 +581,64 @@ int trim_adaptor()
     } while ( 0 );
     
     if ( args.read2_file == NULL ) {
-
-        // TODO : improve the efficient of this function.
-        // complexity of this function is O(n*k*(m-l)), n is reads count, k is the barcode count, m is the read length, and  l is the adaptor length
-        do {
-            l1 = kseq_read(seq1);
-            if ( l1 < 0 )
-                break;
+        struct fastq_record *r1;
+        while ( (r1 = fastq_read(fp1)) != NULL ) {
+            l1 = r1->l_seq;
             if ( l1 == 0 )
                 continue;
             int check_length = l1 - args.trim_tail;
-            int l;
-            string.l = 0;
-            for ( i = 0; i <  check_length; ++i ) {
-                l = l1 - i < args.adaptor_length ? l1 -i : args.adaptor_length;                    
-                if ( check_match2(seq1->seq.s+i, args.adaptor, l < 8 ? 0 : args.mis_ada, l) < 0 ) { 
-                    continue;
-                } else { // check the barcode, failed barcode reads will also export to failed fastqs.
-                    if ( args.minimual_length &&  i < args.minimual_length )
-                        break;
-                    if ( file_is_fastq == 0 ) {
-                        kputc('@', &string); kputs(seq1->name.s, &string); kputc('\n', &string);
-                        kputsn(seq1->seq.s, i+1, &string); kputs("\n+\n", &string);
-                        kputsn(seq1->qual.s, i+1, &string); kputc('\n', &string);
-                    } else {
-                        kputc('>', &string); kputs(seq1->name.s, &string); kputc('\n', &string);
-                        kputsn(seq1->seq.s, i+1, &string); kputc('\n', &string);
-                    }
-                }
-                break;
-            }
-            if ( i > args.minimual_length ) {
-                if ( i == check_length ) {
-                    if ( file_is_fastq == 0 ) {
-                        ksprintf(&string, "@%s\n%s\n+\n%s\n", seq1->name.s, seq1->seq.s, seq1->qual.s);                
-                    } else {
-                        ksprintf(&string, ">%s\n%s\n", seq1->name.s, seq1->seq.s);
-                    }
-                }
-                if ( bgzf_write(args.failed_1, string.s, string.l ) != string.l )
-                    error ("Write error : %d", args.failed_1->errcode);
-            }
-            
-        } while (1);
+            i = adaptor_search(args.matcher, r1->seq, l1, check_length, 1);
+            // too short after trimming
+            if ( i <= args.minimual_length )
+                continue;
+            struct fastq_record t1 = *r1;
+            if ( i < check_length )
+                fastq_trim_adaptor(&t1, i);
+            write_record(args.failed_1, &t1, NULL, NULL, 0);
+        }
         
     } else {
-        kstring_t str1 = STR_INIT;
-        kstring_t str2 = STR_INIT;
-        do {
-            l1 = kseq_read(seq1); l2 = kseq_read(seq2);
-            if ( l1 < 0 || l2 < 0 )
-                break;
-            str1.l = 0; str2.l = 0;
-            for ( i = 0; i < seq1->name.l -1; ++i )
-                if ( seq1->name.s[i] != seq2->name.s[i])
-                    error("Inconsistant read name. %s vs %s.", seq1->name.s, seq2->name.s);
-
-            // only check adaptor pollution in the read 1, if success trim read 1 and read 2
-            int check_length = l1 - args.trim_tail;
-            int l;
-            for ( i = 0; i < check_length; ++i ) {
-                l = l1 - i < args.adaptor_length ? l1 -i : args.adaptor_length;
-                if ( check_match2(seq1->seq.s+i, args.adaptor, l < 8 ? 0 : args.mis_ada, l) < 0 ) {
+        struct fastq_record *r1, *r2;
+        while ( fastq_read2(fp1, fp2, &r1, &r2) ) {
+            struct fastq_record t1 = *r1, t2 = *r2;
+            int insert = args.overlap ? overlap_insert(r1, r2) : -1;
+            if ( insert != -1 ) {
+                if ( insert <= args.minimual_length )
                     continue;
-                } else {
-                    if ( args.minimual_length &&  i < args.minimual_length )
-                        break;
-                    
-                    if ( file_is_fastq == 0 ) {
-                        kputc('@', &str1); kputs(seq1->name.s, &str1); kputc('\n', &str1);
-                        kputsn(seq1->seq.s, i+1, &str1); kputs("\n+\n", &str1);
-                        kputsn(seq1->qual.s, i+1, &str1); kputc('\n', &str1);
-                        // read 2
-                        kputc('@', &str2); kputs(seq2->name.s, &str2); kputc('\n', &str2);
-                        kputsn(seq2->seq.s, i+1, &str2); kputs("\n+\n", &str2);
-                        kputsn(seq2->qual.s, i+1, &str2); kputc('\n', &str2);
-                    } else {
-                        kputc('>', &str1); kputs(seq1->name.s, &str1); kputc('\n', &str1);
-                        kputsn(seq1->seq.s, i+1, &str1); kputc('\n', &str1);
-                        // read 2
-                        kputc('>', &str2); kputs(seq1->name.s, &str2); kputc('\n', &str2);
-                        kputsn(seq1->seq.s, i+1, &str2); kputc('\n', &str2);
-                    }                    
-                } // end match
-                // i = check_length;
-                break;
+                t1.l_seq = t2.l_seq = insert;
             }
-            if ( i > args.minimual_length ) {
-
-                if ( i == check_length ) {
-                    if ( file_is_fastq == 0 ) {
-                        ksprintf(&str1, "@%s\n%s\n+\n%s\n", seq1->name.s, seq1->seq.s, seq1->qual.s);
-                        ksprintf(&str2, "@%s\n%s\n+\n%s\n", seq2->name.s, seq2->seq.s, seq2->qual.s);                
-                    } else {
-                        ksprintf(&str1, ">%s\n%s\n", seq1->name.s, seq1->seq.s);
-                        ksprintf(&str2, ">%s\n%s\n", seq2->name.s, seq2->seq.s);
-                    }
+            else {
+                // only check adaptor pollution in the read 1, if success trim read 1 and read 2
+                l1 = r1->l_seq;
+                int check_length = l1 - args.trim_tail;
+                i = adaptor_search(args.matcher, r1->seq, l1, check_length, 1);
+                if ( i <= args.minimual_length )
+                    continue;
+                if ( i < check_length ) {
+                    fastq_trim_adaptor(&t1, i);
+                    fastq_trim_adaptor(&t2, i);
                 }
-            
-                if ( bgzf_write(args.failed_1, str1.s, str1.l ) != str1.l )
-                    error ("Write error : %d", args.failed_1->errcode);            
-                if ( bgzf_write(args.failed_2, str2.s, str2.l ) != str2.l )                
-                    error ("Write error : %d", args.failed_2->errcode);
             }
-        } while (1);
-        if ( l1 != l2 )
-            error("Inconsistant read records. %d vs %d", l1, l2);
-
-        if ( str1.m )
-            free(str1.s);
-        if ( str2.m )
-            free(str2.s);
+            write_record(args.failed_1, &t1, NULL, NULL, 0);
+            if ( args.failed_2 )
+                write_record(args.failed_2, &t2, NULL, NULL, 0);
+        }
     }
 
     if ( string.m)
         free(string.s);
+    free(args.rc.s);
 
-    kseq_destroy(seq1);
-    if ( seq2 )
-        kseq_destroy(seq2);
+    fastq_reader_close(fp1);
+    fastq_reader_close(fp2);
+
+    if ( args.stdout_flag && fastq_flush(args.failed_1, &args.out_buf, 1) )
+        error("Write error : %d", args.failed_1->errcode);
+    free(args.out_buf.s);
 
     if ( args.failed_1 != NULL )
         bgzf_close(args.failed_1);
-    if ( args.failed_2 != NULL )
+    if ( args.failed_2 != NULL && args.failed_2 != args.failed_1 )
         bgzf_close(args.failed_2);    
     return 0;
     
@@ -712,5 +652,8 @@ int main(int argc, char **argv)
     if ( trim_adaptor() )
         return 1;
 
+    adaptor_matcher_destroy(args.matcher);
+    adaptor_guess_destroy(&args.guess);
+
     return 0;
 }
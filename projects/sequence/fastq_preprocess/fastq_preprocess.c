@@ -0,0 +1,576 @@
+#include "utils.h"
+#include <string.h>
+#include "htslib/kstring.h"
+#include "htslib/bgzf.h"
+#include "number.h"
+#include "fastq.h"
+#include "kthread.h"
+#include "htslib/thread_pool.h"
+#include "pkg_version.h"
+
+int usage()
+{
+    fprintf(stderr,
+            "Split barcode, trim adaptor and parse UMI from FASTQ/FASTA files in one pass.\n"
+            "Usage :\n"
+            "fastq_preprocess [options] reads1.fq.gz [reads2.fq.gz]\n"
+            "\n"
+            "Barcode options, same as split_barcode :\n"
+            "    -barcode   // barcode file, consist of the barcode name and the sequence columns\n"
+            "    -reg       // barcode region in read sequence, format is <read 1|2> : <start> - <end>\n"
+            "    -mismatch  // maximum mismatch tolerant, [0-3]\n"
+            "    -out       // output directory.\n"
+            "\n"
+            "Adaptor options, same as the trim mode of dyncut_adaptor :\n"
+            "    -adaptor   // adaptor pollution sequences for read 1\n"
+            "    -mis_ada   // mismatch allowed in the adaptor sequence alignment\n"
+            "    -min_length // minimual sequence length for trimmed reads\n"
+            "    -trim INT  // trim ends even if partly adaptor detected [5]\n"
+            "    -dropr2    // drop read 2\n"
+            "\n"
+            "UMI options, same as umi_parser :\n"
+            "    -umi       // UMI region in read sequence, format is [1|2]:start-end\n"
+            "\n"
+            "    -out1      // output file for read 1, if no barcode file specified [clean_1.fq.gz]\n"
+            "    -out2      // output file for read 2, if no barcode file specified [clean_2.fq.gz]\n"
+            "    -t         // threads, reading, processing and writing are pipelined [1]\n"
+            "\nReads are processed in the order of split_barcode, dyncut_adaptor and umi_parser, and the\n"
+            "results are the same as running these programs one by one. Reads failed to match any barcode\n"
+            "are exported into failed_[12].fq.gz without trimming.\n"
+            "Version: %s\n"
+            "Homepage: https://github.com/shiquan/small_projects\n",
+            PROJECTS_VERSION
+        );
+    return 1;
+}
+
+struct pair {
+    int id;
+    int start;
+    int end;
+};
+
+struct args {
+    const char *barcode_file;
+    const char *output_dir;
+    const char *barcode_region;
+    const char *adaptor;
+    const char *umi_region;
+    const char *read1_file;
+    const char *read2_file;
+    const char *out1;
+    const char *out2;
+    int mismatch;
+    int mis_ada;
+    int minimual_length;
+    int trim_tail;
+    int drop_read2;
+    int threads;
+    int chunk_size;
+    struct pair reg;
+    struct pair umi;
+    struct barcode barcode;
+    struct adaptor_matcher *matcher;
+    BGZF *failed_1;
+    BGZF *failed_2;
+    BGZF *clean_1;
+    BGZF *clean_2;
+    struct fastq_reader *fp1;
+    struct fastq_reader *fp2;
+    hts_tpool *pool;
+} args = {
+    .barcode_file = NULL,
+    .output_dir = NULL,
+    .barcode_region = NULL,
+    .adaptor = NULL,
+    .umi_region = NULL,
+    .read1_file = NULL,
+    .read2_file = NULL,
+    .out1 = NULL,
+    .out2 = NULL,
+    .mismatch = 0,
+    .mis_ada = 0,
+    .minimual_length = 0,
+    .trim_tail = 5,
+    .drop_read2 = 0,
+    .threads = 1,
+    .chunk_size = 10000000,
+    .reg = {0, 0, 0},
+    .umi = {0, 0, 0},
+    .barcode = {0, 0, 0},
+    .matcher = NULL,
+    .failed_1 = NULL,
+    .failed_2 = NULL,
+    .clean_1 = NULL,
+    .clean_2 = NULL,
+    .fp1 = NULL,
+    .fp2 = NULL,
+    .pool = NULL,
+};
+
+static int parse_reg(const char *str, struct pair *pair)
+{
+    int i, l = strlen(str);
+    if ( l > 4 && (str[0] == '1' || str[0] == '2') && str[1] == ':' ) {
+        pair->id = str[0] - '0';
+    } else {
+        error_print("%s does not like a region.", str);
+        return 1;
+    }
+    for ( i = 2; i < l; ++i )
+        if ( str[i] == '-')
+            break;
+    pair->start = str2int_l((char*)str+2, i-2);
+    pair->end = str2int_l((char*)str+i+1, l-i);
+    if ( pair->start < 1 || pair->end < pair->start ) {
+        error_print("Unsupport region, %d - %d.", pair->start, pair->end);
+        return 1;
+    }
+    return 0;
+}
+
+static int parse_args(int ac, char **av)
+{
+    if ( ac == 1 )
+        return usage();
+
+    int i;
+    const char *mismatch = NULL;
+    const char *mis_ada = NULL;
+    const char *minimual_length = NULL;
+    const char *trim_tail = NULL;
+    const char *threads = NULL;
+    for ( i = 1; i < ac; ) {
+        const char *a = av[i++];
+        if ( strcmp(a, "-h") == 0 )
+            return usage();
+
+        const char **var = 0;
+        if ( strcmp(a, "-barcode") == 0 && args.barcode_file == NULL )
+            var = &args.barcode_file;
+        else if ( strcmp(a, "-out") == 0 && args.output_dir == NULL )
+            var = &args.output_dir;
+        else if ( strcmp(a, "-reg") == 0 && args.barcode_region == NULL )
+            var = &args.barcode_region;
+        else if ( (strcmp(a, "-mismatch") == 0 || strcmp(a, "-mis_bar") == 0) && mismatch == NULL )
+            var = &mismatch;
+        else if ( strcmp(a, "-adaptor") == 0 && args.adaptor == NULL )
+            var = &args.adaptor;
+        else if ( strcmp(a, "-mis_ada") == 0 && mis_ada == NULL )
+            var = &mis_ada;
+        else if ( strcmp(a, "-min_length") == 0 && minimual_length == NULL )
+            var = &minimual_length;
+        else if ( strcmp(a, "-trim") == 0 && trim_tail == NULL )
+            var = &trim_tail;
+        else if ( strcmp(a, "-umi") == 0 && args.umi_region == NULL )
+            var = &args.umi_region;
+        else if ( strcmp(a, "-out1") == 0 && args.out1 == NULL )
+            var = &args.out1;
+        else if ( strcmp(a, "-out2") == 0 && args.out2 == NULL )
+            var = &args.out2;
+        else if ( strcmp(a, "-t") == 0 && threads == NULL )
+            var = &threads;
+
+        if ( var != 0 ) {
+            if ( i == ac ) {
+                error("Miss an argument after %s.", a);
+                return 1;
+            }
+            *var = av[i++];
+            continue;
+        }
+        if ( strcmp(a, "-dropr2") == 0 ) {
+            args.drop_read2 = 1;
+            continue;
+        }
+
+        if ( args.read1_file == NULL )
+            args.read1_file = a;
+        else if ( args.read2_file == NULL )
+            args.read2_file = a;
+        else
+            error("Unknown argument, %s.",a);
+    }
+
+    if ( args.read1_file == NULL )
+        error("No sequence file specified.");
+
+    if ( args.barcode_file == NULL && args.adaptor == NULL && args.umi_region == NULL )
+        error("Nothing to do, specify at least one of -barcode, -adaptor and -umi.");
+
+    if ( threads ) {
+        args.threads = str2int((char*)threads);
+        if ( args.threads < 1 )
+            args.threads = 1;
+    }
+
+    if ( args.barcode_file ) {
+        if ( args.barcode_region == NULL )
+            error("Barcode region should be specified by -reg.");
+        if ( parse_reg(args.barcode_region, &args.reg) )
+            return 1;
+        if ( mismatch ) {
+            args.mismatch = str2int((char*)mismatch);
+            if ( args.mismatch < 0 || args.mismatch > 3 )
+                error("-mismatch should be defined between [0,3].");
+        }
+        if ( load_barcode_file(args.barcode_file, &args.barcode) ) {
+            error_print("Failed to load barcode file.");
+            return 1;
+        }
+        barcode_index_build(&args.barcode, args.reg.end - args.reg.start + 1, args.mismatch, 0);
+    }
+
+    if ( args.adaptor ) {
+        if ( check_acgt(args.adaptor, strlen(args.adaptor)) )
+            error("%s looks not like an adaptor sequence.", args.adaptor);
+        if ( trim_tail ) {
+            args.trim_tail = str2int((char*)trim_tail);
+            if ( args.trim_tail < 5 )
+                args.trim_tail = 5;
+        }
+        if ( mis_ada ) {
+            args.mis_ada = str2int((char*)mis_ada);
+            if ( args.mis_ada < 0 )
+                args.mis_ada = 0;
+        }
+        if ( minimual_length )
+            args.minimual_length = str2int((char*)minimual_length);
+        args.matcher = adaptor_matcher_init(args.adaptor, args.mis_ada);
+    }
+
+    if ( args.umi_region && parse_reg(args.umi_region, &args.umi) )
+        return 1;
+
+    if ( args.read2_file == NULL ) {
+        if ( args.barcode_file && args.reg.id == 2 )
+            error("Inconsistant barcode region. %s", args.barcode_region);
+        if ( args.umi_region && args.umi.id == 2 )
+            error("Inconsistant UMI region. %s", args.umi_region);
+    }
+
+    return 0;
+}
+
+// the destination of a read pair
+#define READ_FAILED  -1 // no barcode matched
+#define READ_DROPPED -2 // too short after trimming
+#define READ_CLEAN   -3 // no barcode file specified
+
+// a chunk of reads processed together in the pipeline
+struct bundle {
+    struct fastq_chunk *c1;
+    struct fastq_chunk *c2;
+    int *idx; // matched barcode or one of READ_*
+    char **tag; // UMI, point to the read buffer
+    int *l_tag;
+};
+
+static void bundle_destroy(struct bundle *b)
+{
+    fastq_chunk_destroy(b->c1);
+    fastq_chunk_destroy(b->c2);
+    free(b->idx);
+    free(b->tag);
+    free(b->l_tag);
+    free(b);
+}
+
+// read a chunk of records, return NULL at the end of file
+static struct bundle *bundle_read()
+{
+    struct bundle *b = (struct bundle*)calloc(1, sizeof(struct bundle));
+    int n;
+    b->c1 = fastq_chunk_init();
+    if ( args.fp2 ) {
+        b->c2 = fastq_chunk_init();
+        n = fastq_read_chunk2(args.fp1, args.fp2, b->c1, b->c2, args.chunk_size);
+    }
+    else {
+        n = fastq_read_chunk(args.fp1, b->c1, args.chunk_size);
+    }
+    if ( n < 0 )
+        error("Failed to read sequences.");
+    if ( n == 0 ) {
+        bundle_destroy(b);
+        return NULL;
+    }
+    b->idx = (int*)malloc(n*sizeof(int));
+    b->tag = (char**)malloc(n*sizeof(char*));
+    b->l_tag = (int*)malloc(n*sizeof(int));
+    return b;
+}
+
+// the same as split_barcode
+static int match_barcode(struct fastq_record *r1, struct fastq_record *r2)
+{
+    struct fastq_record *r = args.reg.id == 1 ? r1 : r2;
+    return r->l_seq < args.reg.end ? READ_FAILED : barcode_lookup(&args.barcode, r->seq+args.reg.start-1);
+}
+
+// the same as the trim mode of dyncut_adaptor, return 1 if the reads are too short after trimming
+static int trim_adaptor(struct fastq_record *r1, struct fastq_record *r2)
+{
+    int l1 = r1->l_seq;
+    if ( l1 == 0 && r2 == NULL )
+        return 1;
+    int check_length = l1 - args.trim_tail;
+    int i = adaptor_search(args.matcher, r1->seq, l1, check_length, 1);
+    if ( i <= args.minimual_length )
+        return 1;
+    if ( i < check_length ) {
+        fastq_trim_adaptor(r1, i);
+        if ( r2 )
+            fastq_trim_adaptor(r2, i);
+    }
+    return 0;
+}
+
+// the same as umi_parser, return the length of UMI
+static int umi_tag(struct fastq_record *r, char **tag)
+{
+    int length = args.umi.end - args.umi.start +1;
+    if ( args.umi.start - 1 >= r->l_seq ) {
+        *tag = r->seq + r->l_seq;
+        return 0;
+    }
+    *tag = r->seq + args.umi.start - 1;
+    return length < r->l_seq - args.umi.start + 1 ? length : r->l_seq - args.umi.start + 1;
+}
+
+static void umi_trim(struct fastq_record *r)
+{
+    if ( args.umi.start == 1 ) {
+        int l = args.umi.end < r->l_seq ? args.umi.end : r->l_seq;
+        r->seq += l;
+        if ( r->qual )
+            r->qual += l;
+        r->l_seq -= l;
+    } else if ( args.umi.start - 1 < r->l_seq ) {
+        r->l_seq = args.umi.start - 1;
+    }
+}
+
+// all the steps only move the views, the read buffer is not changed
+static void process_reads(void *_data, long i, int tid)
+{
+    struct bundle *b = (struct bundle*)_data;
+    struct fastq_record *r1 = &b->c1->r[i];
+    struct fastq_record *r2 = b->c2 ? &b->c2->r[i] : NULL;
+
+    b->tag[i] = NULL;
+    b->l_tag[i] = 0;
+    if ( args.barcode_file ) {
+        b->idx[i] = match_barcode(r1, r2);
+        if ( b->idx[i] == READ_FAILED )
+            return;
+    }
+    else {
+        b->idx[i] = READ_CLEAN;
+    }
+
+    if ( args.matcher && trim_adaptor(r1, r2) ) {
+        b->idx[i] = READ_DROPPED;
+        return;
+    }
+
+    if ( args.umi_region ) {
+        struct fastq_record *r = args.umi.id == 1 ? r1 : r2;
+        b->l_tag[i] = umi_tag(r, &b->tag[i]);
+        umi_trim(r);
+        fastq_strip_read_number(r1, '1');
+        if ( r2 )
+            fastq_strip_read_number(r2, '2');
+    }
+}
+
+static void write_record(BGZF *fp, struct fastq_record *r, const char *prefix, const char *tag, int l_tag)
+{
+    if ( fastq_write(fp, r, prefix, tag, l_tag) )
+        error("Write error : %d", fp->errcode);
+}
+
+static void bundle_write(struct bundle *b)
+{
+    int i;
+    for ( i = 0; i < b->c1->n; ++i ) {
+        struct fastq_record *r1 = &b->c1->r[i];
+        struct fastq_record *r2 = b->c2 ? &b->c2->r[i] : NULL;
+        BGZF *fp1, *fp2;
+        if ( b->idx[i] == READ_DROPPED )
+            continue;
+        if ( b->idx[i] == READ_FAILED ) {
+            write_record(args.failed_1, r1, NULL, NULL, 0);
+            if ( args.failed_2 )
+                write_record(args.failed_2, r2, NULL, NULL, 0);
+            continue;
+        }
+        if ( b->idx[i] == READ_CLEAN ) {
+            fp1 = args.clean_1;
+            fp2 = args.clean_2;
+        }
+        else {
+            fp1 = args.barcode.names[b->idx[i]].fp1;
+            fp2 = args.barcode.names[b->idx[i]].fp2;
+        }
+        if ( args.umi_region == NULL ) {
+            write_record(fp1, r1, NULL, NULL, 0);
+            if ( fp2 )
+                write_record(fp2, r2, NULL, NULL, 0);
+        }
+        else {
+            // umi_parser only adds the _UID: prefix for the read carrying UMI in paired mode
+            write_record(fp1, r1, r2 ? "_UID:" : NULL, b->tag[i], b->l_tag[i]);
+            if ( fp2 )
+                write_record(fp2, r2, args.umi.id == 2 ? "_UID:" : NULL, b->tag[i], b->l_tag[i]);
+        }
+    }
+}
+
+static void *preprocess_pipeline(void *shared, int step, void *_data)
+{
+    if ( step == 0 ) {
+        return bundle_read();
+    }
+    else if ( step == 1 ) {
+        struct bundle *b = (struct bundle*)_data;
+        kt_for(args.threads, process_reads, b, b->c1->n);
+        return b;
+    }
+    else if ( step == 2 ) {
+        struct bundle *b = (struct bundle*)_data;
+        bundle_write(b);
+        bundle_destroy(b);
+    }
+    return 0;
+}
+
+static BGZF *open_output(const char *dir, const char *fn)
+{
+    kstring_t str = {0, 0, 0};
+    if ( dir )
+        ksprintf(&str, "%s/%s", dir, fn);
+    else
+        kputs(fn, &str);
+    BGZF *fp = bgzf_open(str.s, "w");
+    if ( fp == NULL )
+        error("%s : %s.", str.s, strerror(errno));
+    if ( args.pool && bgzf_thread_pool(fp, args.pool, 0) != 0 )
+        error("Failed to set up threads for %s.", str.s);
+    free(str.s);
+    return fp;
+}
+
+int fastq_preprocess()
+{
+    int i;
+    int file_is_fastq;
+
+    // check file type
+    file_is_fastq = check_file_is_fastq(args.read1_file);
+    if ( file_is_fastq == -1 )
+        error("%s is empty.", args.read1_file);
+    file_is_fastq = file_is_fastq == 0;
+
+    if ( args.read2_file != NULL ) {
+        int ret = check_file_is_fastq(args.read2_file);
+        if ( ret == -1 )
+            error("%s is empty.", args.read2_file);
+        if ( file_is_fastq != (ret == 0) )
+            error("Inconsistant read type, read1 and read2 must be in same format.");
+    }
+
+    // threads are shared by the input and all the output files
+    if ( args.threads > 1 ) {
+        args.pool = hts_tpool_init(args.threads);
+        if ( args.pool == NULL )
+            error("Failed to init thread pool.");
+    }
+
+    args.fp1 = fastq_reader_open(args.read1_file, args.pool);
+    if ( args.fp1 == NULL )
+        error("%s : %s", args.read1_file, strerror(errno));
+    if ( args.read2_file != NULL ) {
+        args.fp2 = fastq_reader_open(args.read2_file, args.pool);
+        if ( args.fp2 == NULL )
+            error("%s : %s", args.read2_file, strerror(errno));
+    }
+
+    // read 2 of the trimmed reads are dropped, failed reads are kept
+    int write_read2 = args.fp2 && args.drop_read2 == 0;
+    const char *suffix = file_is_fastq ? "fq" : "fa";
+    kstring_t temp = { 0, 0, 0};
+    if ( args.barcode_file ) {
+        for ( i = 0; i < args.barcode.n; ++i ) {
+            struct name *name = &args.barcode.names[i];
+            temp.l = 0;
+            ksprintf(&temp, "%s_1.%s.gz", name->name, suffix);
+            name->fp1 = open_output(args.output_dir, temp.s);
+            name->fp2 = NULL;
+            if ( write_read2 ) {
+                temp.l = 0;
+                ksprintf(&temp, "%s_2.%s.gz", name->name, suffix);
+                name->fp2 = open_output(args.output_dir, temp.s);
+            }
+        }
+        temp.l = 0;
+        ksprintf(&temp, "failed_1.%s.gz", suffix);
+        args.failed_1 = open_output(args.output_dir, temp.s);
+        if ( args.fp2 ) {
+            temp.l = 0;
+            ksprintf(&temp, "failed_2.%s.gz", suffix);
+            args.failed_2 = open_output(args.output_dir, temp.s);
+        }
+    }
+    else {
+        temp.l = 0;
+        if ( args.out1 )
+            kputs(args.out1, &temp);
+        else
+            ksprintf(&temp, "clean_1.%s.gz", suffix);
+        args.clean_1 = open_output(args.output_dir, temp.s);
+        if ( write_read2 ) {
+            temp.l = 0;
+            if ( args.out2 )
+                kputs(args.out2, &temp);
+            else
+                ksprintf(&temp, "clean_2.%s.gz", suffix);
+            args.clean_2 = open_output(args.output_dir, temp.s);
+        }
+    }
+    free(temp.s);
+
+    // read -> split, trim and parse UMI -> write, the middle step runs in parallel
+    kt_pipeline(args.threads > 1 ? 2 : 1, preprocess_pipeline, &args, 3);
+
+    fastq_reader_close(args.fp1);
+    fastq_reader_close(args.fp2);
+
+    if ( args.barcode_file )
+        clean_barcode_struct(&args.barcode);
+    if ( args.failed_1 )
+        bgzf_close(args.failed_1);
+    if ( args.failed_2 )
+        bgzf_close(args.failed_2);
+    if ( args.clean_1 )
+        bgzf_close(args.clean_1);
+    if ( args.clean_2 )
+        bgzf_close(args.clean_2);
+    if ( args.matcher )
+        adaptor_matcher_destroy(args.matcher);
+    if ( args.pool )
+        hts_tpool_destroy(args.pool);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if ( parse_args(argc, argv) )
+        return 1;
+
+    if ( fastq_preprocess() )
+        return 1;
+
+    return 0;
+}
@@ -3,9 +3,13 @@
 
 #include "utils.h"
 #include "number.h"
-#include "htslib/kseq.h"
 #include "htslib/kstring.h"
-#include <zlib.h>
+#include "htslib/bgzf.h"
+#include "fastq.h"
+#include "sequence.h"
+#include "kthread.h"
+#include "adaptor_detect.h"
+#include "htslib/thread_pool.h"
 
 static char * program_name =  "dyncutadaptor";
 static char * Version = "v0.1.4";
@@ -31,8 +35,6 @@ unsigned char bam_nt16_table[256] = {
 
 char *bam_nt16_rev_table = "=ACMGRSVTWYHKDBN";
 
-int8_t seq_comp_table[16] = { 0, 8, 4, 12, 2, 10, 9, 14, 1, 6, 5, 13, 3, 11, 7, 15 };
-
 // Illumina
 //static uint8_t illumina[19] = { 2, 8, 4, 8, 2, 8, 2, 8, 8, 1, 8, 1, 2, 1, 2, 1, 8, 2, 8};
 // TTCAGCCT
@@ -49,6 +51,17 @@ struct args {
     const char *fastq2;
     const char *out1;
     const char *out2;
+    int threads;
+    int chunk_size;
+    hts_tpool *pool;
+    struct fastq_reader *fp1;
+    struct fastq_reader *fp2;
+    BGZF *out_fp1;
+    BGZF *out_fp2;
+    int *prep;
+    long long all_reads;
+    long long cutted_reads;
+    long long filter_reads;
 } args = {
     .seed = 5,
     .slave_mode = 1,
@@ -60,33 +73,58 @@ struct args {
     .fastq2 = 0,
     .out1 = 0,
     .out2 = 0,
+    .threads = 1,
+    .chunk_size = 10000000,
+    .pool = NULL,
+    .fp1 = NULL,
+    .fp2 = NULL,
+    .out_fp1 = NULL,
+    .out_fp2 = NULL,
+    .prep = NULL,
+    .all_reads = 0,
+    .cutted_reads = 0,
+    .filter_reads = 0,
 };
 
 void seq_comp(uint8_t * seq, int length)
 {
-    int i;
-    for ( i = 0; i < length>>1; ++i ) {
-        int8_t t = seq_comp_table[seq[length - 1 - i]];
-        seq[length - 1 - i] = seq_comp_table[seq[i]];
-        seq[i] = t;
-    }
-    if ( length & 1 )
-        seq[i] = seq_comp_table[seq[i]];
+    seq_revcomp_nt16(seq, length);
 }
 
-KSEQ_INIT(gzFile, gzread)
-
 uint8_t * seq2code(char * str, int n) 
 {
     int i;
     uint8_t *a;
-    a = calloc(n, sizeof(uint8_t));
+    a = (uint8_t*)calloc(n, sizeof(uint8_t));
     for(i = 0; i < n; ++i) {
-        a[i] = bam_nt16_table[str[i]];
+        a[i] = bam_nt16_table[(uint8_t)str[i]];
     }
     return a;
 }
 
+// encoded reads of one worker, reused for all the reads it processes
+struct scratch {
+    int m;
+    uint8_t *s;
+    uint8_t *p;
+};
+
+static uint8_t *seq2code_buf(const char *str, int n, uint8_t *a)
+{
+    seq_encode_nt16(a, str, n);
+    return a;
+}
+
+static void scratch_resize(struct scratch *t, int n)
+{
+    if ( n <= t->m )
+        return;
+    t->m = n;
+    kroundup32(t->m);
+    t->s = (uint8_t*)realloc(t->s, t->m);
+    t->p = (uint8_t*)realloc(t->p, t->m);
+}
+
 static int * BMprep(const uint8_t * pat, int m)
 {
     int i, *suff, *prep, *bmGs, *bmBc;
@@ -197,42 +235,40 @@ int check_loc(uint8_t * seq, int l, uint8_t * a, int m, int loc)
     return 1;
 }
 
-void seq_reverse(char * seq, int len) 
+// keep the first loc bases of both reads
+static void seq_cut(struct fastq_record *r, int loc)
 {
-    int i;
-    for ( i = 0; i < len>>1; ++i) {
-        unsigned char t = seq[i];
-        seq[i] = seq[len - i -1];
-        seq[len - i - 1] = t;
-    }
+    if ( loc < r->l_seq )
+        r->l_seq = loc;
 }
 
-int seq_reloc(char * seq, unsigned long * len, unsigned long loc) 
+// keep the last loc bases of both reads, the adaptor is found on the complement strand
+static void seq_reloc(struct fastq_record *r, int loc)
 {
-    seq_reverse(seq, *len);
-    seq[loc] = 0;
-    seq_reverse(seq, loc);
-    *len = loc;
-    return 1;
+    if ( loc < r->l_seq ) {
+        r->seq += r->l_seq - loc;
+        if ( r->qual )
+            r->qual += r->l_seq - loc;
+        r->l_seq = loc;
+    }
 }
 
-long long filter_reads = 0;
-
-int cut_adaptor(kseq_t * seq1, kseq_t *seq2, uint8_t * pat, int len, int * prep) 
+// return 1 if adaptor cut, 0 if not found, -1 if the reads are too short after cutting
+int cut_adaptor(struct fastq_record *seq1, struct fastq_record *seq2, uint8_t * pat, int len, int * prep, struct scratch *t)
 {
     int m = 0, n = 0;
-    int l, loc = 0;		
+    int loc = 0;		
     uint8_t * s, * p;
-    s = seq2code(seq1->seq.s, seq1->seq.l);
-    p = seq2code(seq2->seq.s, seq2->seq.l);
-    int length = seq1->seq.l;
+    scratch_resize(t, seq1->l_seq > seq2->l_seq ? seq1->l_seq : seq2->l_seq);
+    s = seq2code_buf(seq1->seq, seq1->l_seq, t->s);
+    p = seq2code_buf(seq2->seq, seq2->l_seq, t->p);
     if ( args.slave_mode ) {
-        m = location(s, seq1->seq.l, pat, len, prep);
-        if ( check_loc(s, seq1->seq.l, pat, len, m) ) {
+        m = location(s, seq1->l_seq, pat, len, prep);
+        if ( check_loc(s, seq1->l_seq, pat, len, m) ) {
             loc = m;
         } else {
-            n = location(p, seq2->seq.l, pat, len, prep);
-            if ( check_loc(p, seq2->seq.l, pat, len, n) ) {
+            n = location(p, seq2->l_seq, pat, len, prep);
+            if ( check_loc(p, seq2->l_seq, pat, len, n) ) {
                 loc = n;
             }
         }
@@ -240,159 +276,193 @@ int cut_adaptor(kseq_t * seq1, kseq_t *seq2, uint8_t * pat, int len, int * prep)
             if ( args.minimum && loc < args.minimum) {
                 goto MINI;
             }
-            seq1->seq.s[loc] = 0; seq1->seq.l = l;
-            seq1->qual.s[loc] = 0; seq1->qual.l = l;
-            seq2->seq.s[loc] = 0; seq2->seq.l = l;
-            seq2->qual.s[loc] = 0; seq2->qual.l = l;
+            seq_cut(seq1, loc);
+            seq_cut(seq2, loc);
         } else {
-            seq_comp(s, seq1->seq.l);
-            seq_comp(p, seq2->seq.l);
+            seq_comp(s, seq1->l_seq);
+            seq_comp(p, seq2->l_seq);
             
-            m = location(s, seq1->seq.l, pat, len, prep);
-            if (check_loc(s, seq1->seq.l, pat, len, m)) {
+            m = location(s, seq1->l_seq, pat, len, prep);
+            if (check_loc(s, seq1->l_seq, pat, len, m)) {
                 loc = m;
                 
             } else {
-                n = location(p, seq2->seq.l, pat, len, prep);
-                if (check_loc(p, seq2->seq.l, pat, len, n))
+                n = location(p, seq2->l_seq, pat, len, prep);
+                if (check_loc(p, seq2->l_seq, pat, len, n))
                     loc = n;
             }
             if ( loc ) {
                 if (args.minimum && loc < args.minimum) {
                     goto MINI;
                 }
-                seq_reloc(seq1->seq.s, &seq1->seq.l, loc);
-                seq_reloc(seq2->seq.s, &seq2->seq.l, loc);
-                seq_reloc(seq1->qual.s, &seq1->qual.l, loc);
-                seq2->qual.s[loc] = 0; seq2->qual.l = l;
+                seq_reloc(seq1, loc);
+                seq_reloc(seq2, loc);
             } else {
-                free(s); free(p);
                 return 0;
             }
         }
     } else {
-        m = location(s, seq1->seq.l, pat, len, prep);
-        n = location(p, seq2->seq.l, pat, len, prep);
+        m = location(s, seq1->l_seq, pat, len, prep);
+        n = location(p, seq2->l_seq, pat, len, prep);
         if (m || n) {
             loc = m > n ? n > 0 ? n : m : m > 0 ? m : n;
             if (args.minimum && loc < args.minimum) {
                 goto MINI;
             }
-            seq1->seq.s[loc] = 0; seq1->seq.l = l;
-            seq1->qual.s[loc] = 0; seq1->qual.l = l;
-            seq2->seq.s[loc] = 0; seq2->seq.l = l;
-            seq2->qual.s[loc] = 0; seq2->qual.l = l;
+            seq_cut(seq1, loc);
+            seq_cut(seq2, loc);
         } else { 
-            seq_comp(s, seq1->seq.l);
-            seq_comp(p, seq2->seq.l);
-            m = location(s, seq1->seq.l, pat, len, prep);
-            n = location(p, seq2->seq.l, pat, len, prep);
+            seq_comp(s, seq1->l_seq);
+            seq_comp(p, seq2->l_seq);
+            m = location(s, seq1->l_seq, pat, len, prep);
+            n = location(p, seq2->l_seq, pat, len, prep);
             if (m || n) {
                 loc = m > n ? n > 0 ? n : m : m > 0 ? m : n;
                 if ( args.minimum && loc < args.minimum) {
                     goto MINI;
                 }
-                seq_reloc(seq1->seq.s, &seq1->seq.l, loc);
-                seq_reloc(seq2->seq.s, &seq2->seq.l, loc);
-                seq_reloc(seq1->qual.s, &seq1->qual.l, loc);
-                seq2->qual.s[loc] = 0; seq2->qual.l = l;
+                seq_reloc(seq1, loc);
+                seq_reloc(seq2, loc);
             } else {
-                free(s); free(p);
                 return 0;
             }
         }
     }
-    free(s); free(p);
     return 1;
 MINI:
-    filter_reads++;
-    free(s); free(p);
     return -1;
 }
 
-int check_name(kstring_t name1, kstring_t name2)
+// a chunk of read pairs processed together in the pipeline
+struct bundle {
+    struct fastq_chunk *c1;
+    struct fastq_chunk *c2;
+    int *ret; // return of cut_adaptor()
+};
+
+static struct scratch *scratch = NULL;
+
+static void bundle_destroy(struct bundle *b)
 {
-    char * s1 = name1.s;
-    char * s2 = name2.s;
-    size_t n;
-    for(n = 0; n < name1.l - 1; ++n, ++s1, ++s2) {
-        if (*s1 != *s2) {
-            return 0;
+    fastq_chunk_destroy(b->c1);
+    fastq_chunk_destroy(b->c2);
+    free(b->ret);
+    free(b);
+}
+
+// read a chunk of read pairs, return NULL at the end of file. read names are checked by the reader
+static struct bundle *bundle_read()
+{
+    struct bundle *b = (struct bundle*)calloc(1, sizeof(struct bundle));
+    b->c1 = fastq_chunk_init();
+    b->c2 = fastq_chunk_init();
+    int n = fastq_read_chunk2(args.fp1, args.fp2, b->c1, b->c2, args.chunk_size);
+    if ( n < 0 )
+        error("Failed to read sequences.");
+    if ( n == 0 ) {
+        bundle_destroy(b);
+        return NULL;
+    }
+    if ( b->c1->r[0].qual == NULL || b->c2->r[0].qual == NULL )
+        error("Only support FASTQ for now.");
+    b->ret = (int*)malloc(n*sizeof(int));
+    return b;
+}
+
+static void process_reads(void *_b, long i, int tid)
+{
+    struct bundle *b = (struct bundle*)_b;
+    b->ret[i] = cut_adaptor(&b->c1->r[i], &b->c2->r[i], args.adaptor, args.seed, args.prep, &scratch[tid]);
+}
+
+static void bundle_write(struct bundle *b)
+{
+    int i;
+    for ( i = 0; i < b->c1->n; ++i ) {
+        args.all_reads++;
+        if ( b->ret[i] )
+            args.cutted_reads++;
+        if ( b->ret[i] < 0 ) {
+            args.filter_reads++;
+            continue;
         }
+        if ( fastq_write(args.out_fp1, &b->c1->r[i], NULL, NULL, 0) )
+            error("Write error : %d", args.out_fp1->errcode);
+        if ( fastq_write(args.out_fp2, &b->c2->r[i], NULL, NULL, 0) )
+            error("Write error : %d", args.out_fp2->errcode);
     }
-    return 1;
 }
 
-int loadfastq_pe(const char * pe1, const char * pe2, uint8_t * a)
+static void *cut_pipeline(void *shared, int step, void *_data)
 {
-    gzFile fq1, fq2;
-    kseq_t * seq1, * seq2;
-    int l, m;
-    long long all_reads = 0;
-    long long cutted_reads = 0;
-    fq1 = gzopen(pe1, "r");
-    fq2 = gzopen(pe2, "r");
-    if (fq1 == NULL) {
+    if ( step == 0 ) {
+        return bundle_read();
+    }
+    else if ( step == 1 ) {
+        struct bundle *b = (struct bundle*)_data;
+        kt_for(args.threads, process_reads, b, b->c1->n);
+        return b;
+    }
+    else if ( step == 2 ) {
+        struct bundle *b = (struct bundle*)_data;
+        bundle_write(b);
+        bundle_destroy(b);
+    }
+    return 0;
+}
+
+static BGZF *open_output(const char *fn)
+{
+    BGZF *fp = bgzf_open(fn, "w");
+    if ( fp == NULL )
+        error("%s : %s.", fn, strerror(errno));
+    if ( args.pool && bgzf_thread_pool(fp, args.pool, 0) != 0 )
+        error("Failed to set up threads for %s.", fn);
+    return fp;
+}
+
+int loadfastq_pe(const char * pe1, const char * pe2)
+{
+    int i;
+    // threads are shared by the input and output files
+    if ( args.threads > 1 ) {
+        args.pool = hts_tpool_init(args.threads);
+        if ( args.pool == NULL )
+            error("Failed to init thread pool.");
+    }
+    args.fp1 = fastq_reader_open(pe1, args.pool);
+    if (args.fp1 == NULL) {
         fprintf(stderr, "[loadfastq_pe] %s : %s\n", pe1, strerror(errno));
         return 0;
     }
-    if (fq2 == NULL) {
+    args.fp2 = fastq_reader_open(pe2, args.pool);
+    if (args.fp2 == NULL) {
         fprintf(stderr, "[loadfastq_pe] %s : %s\n", pe2, strerror(errno));
+        fastq_reader_close(args.fp1);
         return 0;
     }
-    seq1 = kseq_init(fq1);
-    seq2 = kseq_init(fq2);
-    FILE * fp1, * fp2;
-    fp1 = fopen(args.out1, "w");
-    fp2 = fopen(args.out2, "w");
-    int *prep;
-    prep = BMprep(a, args.seed);
-    while (kseq_read(seq1) > 0 && kseq_read(seq2) > 0) {
-        all_reads++;
-        if (check_name(seq1->name, seq2->name) < 1) {
-            fprintf(stderr, "[loadfastq_pe] The fastq files not paired:\n %s\n%s\n",
-                    seq1->name.s, seq2->name.s);
-            goto LOADFQ_ERROR;
-        }
-        int n;
-        n = cut_adaptor(seq1, seq2, a, args.seed, prep);
-        if ( n )
-            cutted_reads++;
-        if ( n < 0 )
-            continue;
-        fputc('@', fp1);
-        fputs(seq1->name.s, fp1);
-        fputc('\n', fp1); 
-        fputs(seq1->seq.s, fp1);
-        fputs("\n", fp1);
-        fputs("+\n",fp1);
-        fputs(seq1->qual.s, fp1);
-        fputs("\n", fp1);
-        fputc('@', fp2);
-        fputs(seq2->name.s, fp2);
-        fputs("\n", fp2); 
-        fputs(seq2->seq.s, fp2);
-        fputs("\n", fp2);
-        fputs("+\n",fp2);
-        fputs(seq2->qual.s, fp2);
-        fputs("\n", fp2);
+    args.out_fp1 = open_output(args.out1);
+    args.out_fp2 = open_output(args.out2);
+    args.prep = BMprep(args.adaptor, args.seed);
+    scratch = (struct scratch*)calloc(args.threads, sizeof(struct scratch));
+
+    // read -> cut adaptor -> write, the middle step runs in parallel and the order of reads is kept
+    kt_pipeline(args.threads > 1 ? 2 : 1, cut_pipeline, &args, 3);
+
+    for ( i = 0; i < args.threads; ++i ) {
+        free(scratch[i].s);
+        free(scratch[i].p);
     }
-    free(prep);
-    kseq_destroy(seq1);
-    kseq_destroy(seq2);
-    gzclose(fq1);
-    gzclose(fq2);
-    fclose(fp1);
-    fclose(fp2);
-    fprintf(stdout, "dealed with %lld reads.\nTotal reads is %lld\nfilter %lld reads\n", cutted_reads, all_reads, filter_reads);
+    free(scratch);
+    free(args.prep);
+    fastq_reader_close(args.fp1);
+    fastq_reader_close(args.fp2);
+    if ( bgzf_close(args.out_fp1) || bgzf_close(args.out_fp2) )
+        error("Failed to close the output files.");
+    if ( args.pool )
+        hts_tpool_destroy(args.pool);
+    fprintf(stdout, "dealed with %lld reads.\nTotal reads is %lld\nfilter %lld reads\n", args.cutted_reads, args.all_reads, args.filter_reads);
     return 1;
-    
-  LOADFQ_ERROR:
-    kseq_destroy(seq1);
-    kseq_destroy(seq2);
-    gzclose(fq1);
-    gzclose(fq2);
-    return 0;
 }
 
 
@@ -404,15 +474,16 @@ Usage: %s --fastq1 [in1.fq.gz] --fastq2 [in2.fq.gz] \n\
 ======================================================\n\
 -fastq1, -f         Fastq file of read1.\n\
 -fastq2, -r         Fastq file of read2.\n\
--outfq1, -o         New fastq file of read1.\n\
--outfq2, -p         New fastq file of read2.\n\
+-outfq1, -o         New fastq file of read1, BGZF compressed.[reads1.fq.gz]\n\
+-outfq2, -p         New fastq file of read2, BGZF compressed.[reads2.fq.gz]\n\
 -seed,   -s         Initial length of adaptor.[5]\n\
 -slave,  -d         Cut all sequence like adaptor.\n\
 -mis,    -i         Tolerate mismatchs.[1]\n\
 -tail,   -t         Don't cut tail in the last n bp.[3]\n\
 -min,    -m         Don't keep seqences shorter.[0]\n\
+-threads, -@        Threads for reading, cutting and compressing.[1]\n\
 -help,   -h         See this information.\n\
--adaptor            Adaptor sequence.\n\
+-adaptor            Adaptor sequence, or auto to detect it from the first 1M reads of read1.\n\
 ======================================================\n\
 Author: Shi Quan (shiquan@genomics.cn)\n\
 Pages:\n\
@@ -435,6 +506,7 @@ int parse_args(int ac, char **av)
     const char *tail = 0;
     const char *mismatch = 0;
     const char *adaptor = 0;
+    const char *threads = 0;
     if ( ac == 0 )
         return usage(0);
     
@@ -459,6 +531,10 @@ int parse_args(int ac, char **av)
             arg_var = &seed;
         else if ( (strcmp(a, "-mis") == 0 || strcmp(a, "-i") == 0 ) && mismatch == 0 )
             arg_var = &mismatch;
+        else if ( (strcmp(a, "-tail") == 0 || strcmp(a, "-t") == 0 ) && tail == 0 )
+            arg_var = &tail;
+        else if ( (strcmp(a, "-threads") == 0 || strcmp(a, "-@") == 0 ) && threads == 0 )
+            arg_var = &threads;
         else if ( strcmp(a, "-adaptor") == 0 && adaptor == 0 )
             arg_var = &adaptor;
         
@@ -497,6 +573,23 @@ int parse_args(int ac, char **av)
         args.tail = str2int((char*)tail);
     }
 
+    if ( threads ) {
+        args.threads = str2int((char*)threads);
+        if ( args.threads < 1 )
+            args.threads = 1;
+    }
+
+    struct adaptor_guess guess = { 0, 0, 0, 0, 0 };
+    if ( adaptor && strcmp(adaptor, "auto") == 0 ) {
+        int ret = adaptor_detect(args.fastq1, 1000000, args.threads, &guess);
+        if ( ret == -1 )
+            error("%s : %s.", args.fastq1, strerror(errno));
+        adaptor_guess_print(stderr, &guess);
+        if ( ret == 1 )
+            error("Failed to detect the adaptor, please specify it with -adaptor.");
+        adaptor = guess.seq;
+    }
+
     if ( adaptor ) {
         int length = strlen(adaptor);
         args.adaptor = seq2code((char*)adaptor, length);
@@ -506,6 +599,7 @@ int parse_args(int ac, char **av)
         }
         if ( args.adaptor == NULL )
             error("Failed to recongnise adaptor sequence. %s.", adaptor);
+        adaptor_guess_destroy(&guess);
     } else {
         // Default is BGISEQ AD153 adaptor       
         args.adaptor = seq2code("TTCAGCCT",8);
@@ -530,10 +624,10 @@ int parse_args(int ac, char **av)
     }
 
     if ( args.out1 == NULL )
-        args.out1 = "reads1.fq";
+        args.out1 = "reads1.fq.gz";
 
     if ( args.out2 == NULL )
-        args.out2 = "reads2.fq";
+        args.out2 = "reads2.fq.gz";
     
     return 0;
 }
@@ -542,6 +636,7 @@ int main(int argc, char *argv[])
 {
     if ( parse_args(--argc, ++argv) )
         return 1;
-    loadfastq_pe(args.fastq1, args.fastq2, args.adaptor);
-    return 1;
+    if ( loadfastq_pe(args.fastq1, args.fastq2) == 0 )
+        return 1;
+    return 0;
 }
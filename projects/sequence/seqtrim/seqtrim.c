@@ -1,25 +1,39 @@
 #include "utils.h"
 #include <string.h>
 #include <htslib/kstring.h>
-#include <htslib/kseq.h>
-#include <zlib.h>
+#include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
 #include "sequence.h"
+#include "fastq.h"
+#include "kthread.h"
 #include "pkg_version.h"
 
-KSEQ_INIT(gzFile, gzread)
-
 struct args {
     const char *input_fname;
+    const char *output_fname;
     int trim_start; // the start location of the sequences
     int trim_end; // the end location of the sequences
     int print_title;
     int compl;
+    int compress;
+    int threads;
+    int chunk_size;
+    struct fastq_reader *fp;
+    BGZF *out;
+    hts_tpool *pool;
 } args = {
     .input_fname = 0,
+    .output_fname = 0,
     .trim_start = 0,
     .trim_end = 0,
     .print_title = 1,
     .compl = 0,
+    .compress = 0,
+    .threads = 1,
+    .chunk_size = 10000000,
+    .fp = NULL,
+    .out = NULL,
+    .pool = NULL,
 };
 
 int usage()
@@ -30,6 +44,9 @@ int usage()
     fprintf(stderr, "    -end loc      // end location of the sequences, default is the end of the sequences.\n");
     fprintf(stderr, "    -seq          // only export the sequences. no titles.\n");
     fprintf(stderr, "    -comp         // export complement strand of sequences\n");
+    fprintf(stderr, "    -o FILE       // output file, BGZF compressed if ends with .gz [stdout]\n");
+    fprintf(stderr, "    -z            // compress the output by BGZF\n");
+    fprintf(stderr, "    -@ INT        // threads for decompressing, compressing and pipelining [1]\n");
     fprintf(stderr, "\nVersion: %s\n", PROJECTS_VERSION);
     fprintf(stderr, "Homepage: https://github.com/shiquan/small_projects\n");
     return 1;
@@ -41,6 +58,7 @@ int parse_args(int argc, char **argv)
     int i;
     const char *start = 0;
     const char *end = 0;
+    const char *threads = 0;
     for (i = 1; i < argc; )  {
         const char *a = argv[i++];
         if ( strcmp(a, "-h") == 0)
@@ -50,6 +68,14 @@ int parse_args(int argc, char **argv)
             var = &start;
         else if ( strcmp(a, "-end") == 0 )
             var = &end;
+        else if ( strcmp(a, "-o") == 0 && args.output_fname == 0 )
+            var = &args.output_fname;
+        else if ( strcmp(a, "-@") == 0 && threads == 0 )
+            var = &threads;
+        else if ( strcmp(a, "-z") == 0 ) {
+            args.compress = 1;
+            continue;
+        }
         else if ( strcmp(a, "-seq") == 0 ) {            
             args.print_title = 0;
             continue;
@@ -89,84 +115,112 @@ int parse_args(int argc, char **argv)
     }
     if (args.trim_end && args.trim_start >= args.trim_end)
         error("Should set location start smaller than end.");
+
+    if ( threads ) {
+        args.threads = atoi(threads);
+        if ( args.threads < 1 )
+            args.threads = 1;
+    }
+    if ( args.output_fname == 0 )
+        args.output_fname = "-";
+    else if ( strlen(args.output_fname) > 3 && strcmp(args.output_fname + strlen(args.output_fname) - 3, ".gz") == 0 )
+        args.compress = 1;
     
     return 0;
 }
+// records are formatted into one block per chunk, and written at once
+static void format_record(struct fastq_record *seq, kstring_t *str)
+{
+    if ( args.trim_start && args.trim_start > seq->l_seq)
+        return;
+
+    int l_qual = seq->qual ? seq->l_seq : 0;
+    if ( args.print_title ) {
+        kputc(l_qual ? '@' : '>', str);
+        kputsn(seq->name, seq->l_name, str);
+        kputc('\n', str);
+    }
+
+    int start = args.trim_start ? args.trim_start - 1 : 0;
+    int end = args.trim_end && args.trim_end < seq->l_seq ? args.trim_end : seq->l_seq;
+    int i, l = end - start;
+    ks_resize(str, str->l + l + 1);
+    if ( args.compl == 1 )
+        seq_revcomp(str->s + str->l, seq->seq + start, l);
+    else
+        memcpy(str->s + str->l, seq->seq + start, l);
+    str->l += l;
+    kputc('\n', str);
+    if ( args.print_title && l_qual ) {
+        kputsn("+\n", 2, str);
+        ks_resize(str, str->l + l + 1);
+        if ( args.compl == 1 ) {
+            for ( i = 0; i < l; ++i )
+                str->s[str->l + i] = seq->qual[end - 1 - i];
+        } else {
+            memcpy(str->s + str->l, seq->qual + start, l);
+        }
+        str->l += l;
+        kputc('\n', str);
+    }
+}
+
+// reading and writing are pipelined, compression runs on the thread pool
+static void *trim_pipeline(void *shared, int step, void *_data)
+{
+    if ( step == 0 ) {
+        struct fastq_chunk *c = fastq_chunk_init();
+        int n = fastq_read_chunk(args.fp, c, args.chunk_size);
+        if ( n < 0 )
+            error("Failed to read sequences.");
+        if ( n == 0 ) {
+            fastq_chunk_destroy(c);
+            return 0;
+        }
+        return c;
+    }
+    else if ( step == 1 ) {
+        struct fastq_chunk *c = (struct fastq_chunk*)_data;
+        kstring_t str = {0, 0, 0};
+        int i;
+        for ( i = 0; i < c->n; ++i )
+            format_record(&c->r[i], &str);
+        if ( str.l && bgzf_write(args.out, str.s, str.l) < 0 )
+            error("Write error : %d", args.out->errcode);
+        free(str.s);
+        fastq_chunk_destroy(c);
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     if ( parse_args(argc, argv) )
         return 1;
 
-    gzFile fp;
-    kseq_t *seq;
-    fp = strcmp(args.input_fname, "-") == 0 ? gzdopen(fileno(stdin), "r") : gzopen(args.input_fname, "r");
-    if ( fp == 0 )
+    // threads are shared by the input and output files
+    if ( args.threads > 1 ) {
+        args.pool = hts_tpool_init(args.threads);
+        if ( args.pool == NULL )
+            error("Failed to init thread pool.");
+    }
+
+    args.fp = fastq_reader_open(args.input_fname, args.pool);
+    if ( args.fp == NULL )
         error("%s : %s", args.input_fname, strerror(errno));
-    seq = kseq_init(fp);
 
-    int l;
-    while ((l = kseq_read(seq)) >= 0) {
-        if ( args.trim_start && args.trim_start > seq->seq.l)
-            continue;
-        
-        if ( args.print_title ) {
-            putchar(seq->qual.l ? '@' : '>');
-            fputs(seq->name.s, stdout);
-            putchar('\n');
-        }
+    args.out = bgzf_open(args.output_fname, args.compress ? "w" : "wu");
+    if ( args.out == NULL )
+        error("%s : %s", args.output_fname, strerror(errno));
+    if ( args.compress && args.pool && bgzf_thread_pool(args.out, args.pool, 0) != 0 )
+        error("Failed to set up threads for %s.", args.output_fname);
 
-        if ( args.trim_end && args.trim_end < seq->seq.l ) {
-            seq->seq.s[args.trim_end] = '\0';
-            seq->seq.l = args.trim_end;
-            if ( seq->qual.l ) {
-                seq->qual.s[args.trim_end] = '\0';
-                seq->qual.l = args.trim_end;
-            }
-        }
+    kt_pipeline(args.threads > 1 ? 2 : 1, trim_pipeline, &args, 2);
 
-        if ( args.trim_start ) {
-            if ( args.compl == 1 ) {
-                int i;
-                for ( i = seq->seq.l -1 ; i >= args.trim_start-1; --i )
-                    putchar("TGCAN"[seq2code4(seq->seq.s[i])]);
-            } else {
-                fputs(seq->seq.s + args.trim_start -1, stdout);
-            }
-            putchar('\n');
-            if ( args.print_title && seq->qual.l) {
-                putchar('+'); putchar('\n');
-                if ( args.compl == 1 ) {
-                    int i;
-                    for ( i = seq->qual.l - 1; i >= args.trim_start-1; --i)
-                        putchar(seq->qual.s[i]);
-                } else {
-                    fputs(seq->qual.s + args.trim_start -1, stdout);
-                }
-                putchar('\n');
-            }
-        } else {
-            if ( args.compl == 1 ) {
-                int i;
-                for ( i = seq->seq.l -1 ; i >= 0; --i )
-                    putchar("TGCAN"[seq2code4(seq->seq.s[i])]);            
-            } else {
-                fputs(seq->seq.s, stdout);
-            }
-            putchar('\n');
-            if ( args.print_title && seq->qual.l) {
-                putchar('+'); putchar('\n');
-                if ( args.compl == 1 ) {
-                    int i;
-                    for ( i = seq->qual.l -1; i >= 0; --i )
-                        putchar(seq->qual.s[i]);
-                } else {
-                    fputs(seq->qual.s, stdout);
-                }
-                putchar('\n');
-            }            
-        }
-    }
-    kseq_destroy(seq);
-    gzclose(fp);
+    if ( bgzf_close(args.out) )
+        error("Failed to close %s.", args.output_fname);
+    fastq_reader_close(args.fp);
+    if ( args.pool )
+        hts_tpool_destroy(args.pool);
     return 0;
 }
@@ -1,14 +1,23 @@
 #include "utils.h"
 #include <string.h>
 #include "htslib/kstring.h"
-#include "htslib/kseq.h"
 #include "htslib/bgzf.h"
-#include <zlib.h>
 #include "number.h"
 #include "fastq.h"
+#include "kthread.h"
+#include "bucket_writer.h"
+#include "ubam.h"
+#include "htslib/thread_pool.h"
+#include "htslib/khash.h"
 #include "pkg_version.h"
 
-KSEQ_INIT(gzFile, gzread)
+// longest dual index barcode, both indexes joined
+#define DUAL_INDEX_MAX 64
+// distinct barcodes of failed reads counted, and reported
+#define UNASSIGNED_MAX 1000000
+#define UNASSIGNED_TOP 100
+
+KHASH_MAP_INIT_STR(count, long)
 
 int usage()
 {
@@ -17,12 +26,23 @@ int usage()
             "Usage :\n"
             "split_barcode -reg 2:101-113 -barcode barcode.txt reads1.fq.gz [reads2.fq.gz]\n"
             "    -reg       // barcode region in read sequence, format is <read 1|2> : <start> - <end>\n"
+            "    -reg2      // region of the second index for dual index barcodes, in the same format\n"
             "    -comp      // use the complement of barcode sequences\n"
             "    -mismatch  // maximum mismatch tolerant, [1-3]\n"
+            "    -mismatch2 // maximum mismatch tolerant of the second index [same as -mismatch]\n"
             "    -barcode   // barcode file, this parameter is mandontory\n"
             "    -out       // output directory.\n"
+            "    -t         // threads, reading, matching and writing are pipelined [1]\n"
+            "    -mem       // memory limit in MB for output buffers, keep sample files closed until buffers are full\n"
+            "    -max_open  // maximum number of output files open at the same time in -mem mode [128]\n"
+            "    -ubam      // export unaligned BAM per sample with barcode in BC tag, instead of FASTQ files\n"
+            "    -qbin      // bin qualities, illumina8, bin4 or custom bins like 0-9:6,10-29:20,30-93:37\n"
+            "    -unassigned // report the most frequent barcodes of failed reads to this file\n"
+            "    -stdout    // write reads of all samples to stdout, uncompressed and interleaved, with barcode in\n"
+            "               // a BC:Z: comment (bwa mem -C keeps it). failed reads are still written to files\n"
             "\nAbout the barcode file, it should consist of barcode name and barcode sequences columns, and\n"
-            "seperated by tab.\n"
+            "seperated by tab. For dual index barcodes, the third column is the second index. Both indexes\n"
+            "are matched together in one lookup, each within its own mismatches.\n"
             "Version: %s"
             "Homepage: \n"
             "https://github.com/shiquan/small_projects\n",
@@ -35,28 +55,104 @@ struct args {
     const char *barcode_file;
     const char *output_dir;
     const char *barcode_region;
+    const char *barcode_region2;
+    const char *unassigned_file;
     const char *read1_file;
     const char *read2_file;
     int mismatch;
+    int mismatch2;
     int compl_flag;    
     int start;
     int end;
+    // region of the second index, read_flag2 is 0 for single index
+    int start2;
+    int end2;
+    int read_flag2;
+    int threads;
+    int chunk_size;
+    int read_flag;
+    size_t mem_limit;
+    int max_open;
     struct barcode barcode;
+    // bounded memory mode, records are kept in buckets instead of BGZF per sample
+    struct bucket_writer *buckets;
+    int *bucket1;
+    int *bucket2;
+    // unaligned BAM mode, both ends are kept in one file per sample
+    int ubam_flag;
+    struct ubam **ubam;
+    struct ubam *failed_ubam;
+    // stdout mode, records of all samples are collected and written in blocks
+    int stdout_flag;
+    BGZF *out;
+    kstring_t out_buf;
+    // barcodes of failed reads
+    kh_count_t *unassigned;
+    long n_other;
+    long n_reads;
+    long n_failed;
+    kstring_t tag;
     BGZF *failed_1;
     BGZF *failed_2;
+    struct fastq_reader *fp1;
+    struct fastq_reader *fp2;
+    hts_tpool *pool;
 } args = {
     .barcode_file = NULL,
     .output_dir = NULL,
     .barcode_region = NULL,
+    .barcode_region2 = NULL,
+    .unassigned_file = NULL,
     .read1_file = NULL,
     .read2_file = NULL,
     .mismatch = 0,
+    .mismatch2 = -1,
     .compl_flag = 0,
+    .start2 = 0,
+    .end2 = 0,
+    .read_flag2 = 0,
+    .threads = 1,
+    .chunk_size = 10000000,
+    .read_flag = 1,
+    .mem_limit = 0,
+    .max_open = 128,
     .barcode = {0, 0, 0},
+    .buckets = NULL,
+    .bucket1 = NULL,
+    .bucket2 = NULL,
+    .ubam_flag = 0,
+    .ubam = NULL,
+    .failed_ubam = NULL,
+    .stdout_flag = 0,
+    .out = NULL,
+    .out_buf = {0, 0, 0},
+    .unassigned = NULL,
+    .n_other = 0,
+    .n_reads = 0,
+    .n_failed = 0,
+    .tag = {0, 0, 0},
     .failed_1 = NULL,
     .failed_2 = NULL,
+    .fp1 = NULL,
+    .fp2 = NULL,
+    .pool = NULL,
 };
 
+// parse <read 1|2> : <start> - <end>, return 1 on failure
+static int parse_region(const char *reg, int *read, int *start, int *end)
+{
+    int i, l = strlen(reg);
+    if ( l <= 4 || (reg[0] != '1' && reg[0] != '2') || reg[1] != ':' )
+        return 1;
+    for ( i = 2; i < l; ++i )
+        if ( reg[i] == '-')
+            break;
+    *read = reg[0] == '1' ? 1 : 2;
+    *start = str2int_l((char*)reg+2, i - 2);
+    *end = str2int_l((char*)reg+i+1, l -i);
+    return *start < 1 || *end < *start;
+}
+
 static int parse_args(int ac, char **av)
 {
     if ( ac == 1 )
@@ -64,6 +160,11 @@ static int parse_args(int ac, char **av)
     
     int i;
     const char *mismatch = NULL;
+    const char *mismatch2 = NULL;
+    const char *threads = NULL;
+    const char *mem = NULL;
+    const char *max_open = NULL;
+    const char *qual_bins = NULL;
     for ( i = 1; i < ac; ) {
         const char *a = av[i++];
         if ( strcmp(a, "-h") == 0 )
@@ -76,8 +177,22 @@ static int parse_args(int ac, char **av)
             var = &args.output_dir;
         else if ( strcmp(a, "-reg") == 0 && args.barcode_region == NULL )
             var = &args.barcode_region;
+        else if ( strcmp(a, "-reg2") == 0 && args.barcode_region2 == NULL )
+            var = &args.barcode_region2;
         else if ( strcmp(a, "-mismatch") == 0 && mismatch == NULL )
             var = &mismatch;
+        else if ( strcmp(a, "-mismatch2") == 0 && mismatch2 == NULL )
+            var = &mismatch2;
+        else if ( strcmp(a, "-unassigned") == 0 && args.unassigned_file == NULL )
+            var = &args.unassigned_file;
+        else if ( strcmp(a, "-qbin") == 0 && qual_bins == NULL )
+            var = &qual_bins;
+        else if ( strcmp(a, "-t") == 0 && threads == NULL )
+            var = &threads;
+        else if ( strcmp(a, "-mem") == 0 && mem == NULL )
+            var = &mem;
+        else if ( strcmp(a, "-max_open") == 0 && max_open == NULL )
+            var = &max_open;
 
         if ( var != 0 ) {
             if ( i == ac ) {
@@ -91,6 +206,14 @@ static int parse_args(int ac, char **av)
             args.compl_flag = 1;
             continue;
         }
+        if ( strcmp(a, "-ubam") == 0 ) {
+            args.ubam_flag = 1;
+            continue;
+        }
+        if ( strcmp(a, "-stdout") == 0 ) {
+            args.stdout_flag = 1;
+            continue;
+        }
 
         if ( args.read1_file == NULL )
             args.read1_file = a;
@@ -115,73 +238,317 @@ static int parse_args(int ac, char **av)
             error("-mismatch should be defined between [1,3].");
     }
 
-    int l;
-    l = strlen(args.barcode_region);
-    if ( l > 4 && (args.barcode_region[0] == '1' || args.barcode_region[0] == '2') && args.barcode_region[1] == ':') {
-        for ( i = 2; i < l; ++i )
-            if ( args.barcode_region[i] == '-')
-                break;
-        args.start = str2int_l((char*)args.barcode_region+2, i - 2);
-        args.end = str2int_l((char*)args.barcode_region+i+1, l -i);
-        if ( args.start < 1 || args.end < 1 )
-            error("Barcode region unsupport. %d-%d", args.start, args.end);
-    } else {
+    if ( threads ) {
+        args.threads = str2int((char*)threads);
+        if ( args.threads < 1 )
+            args.threads = 1;
+    }
+
+    if ( mem ) {
+        int m = str2int((char*)mem);
+        if ( m < 1 )
+            error("-mem should be a positive number of MB.");
+        args.mem_limit = (size_t)m << 20;
+    }
+
+    if ( args.ubam_flag && mem )
+        error("-ubam does not work with -mem.");
+
+    if ( args.stdout_flag && (args.ubam_flag || mem) )
+        error("-stdout does not work with -ubam or -mem.");
+
+    if ( max_open ) {
+        args.max_open = str2int((char*)max_open);
+        if ( args.max_open < 1 )
+            error("-max_open should be a positive number.");
+    }
+
+    if ( qual_bins ) {
+        uint8_t table[QUAL_BINS_SIZE];
+        if ( fastq_qual_bins_parse(qual_bins, table) )
+            error("Unknown quality bins, %s.", qual_bins);
+        fastq_set_qual_bins(table);
+    }
+
+    if ( parse_region(args.barcode_region, &args.read_flag, &args.start, &args.end) )
         error("-reg does not look like the supported format. %s", args.barcode_region);
+    if ( args.barcode_region2 && parse_region(args.barcode_region2, &args.read_flag2, &args.start2, &args.end2) )
+        error("-reg2 does not look like the supported format. %s", args.barcode_region2);
+
+    args.mismatch2 = args.mismatch;
+    if ( mismatch2 ) {
+        args.mismatch2 = str2int((char*)mismatch2);
+        if ( args.mismatch2 < 0 )
+            error("-mismatch2 should be a non-negative number.");
     }
+
     if ( load_barcode_file(args.barcode_file, &args.barcode) ) {
         error_print("Failed to load barcode file.");
         return 1;
     }    
-   
+    int l1 = args.end - args.start + 1;
+    if ( args.read_flag2 ) {
+        int l2 = args.end2 - args.start2 + 1;
+        if ( args.barcode.l_index1 == 0 )
+            error("-reg2 requires the second index in the third column of %s.", args.barcode_file);
+        if ( args.barcode.l_index1 != l1 )
+            error("The first index is %d bases in %s, but -reg is %d bases.", args.barcode.l_index1, args.barcode_file, l1);
+        if ( l1 + l2 > DUAL_INDEX_MAX )
+            error("Dual indexes longer than %d bases are not supported.", DUAL_INDEX_MAX);
+        barcode_index_build2(&args.barcode, l1, args.mismatch, l2, args.mismatch2, 0);
+    }
+    else {
+        if ( args.barcode.l_index1 )
+            error("%s has dual indexes, the second index should be specified by -reg2.", args.barcode_file);
+        barcode_index_build(&args.barcode, l1, args.mismatch, 0);
+    }
+
+    // every sample file keeps its partial block in memory
+    if ( args.mem_limit ) {
+        int n_buckets = args.barcode.n * (args.read2_file ? 2 : 1);
+        size_t min = (size_t)n_buckets * BGZF_BLOCK_SIZE;
+        if ( args.mem_limit < min ) {
+            args.mem_limit = (min + (1<<20) - 1) >> 20 << 20;
+            warnings("-mem is raised to %d MB, one block for each of %d sample files.", (int)(args.mem_limit >> 20), n_buckets);
+        }
+    }
+
     return 0;
 }
 
-int split_barcode()
+// a chunk of reads processed together in the pipeline
+struct bundle {
+    struct fastq_chunk *c1;
+    struct fastq_chunk *c2;
+    int *idx; // matched barcode, -1 for failed reads
+};
+
+static void bundle_destroy(struct bundle *b)
 {
-    int i;
-    int l1, l2;
-    int file_is_fastq;
+    fastq_chunk_destroy(b->c1);
+    fastq_chunk_destroy(b->c2);
+    free(b->idx);
+    free(b);
+}
 
-    gzFile fp1, fp2;
-    kseq_t *seq1 = NULL;
-    kseq_t *seq2 = NULL;
-    fp1 = gzopen(args.read1_file, "r");
-    if ( fp1 == 0 )
-        error("%s : %s", args.read1_file, strerror(errno));
+// read a chunk of records, return NULL at the end of file
+static struct bundle *bundle_read()
+{
+    struct bundle *b = (struct bundle*)calloc(1, sizeof(struct bundle));
+    int n;
+    b->c1 = fastq_chunk_init();
+    if ( args.fp2 ) {
+        b->c2 = fastq_chunk_init();
+        n = fastq_read_chunk2(args.fp1, args.fp2, b->c1, b->c2, args.chunk_size);
+    }
+    else {
+        n = fastq_read_chunk(args.fp1, b->c1, args.chunk_size);
+    }
+    if ( n < 0 )
+        error("Failed to read sequences.");
+    if ( n == 0 ) {
+        bundle_destroy(b);
+        return NULL;
+    }
+    b->idx = (int*)malloc(n*sizeof(int));
+    return b;
+}
 
-    // check file type
-    seq1 = kseq_init(fp1);
-    l1 = kseq_read(seq1);
-    if ( l1 >= 0 ) {
-        file_is_fastq = seq1->qual.l > 0 ? 1 : 0;
-        kseq_destroy(seq1);
-        gzclose(fp1);
-        fp1 = gzopen(args.read1_file, "r");
-        seq1 = kseq_init(fp1);
-    } else {
-        error("%s is empty.", args.read1_file);
+static void match_barcode(void *_data, long i, int tid)
+{
+    struct bundle *b = (struct bundle*)_data;
+    struct fastq_record *r = args.read_flag == 1 ? &b->c1->r[i] : &b->c2->r[i];
+    // reads shorter than the barcode region are failed
+    if ( r->l_seq < args.end ) {
+        b->idx[i] = -1;
+        return;
+    }
+    if ( args.read_flag2 == 0 ) {
+        b->idx[i] = barcode_lookup(&args.barcode, r->seq+args.start-1);
+        return;
+    }
+    // both indexes are joined and looked up at once
+    struct fastq_record *r2 = args.read_flag2 == 1 ? &b->c1->r[i] : &b->c2->r[i];
+    char bc[DUAL_INDEX_MAX];
+    int l1 = args.end - args.start + 1;
+    if ( r2->l_seq < args.end2 ) {
+        b->idx[i] = -1;
+        return;
     }
+    memcpy(bc, r->seq + args.start - 1, l1);
+    memcpy(bc + l1, r2->seq + args.start2 - 1, args.end2 - args.start2 + 1);
+    b->idx[i] = barcode_lookup(&args.barcode, bc);
+}
 
-    // check read 2
-    if ( args.read2_file != NULL ) {
-        fp2 = gzopen(args.read2_file, "r");
-        if ( fp2 == 0 )
-            error("%s : %s", args.read2_file, strerror(errno));
-        seq2 = kseq_init(fp2);
-        l2 = kseq_read(seq2);
-        if ( l2 >= 0 ) {
-            if ( file_is_fastq != (seq2->qual.l != 0) )
-                error("Inconsistant read type, read1 and read2 must be in same format.");
-            kseq_destroy(seq2);
-            gzclose(fp2);
-            fp2 = gzopen(args.read2_file, "r");
-            seq2 = kseq_init(fp2);
-        } else {
-            error("%s is empty.", args.read2_file);
+static void region_tag(struct fastq_record *r, int start, int end, kstring_t *s)
+{
+    if ( r->l_seq >= start )
+        kputsn(r->seq + start - 1, (r->l_seq < end ? r->l_seq : end) - start + 1, s);
+}
+
+// the barcode as sequenced, may be shorter than the region for failed reads. dual
+// indexes are joined by a hyphen, as the BC tag in SAM
+static int barcode_tag(struct fastq_record *r1, struct fastq_record *r2, kstring_t *s)
+{
+    s->l = 0;
+    region_tag(args.read_flag == 1 ? r1 : r2, args.start, args.end, s);
+    if ( args.read_flag2 ) {
+        kputc('-', s);
+        region_tag(args.read_flag2 == 1 ? r1 : r2, args.start2, args.end2, s);
+    }
+    if ( s->s == NULL )
+        kputsn("", 0, s);
+    return s->l;
+}
+
+// count the barcodes of failed reads, new barcodes are not added once the hash is full
+static void count_unassigned(struct fastq_record *r1, struct fastq_record *r2)
+{
+    int ret, l = barcode_tag(r1, r2, &args.tag);
+    khiter_t k = kh_get(count, args.unassigned, args.tag.s);
+    if ( k == kh_end(args.unassigned) ) {
+        if ( kh_size(args.unassigned) >= UNASSIGNED_MAX ) {
+            args.n_other++;
+            return;
         }
+        k = kh_put(count, args.unassigned, strndup(args.tag.s, l), &ret);
+        kh_val(args.unassigned, k) = 0;
     }
+    kh_val(args.unassigned, k)++;
+}
 
-    // open file handlers
+static void bundle_write_ubam(struct bundle *b)
+{
+    int i;
+    for ( i = 0; i < b->c1->n; ++i ) {
+        struct fastq_record *r1 = &b->c1->r[i];
+        struct fastq_record *r2 = b->c2 ? &b->c2->r[i] : NULL;
+        struct ubam *u = b->idx[i] == -1 ? args.failed_ubam : args.ubam[b->idx[i]];
+        int l_bc = barcode_tag(r1, r2, &args.tag);
+        struct fastq_record t1 = *r1;
+        if ( r2 ) {
+            struct fastq_record t2 = *r2;
+            fastq_strip_read_number(&t1, '1');
+            fastq_strip_read_number(&t2, '2');
+            if ( ubam_write(u, &t1, 1, NULL, 0, args.tag.s, l_bc) || ubam_write(u, &t2, 2, NULL, 0, args.tag.s, l_bc) )
+                error("Failed to write BAM records.");
+        }
+        else if ( ubam_write(u, &t1, 0, NULL, 0, args.tag.s, l_bc) ) {
+            error("Failed to write BAM records.");
+        }
+    }
+}
+
+static void bundle_write(struct bundle *b)
+{
+    int i;
+    args.n_reads += b->c1->n;
+    for ( i = 0; i < b->c1->n; ++i ) {
+        if ( b->idx[i] != -1 )
+            continue;
+        args.n_failed++;
+        if ( args.unassigned )
+            count_unassigned(&b->c1->r[i], b->c2 ? &b->c2->r[i] : NULL);
+    }
+    if ( args.ubam_flag ) {
+        bundle_write_ubam(b);
+        return;
+    }
+    for ( i = 0; i < b->c1->n; ++i ) {
+        BGZF *fp1, *fp2;
+        if ( b->idx[i] == -1 ) {
+            fp1 = args.failed_1;
+            fp2 = args.failed_2;
+        }
+        else if ( args.stdout_flag ) {
+            struct fastq_record *r2 = b->c2 ? &b->c2->r[i] : NULL;
+            int l_bc = barcode_tag(&b->c1->r[i], r2, &args.tag);
+            fastq_format(&args.out_buf, &b->c1->r[i], "\tBC:Z:", args.tag.s, l_bc);
+            if ( r2 )
+                fastq_format(&args.out_buf, r2, "\tBC:Z:", args.tag.s, l_bc);
+            continue;
+        }
+        else if ( args.buckets ) {
+            int j = b->idx[i];
+            fastq_format(bucket_writer_buffer(args.buckets, args.bucket1[j]), &b->c1->r[i], NULL, NULL, 0);
+            if ( b->c2 )
+                fastq_format(bucket_writer_buffer(args.buckets, args.bucket2[j]), &b->c2->r[i], NULL, NULL, 0);
+            continue;
+        }
+        else {
+            fp1 = args.barcode.names[b->idx[i]].fp1;
+            fp2 = args.barcode.names[b->idx[i]].fp2;
+        }
+        if ( fastq_write(fp1, &b->c1->r[i], NULL, NULL, 0) )
+            error("Write error : %d", fp1->errcode);
+        if ( fp2 && fastq_write(fp2, &b->c2->r[i], NULL, NULL, 0) )
+            error("Write error : %d", fp2->errcode);
+    }
+    if ( args.buckets && bucket_writer_flush(args.buckets) )
+        error("Failed to write sample files.");
+    if ( args.stdout_flag && fastq_flush(args.out, &args.out_buf, 0) )
+        error("Write error : %d", args.out->errcode);
+}
+
+static void *split_pipeline(void *shared, int step, void *_data)
+{
+    if ( step == 0 ) {
+        return bundle_read();
+    }
+    else if ( step == 1 ) {
+        struct bundle *b = (struct bundle*)_data;
+        kt_for(args.threads, match_barcode, b, b->c1->n);
+        return b;
+    }
+    else if ( step == 2 ) {
+        struct bundle *b = (struct bundle*)_data;
+        bundle_write(b);
+        bundle_destroy(b);
+    }
+    return 0;
+}
+
+static BGZF *open_output(const char *fn)
+{
+    BGZF *fp = bgzf_open(fn, "w");
+    if ( fp == NULL )
+        error("%s : %s.", fn, strerror(errno));
+    if ( args.pool && bgzf_thread_pool(fp, args.pool, 0) != 0 )
+        error("Failed to set up threads for %s.", fn);
+    return fp;
+}
+
+static void open_ubam_outputs()
+{
+    int i;
+    kstring_t temp = { 0, 0, 0};
+    args.ubam = (struct ubam**)malloc(args.barcode.n*sizeof(struct ubam*));
+    for ( i = 0; i < args.barcode.n; ++i ) {
+        struct name *name = &args.barcode.names[i];
+        temp.l = 0;
+        if ( args.output_dir )
+            ksprintf(&temp, "%s/%s.bam", args.output_dir, name->name);
+        else
+            ksprintf(&temp, "%s.bam", name->name);
+        args.ubam[i] = ubam_open(temp.s, args.pool);
+        if ( args.ubam[i] == NULL )
+            error("%s : %s.", temp.s, strerror(errno));
+        name->fp1 = name->fp2 = NULL;
+    }
+    temp.l = 0;
+    if ( args.output_dir )
+        ksprintf(&temp, "%s/failed.bam", args.output_dir);
+    else
+        kputs("failed.bam", &temp);
+    args.failed_ubam = ubam_open(temp.s, args.pool);
+    if ( args.failed_ubam == NULL )
+        error("%s : %s.", temp.s, strerror(errno));
+    free(temp.s);
+}
+
+static void open_fastq_outputs(int file_is_fastq)
+{
+    int i;
     kstring_t temp = { 0, 0, 0};
     for ( i = 0; i < args.barcode.n; ++i ) {
         struct name *name = &args.barcode.names[i];
@@ -191,142 +558,220 @@ int split_barcode()
         else
             ksprintf(&temp,"%s_1.%s.gz",name->name, file_is_fastq ? "fq" : "fa");
 
-        name->fp1 = bgzf_open(temp.s, "w");
-        if ( name->fp1 == NULL )
-            error("%s : %s.", temp.s, strerror(errno));
+        name->fp1 = NULL;
         name->fp2 = NULL;
-        if ( seq2 ) {
+        if ( args.stdout_flag )
+            continue;
+        if ( args.buckets ) {
+            args.bucket1[i] = bucket_writer_add(args.buckets, temp.s);
+            if ( args.bucket1[i] == -1 )
+                error("%s : %s.", temp.s, strerror(errno));
+        }
+        else {
+            name->fp1 = open_output(temp.s);
+        }
+        if ( args.fp2 ) {
             temp.l = 0;
             if ( args.output_dir )
                 ksprintf(&temp,"%s/%s_2.%s.gz", args.output_dir, name->name, file_is_fastq ? "fq" : "fa");
             else
                 ksprintf(&temp,"%s_2.%s.gz",name->name, file_is_fastq ? "fq" : "fa");
-            name->fp2 = bgzf_open(temp.s, "w");
-            if ( name->fp2 == NULL )
-                error("%s : %s.", temp.s, strerror(errno));            
+            if ( args.buckets ) {
+                args.bucket2[i] = bucket_writer_add(args.buckets, temp.s);
+                if ( args.bucket2[i] == -1 )
+                    error("%s : %s.", temp.s, strerror(errno));
+            }
+            else {
+                name->fp2 = open_output(temp.s);
+            }
         }
     }
+    if ( args.stdout_flag ) {
+        args.out = fastq_stdout_open();
+        if ( args.out == NULL )
+            error("Failed to open stdout.");
+    }
     temp.l = 0;
     if ( args.output_dir )
         ksprintf(&temp, "%s/failed_1.%s.gz", args.output_dir, file_is_fastq ? "fq" : "fa");
     else
         ksprintf(&temp,"failed_1.%s.gz", file_is_fastq ? "fq" : "fa");
 
-    args.failed_1 = bgzf_open(temp.s, "w");
+    args.failed_1 = open_output(temp.s);
     args.failed_2 = NULL;
-    if ( args.failed_1 == NULL )
-        error("%s : %s.", temp.s, strerror(errno));
 
-    if ( seq2 ) {
+    if ( args.fp2 ) {
         temp.l = 0;
         if ( args.output_dir )
             ksprintf(&temp, "%s/failed_2.%s.gz", args.output_dir, file_is_fastq ? "fq" : "fa");
         else
             ksprintf(&temp,"failed_2.%s.gz", file_is_fastq ? "fq" : "fa");
 
-        args.failed_2 = bgzf_open(temp.s, "w");
-        if ( args.failed_2 == NULL )
-            error("%s : %s.", temp.s, strerror(errno));
+        args.failed_2 = open_output(temp.s);
     }
     free(temp.s);
+}
 
-    // check barcodes
-    int read_flag = args.barcode_region[0] == '1' ? 1 : 2;    
-    int length;
-    length = args.end - args.start+1;
-    assert(length > 0 );
-    // SE
-    if ( seq2 == NULL ) {        
-        if ( read_flag == 2 )
-            error("Inconsistant region specified. %s", args.barcode_region);
-        kstring_t string = {0, 0, 0};
-        while ( (l1 = kseq_read(seq1)) >= 0 ) {
-            string.l = 0;
-            if (seq1->qual.l) {
-                ksprintf(&string, "@%s\n%s\n+\n%s\n", seq1->name.s, seq1->seq.s, seq1->qual.s);
-            } else {
-                ksprintf(&string, ">%s\n%s\n", seq1->name.s, seq1->seq.s);
-            }
-            for ( i = 0; i < args.barcode.n; ++i ) {
-                struct name *name = &args.barcode.names[i];
-                int mismatch = check_match(seq1->seq.s+args.start-1, name->barcode, args.mismatch, length);
-                if ( mismatch == -1 )
-                    continue;
-                if ( bgzf_write(name->fp1, string.s, string.l) != string.l)
-                    error("Write error : %d", name->fp1->errcode);
-                break;
-            }
-            if ( i == args.barcode.n)
-                if ( bgzf_write(args.failed_1, string.s, string.l) != string.l)
-                    error("Write error : %d", args.failed_1->errcode);            
+// the first sample with the index matched, or "." if none. i is 0 for the first index, 1 for the second
+static const char *index_sample(const char *seq, int l, int i)
+{
+    int j, offset = i == 0 ? 0 : args.barcode.l_index1;
+    for ( j = 0; j < args.barcode.n; ++j )
+        if ( check_match((char*)seq, args.barcode.names[j].barcode + offset, i == 0 ? args.mismatch : args.mismatch2, l) != -1 )
+            return args.barcode.names[j].name;
+    return ".";
+}
+
+struct unassigned_entry {
+    const char *barcode;
+    long count;
+};
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const struct unassigned_entry *x = (const struct unassigned_entry*)a;
+    const struct unassigned_entry *y = (const struct unassigned_entry*)b;
+    if ( x->count != y->count )
+        return x->count < y->count ? 1 : -1;
+    return strcmp(x->barcode, y->barcode);
+}
+
+// Barcodes of failed reads, the most frequent first. For dual indexes the samples of
+// each index tell index hopping from unknown barcodes.
+static void write_unassigned_report()
+{
+    FILE *fp = fopen(args.unassigned_file, "w");
+    if ( fp == NULL )
+        error("%s : %s.", args.unassigned_file, strerror(errno));
+
+    int i, n = 0, l1 = args.end - args.start + 1, l2 = args.end2 - args.start2 + 1;
+    struct unassigned_entry *a = (struct unassigned_entry*)malloc(kh_size(args.unassigned)*sizeof(struct unassigned_entry));
+    khiter_t k;
+    for ( k = kh_begin(args.unassigned); k != kh_end(args.unassigned); ++k ) {
+        if ( !kh_exist(args.unassigned, k) )
+            continue;
+        a[n].barcode = kh_key(args.unassigned, k);
+        a[n].count = kh_val(args.unassigned, k);
+        n++;
+    }
+    qsort(a, n, sizeof(struct unassigned_entry), entry_cmp);
+
+    // counts are of read pairs for paired reads
+    fprintf(fp, "#total\t%ld\n#assigned\t%ld\n#unassigned\t%ld\n#distinct\t%d\n#uncounted\t%ld\n",
+            args.n_reads, args.n_reads - args.n_failed, args.n_failed, n, args.n_other);
+    fprintf(fp, "#barcode\tcount\tfraction%s\n", args.read_flag2 ? "\tindex1_sample\tindex2_sample" : "");
+    for ( i = 0; i < n && i < UNASSIGNED_TOP; ++i ) {
+        fprintf(fp, "%s\t%ld\t%.4f", a[i].barcode, a[i].count, (double)a[i].count/args.n_failed);
+        // barcodes of short reads are not reported by sample
+        if ( args.read_flag2 ) {
+            const char *s = a[i].barcode;
+            if ( strlen(s) == l1 + 1 + l2 )
+                fprintf(fp, "\t%s\t%s", index_sample(s, l1, 0), index_sample(s + l1 + 1, l2, 1));
+            else
+                fputs("\t.\t.", fp);
         }
-        if ( string.l )
-            free(string.s);
-        
-    } else { // PE
-        kstring_t string1 = {0, 0, 0};
-        kstring_t string2 = {0, 0, 0};
-        do {
-            l1 = kseq_read(seq1);
-            l2 = kseq_read(seq2);
-            if ( l1 < 0 || l2 < 0 )
-                break;
-            // check the read name
-            for ( i = 0; i < seq1->name.l-1; ++i )
-                if ( seq1->name.s[i] != seq2->name.s[i])
-                    error("Inconsistant read name. %s vs %s.", seq1->name.s, seq2->name.s);
-            
-            string1.l = 0;
-            string2.l = 0;
-            
-            if ( file_is_fastq ) {
-                ksprintf(&string1, "@%s\n%s\n+\n%s\n", seq1->name.s, seq1->seq.s, seq1->qual.s);
-                ksprintf(&string2, "@%s\n%s\n+\n%s\n", seq2->name.s, seq2->seq.s, seq2->qual.s);
-            } else {
-                ksprintf(&string1, ">%s\n%s\n", seq1->name.s, seq1->seq.s);
-                ksprintf(&string2, ">%s\n%s\n", seq2->name.s, seq2->seq.s);
-            }
-            
-            for ( i = 0; i < args.barcode.n; ++i ) {
-                struct name *name = &args.barcode.names[i];
-                int mis;
-                if ( read_flag == 1 )
-                    mis = check_match(seq1->seq.s+args.start-1, name->barcode, args.mismatch, length);
-                else
-                    mis = check_match(seq2->seq.s+args.start-1, name->barcode, args.mismatch, length);
-                if ( mis == -1 )
-                    continue;
-                if ( bgzf_write(name->fp1, string1.s, string1.l) != string1.l)
-                    error("Write error : %d", name->fp1->errcode);
-                if ( bgzf_write(name->fp2, string2.s, string2.l) != string2.l)
-                    error("Write error : %d", name->fp2->errcode);
-                break;
-            }
-            if ( i == args.barcode.n) {
-                if ( bgzf_write(args.failed_1, string1.s, string1.l) != string1.l)
-                    error("Write error : %d", args.failed_1->errcode);            
-                if ( bgzf_write(args.failed_2, string2.s, string2.l) != string2.l)
-                    error("Write error : %d", args.failed_2->errcode);                            
-            }
+        fputc('\n', fp);
+    }
+    fclose(fp);
+    free(a);
+    for ( k = kh_begin(args.unassigned); k != kh_end(args.unassigned); ++k )
+        if ( kh_exist(args.unassigned, k) )
+            free((char*)kh_key(args.unassigned, k));
+    kh_destroy(count, args.unassigned);
+}
 
-        } while (1);
-        if ( l1 != l2  )
-            error("Inconsistant read records. %d vs %d",l1, l2);
+int split_barcode()
+{
+    int i;
+    int file_is_fastq;
+
+    // check file type
+    file_is_fastq = check_file_is_fastq(args.read1_file);
+    if ( file_is_fastq == -1 )
+        error("%s is empty.", args.read1_file);
+    file_is_fastq = file_is_fastq == 0;
+
+    // check read 2
+    if ( args.read2_file != NULL ) {
+        int ret = check_file_is_fastq(args.read2_file);
+        if ( ret == -1 )
+            error("%s is empty.", args.read2_file);
+        if ( file_is_fastq != (ret == 0) )
+            error("Inconsistant read type, read1 and read2 must be in same format.");
     }
 
-    for ( i = 0; i < args.barcode.n; ++i ) {
-        struct name *name = &args.barcode.names[i];
-        free(name->name);
-        free(name->barcode);
-        bgzf_close(name->fp1);
-        if ( name->fp2 )
-            bgzf_close(name->fp2);
+    // threads are shared by the input and all the output files
+    if ( args.threads > 1 ) {
+        args.pool = hts_tpool_init(args.threads);
+        if ( args.pool == NULL )
+            error("Failed to init thread pool.");
     }
-    bgzf_close(args.failed_1);    
+
+    args.fp1 = fastq_reader_open(args.read1_file, args.pool);
+    if ( args.fp1 == NULL )
+        error("%s : %s", args.read1_file, strerror(errno));
+    if ( args.read2_file != NULL ) {
+        args.fp2 = fastq_reader_open(args.read2_file, args.pool);
+        if ( args.fp2 == NULL )
+            error("%s : %s", args.read2_file, strerror(errno));
+    }
+
+    if ( args.mem_limit ) {
+        args.buckets = bucket_writer_init(args.mem_limit, args.max_open, args.threads);
+        args.bucket1 = (int*)malloc(args.barcode.n*sizeof(int));
+        args.bucket2 = (int*)malloc(args.barcode.n*sizeof(int));
+    }
+
+    // open file handlers
+    if ( args.ubam_flag )
+        open_ubam_outputs();
+    else
+        open_fastq_outputs(file_is_fastq);
+
+    // check barcodes
+    if ( args.fp2 == NULL && args.read_flag == 2 )
+        error("Inconsistant region specified. %s", args.barcode_region);
+    if ( args.fp2 == NULL && args.read_flag2 == 2 )
+        error("Inconsistant region specified. %s", args.barcode_region2);
+    if ( args.unassigned_file )
+        args.unassigned = kh_init(count);
+
+    // read -> match -> write, the matching step runs in parallel
+    kt_pipeline(args.threads > 1 ? 2 : 1, split_pipeline, &args, 3);
+
+    fastq_reader_close(args.fp1);
+    fastq_reader_close(args.fp2);
+
+    if ( args.ubam_flag ) {
+        for ( i = 0; i < args.barcode.n; ++i )
+            if ( ubam_close(args.ubam[i]) )
+                error("Failed to close BAM files.");
+        if ( ubam_close(args.failed_ubam) )
+            error("Failed to close BAM files.");
+        free(args.ubam);
+    }
+    if ( args.buckets ) {
+        if ( bucket_writer_close(args.buckets) )
+            error("Failed to write sample files.");
+        free(args.bucket1);
+        free(args.bucket2);
+    }
+    if ( args.out ) {
+        if ( fastq_flush(args.out, &args.out_buf, 1) )
+            error("Write error : %d", args.out->errcode);
+        bgzf_close(args.out);
+        free(args.out_buf.s);
+    }
+    if ( args.unassigned )
+        write_unassigned_report();
+    free(args.tag.s);
+    clean_barcode_struct(&args.barcode);
+    if ( args.failed_1 )
+        bgzf_close(args.failed_1);
     if ( args.failed_2)
         bgzf_close(args.failed_2);
-    
-    free(args.barcode.names);
+    if ( args.pool )
+        hts_tpool_destroy(args.pool);
 
     return 0;
 }
@@ -1,14 +1,15 @@
 #include "utils.h"
 #include "htslib/kstring.h"
-#include "htslib/kseq.h"
 #include "htslib/bgzf.h"
 #include "sequence.h"
+#include "fastq.h"
+#include "ubam.h"
 #include "number.h"
-#include <zlib.h>
+#include "kthread.h"
+#include "htslib/thread_pool.h"
 #include <string.h>
 #include "pkg_version.h"
 
-KSEQ_INIT(gzFile, gzread)
 struct pair {
     int id;
     int start;
@@ -21,10 +22,22 @@ struct args {
     const char *umi_reg;
     const char *output1_fname;
     const char *output2_fname;
+    const char *ubam_fname;
     kstring_t str1;
     kstring_t str2;
     struct pair trim;
     struct pair umi;
+    int threads;
+    int chunk_size;
+    struct fastq_reader *fp1;
+    struct fastq_reader *fp2;
+    BGZF *out1;
+    BGZF *out2;
+    struct ubam *ubam;
+    // interleaved FASTQ to stdout, records are collected and written in blocks
+    int stdout_flag;
+    kstring_t out_buf;
+    hts_tpool *pool;
 } args = {
     .input1_fname = NULL,
     .input2_fname = NULL,
@@ -32,10 +45,21 @@ struct args {
     .umi_reg = NULL,
     .output1_fname = NULL,
     .output2_fname = NULL,
+    .ubam_fname = NULL,
     .str1 = {0, 0, 0},
     .str2 = {0, 0, 0},
     .trim = {0, 0, 0},
     .umi = {0, 0, 0},
+    .threads = 1,
+    .chunk_size = 10000000,
+    .fp1 = NULL,
+    .fp2 = NULL,
+    .out1 = NULL,
+    .out2 = NULL,
+    .ubam = NULL,
+    .stdout_flag = 0,
+    .out_buf = {0, 0, 0},
+    .pool = NULL,
 };
 
 int usage()
@@ -46,9 +70,12 @@ int usage()
             "UMI_parser -umi 2:101-113 read1.fq.gz [read2.fq.gz]\n"
             "   -umi   2:101-106           // UMI barcode region in read sequence, format is [1|2]:start-end\n"
             //"   -trim  1:1-6               // primer region, this region will be trimmed\n"
-            "   -t     INT                 // number of threads\n"
+            "   -t     INT                 // number of threads, records are rewritten in parallel batches [1]\n"
             "   -out1  FILE                // output file for read1\n"
             "   -out2  FILE                // output file for read2\n"
+            "   -ubam  FILE                // export unaligned BAM with UMI in RX tag instead of FASTQ files\n"
+            "   -qbin  STR                 // bin qualities, illumina8, bin4 or custom bins like 0-9:6,10-29:20,30-93:37\n"
+            "   -stdout                    // write uncompressed interleaved FASTQ to stdout, for piping to aligners\n"
             "Version : %s\n"
             "Homepage : https://github.com/shiquan/small_projects\n",
             PROJECTS_VERSION
@@ -88,6 +115,7 @@ int parse_args(int ac, char **av)
     
     int i;
     const char *threads = NULL;
+    const char *qual_bins = NULL;
     for ( i = 1; i < ac; ) {
         const char *a = av[i++];
         const char **var = 0;
@@ -98,12 +126,16 @@ int parse_args(int ac, char **av)
             var = &args.umi_reg;
         else if ( strcmp(a, "-trim") == 0 && args.trim_reg == NULL )
             var = &args.trim_reg;
-        else if ( strcmp(a, "-t") == 0 )
+        else if ( strcmp(a, "-t") == 0 && threads == NULL )
             var = &threads;
         else if ( strcmp(a, "-out1") == 0 && args.output1_fname == NULL )
             var = &args.output1_fname;
         else if ( strcmp(a, "-out2") == 0 && args.output2_fname == NULL )
             var = &args.output2_fname;
+        else if ( strcmp(a, "-ubam") == 0 && args.ubam_fname == NULL )
+            var = &args.ubam_fname;
+        else if ( strcmp(a, "-qbin") == 0 && qual_bins == NULL )
+            var = &qual_bins;
 
         if ( var != 0 ) {
             if ( i == ac ) {
@@ -113,6 +145,10 @@ int parse_args(int ac, char **av)
             *var = av[i++];
             continue;
         }
+        if ( strcmp(a, "-stdout") == 0 ) {
+            args.stdout_flag = 1;
+            continue;
+        }
 
         if ( args.input1_fname == NULL )
             args.input1_fname = a;
@@ -128,16 +164,35 @@ int parse_args(int ac, char **av)
     if ( args.umi_reg == NULL )
         error("No UMI region specified.");
 
-    if ( args.output1_fname == NULL ) {
+    if ( args.ubam_fname && (args.output1_fname || args.output2_fname) )
+        error("-ubam conflicts with -out1 and -out2.");
+
+    if ( args.stdout_flag && (args.ubam_fname || args.output1_fname || args.output2_fname) )
+        error("-stdout conflicts with -ubam, -out1 and -out2.");
+
+    if ( args.output1_fname == NULL && args.ubam_fname == NULL && args.stdout_flag == 0 ) {
         ksprintf(&args.str1, "UMI_%s", args.input1_fname);
         args.output1_fname = (const char*)args.str1.s;
     }
 
-    if ( args.output2_fname == NULL && args.input2_fname != NULL ) {
+    if ( args.output2_fname == NULL && args.input2_fname != NULL && args.ubam_fname == NULL && args.stdout_flag == 0 ) {
         ksprintf(&args.str2, "UMI_%s", args.input2_fname);
         args.output2_fname = (const char*)args.str2.s;
     }
 
+    if ( threads ) {
+        args.threads = str2int((char*)threads);
+        if ( args.threads < 1 )
+            args.threads = 1;
+    }
+
+    if ( qual_bins ) {
+        uint8_t table[QUAL_BINS_SIZE];
+        if ( fastq_qual_bins_parse(qual_bins, table) )
+            error("Unknown quality bins, %s.", qual_bins);
+        fastq_set_qual_bins(table);
+    }
+
     if ( args.trim_reg && parse_reg(args.trim_reg, strlen(args.trim_reg), &args.trim) == 1 )
         return 1;
     if ( args.umi_reg && parse_reg(args.umi_reg, strlen(args.umi_reg), &args.umi) == 1)
@@ -146,174 +201,227 @@ int parse_args(int ac, char **av)
     return 0;
 }
 
-int parse_UMI()
+// a chunk of reads processed together in the pipeline
+struct bundle {
+    struct fastq_chunk *c1;
+    struct fastq_chunk *c2;
+    char **tag; // UMI of each record, points to the read sequence
+    int *l_tag;
+};
+
+static void bundle_destroy(struct bundle *b)
+{
+    fastq_chunk_destroy(b->c1);
+    fastq_chunk_destroy(b->c2);
+    free(b->tag);
+    free(b->l_tag);
+    free(b);
+}
+
+// read a chunk of records, return NULL at the end of file
+static struct bundle *bundle_read()
+{
+    struct bundle *b = (struct bundle*)calloc(1, sizeof(struct bundle));
+    int i, n;
+    b->c1 = fastq_chunk_init();
+    if ( args.fp2 ) {
+        b->c2 = fastq_chunk_init();
+        n = fastq_read_chunk2(args.fp1, args.fp2, b->c1, b->c2, args.chunk_size);
+    }
+    else {
+        n = fastq_read_chunk(args.fp1, b->c1, args.chunk_size);
+        for ( i = 0; i < n; ++i )
+            if ( b->c1->r[i].qual == NULL )
+                error("Only support FASTQ for now.");
+    }
+    if ( n < 0 )
+        error("Failed to read sequences.");
+    if ( n == 0 ) {
+        bundle_destroy(b);
+        return NULL;
+    }
+    b->tag = (char**)malloc(n*sizeof(char*));
+    b->l_tag = (int*)malloc(n*sizeof(int));
+    return b;
+}
+
+// the UMI sequence, return the length
+static int umi_tag(struct fastq_record *r, char **tag)
+{
+    int length = args.umi.end - args.umi.start +1;
+    if ( args.umi.start - 1 >= r->l_seq ) {
+        *tag = r->seq + r->l_seq;
+        return 0;
+    }
+    *tag = r->seq + args.umi.start - 1;
+    return length < r->l_seq - args.umi.start + 1 ? length : r->l_seq - args.umi.start + 1;
+}
+
+// cut the UMI region, the region is at the start of read or the rest of read is kept
+static void umi_trim(struct fastq_record *r)
+{
+    if ( args.umi.start == 1 ) {
+        int l = args.umi.end < r->l_seq ? args.umi.end : r->l_seq;
+        r->seq += l;
+        r->qual += l;
+        r->l_seq -= l;
+    } else if ( args.umi.start - 1 < r->l_seq ) {
+        r->l_seq = args.umi.start - 1;
+    }
+}
+
+// rewrite the views of record i in place, the UMI is kept in the bundle
+static void parse_record(void *_b, long i, int tid)
+{
+    struct bundle *b = (struct bundle*)_b;
+    struct fastq_record *r = &b->c1->r[i];
+    fastq_strip_read_number(r, '1');
+    if ( b->c2 ) {
+        fastq_strip_read_number(&b->c2->r[i], '2');
+        if ( args.umi.id == 2 )
+            r = &b->c2->r[i];
+    }
+    b->l_tag[i] = umi_tag(r, &b->tag[i]);
+    umi_trim(r);
+}
+
+static void write_record(BGZF *fp, const struct fastq_record *r, const char *prefix, const char *tag, int l)
+{
+    if ( args.stdout_flag )
+        fastq_format(&args.out_buf, r, prefix, tag, l);
+    else if ( fastq_write(fp, r, prefix, tag, l) )
+        error("Write error : %d", fp->errcode);
+}
+
+static void parse_UMI_se(struct fastq_record *r1, const char *tag, int l)
+{
+    if ( args.ubam ) {
+        if ( ubam_write(args.ubam, r1, 0, tag, l, NULL, 0) )
+            error("Failed to write %s.", args.ubam_fname);
+        return;
+    }
+    write_record(args.out1, r1, NULL, tag, l);
+}
+
+static void parse_UMI_pe(struct fastq_record *r1, struct fastq_record *r2, const char *tag, int l)
+{
+    if ( args.ubam ) {
+        if ( ubam_write(args.ubam, r1, 1, tag, l, NULL, 0) || ubam_write(args.ubam, r2, 2, tag, l, NULL, 0) )
+            error("Failed to write %s.", args.ubam_fname);
+        return;
+    }
+
+    // aligners pair the interleaved reads by name, so both of them are renamed
+    write_record(args.out1, r1, "_UID:", tag, l);
+    write_record(args.out2, r2, args.umi.id == 2 || args.stdout_flag ? "_UID:" : NULL, tag, l);
+}
+
+static void bundle_write(struct bundle *b)
 {
-    // check UMI regions
-    gzFile fp1, fp2;
-    kseq_t *seq1 = NULL;
-    kseq_t *seq2 = NULL;
-    int l1, l2;
     int i;
-    BGZF *out1 = NULL;
-    BGZF *out2 = NULL;
-    
-    fp1 = gzopen(args.input1_fname, "r");
-    if ( fp1 == NULL )
+    for ( i = 0; i < b->c1->n; ++i ) {
+        if ( b->c2 )
+            parse_UMI_pe(&b->c1->r[i], &b->c2->r[i], b->tag[i], b->l_tag[i]);
+        else
+            parse_UMI_se(&b->c1->r[i], b->tag[i], b->l_tag[i]);
+    }
+    if ( args.stdout_flag && fastq_flush(args.out1, &args.out_buf, 0) )
+        error("Write error : %d", args.out1->errcode);
+}
+
+// records are read, rewritten in parallel and written in order
+static void *umi_pipeline(void *shared, int step, void *_data)
+{
+    if ( step == 0 ) {
+        return bundle_read();
+    }
+    else if ( step == 1 ) {
+        struct bundle *b = (struct bundle*)_data;
+        kt_for(args.threads, parse_record, b, b->c1->n);
+        return b;
+    }
+    else if ( step == 2 ) {
+        struct bundle *b = (struct bundle*)_data;
+        bundle_write(b);
+        bundle_destroy(b);
+    }
+    return 0;
+}
+
+static BGZF *open_output(const char *fn)
+{
+    BGZF *fp = bgzf_open(fn, "w");
+    if ( fp == NULL )
+        error("%s : %s.", fn, strerror(errno));
+    if ( args.pool && bgzf_thread_pool(fp, args.pool, 0) != 0 )
+        error("Failed to set up threads for %s.", fn);
+    return fp;
+}
+
+int parse_UMI()
+{
+    // threads are shared by the input and output files
+    if ( args.threads > 1 ) {
+        args.pool = hts_tpool_init(args.threads);
+        if ( args.pool == NULL )
+            error("Failed to init thread pool.");
+    }
+
+    args.fp1 = fastq_reader_open(args.input1_fname, args.pool);
+    if ( args.fp1 == NULL )
         error("%s : %s.", args.input1_fname, strerror(errno));
-    out1 = bgzf_open(args.output1_fname, "w");
-    if ( out1 == NULL )
-        error("%s : %s.", args.output1_fname, strerror(errno));
-    
-    seq1 = kseq_init(fp1);
 
     if ( args.input2_fname != NULL ) {
-        fp2 = gzopen(args.input2_fname, "r");
-        if (fp2 == NULL )
+        args.fp2 = fastq_reader_open(args.input2_fname, args.pool);
+        if ( args.fp2 == NULL )
             error("%s : %s.", args.input2_fname, strerror(errno));
-        seq2 = kseq_init(fp2);
-        out2 = bgzf_open(args.output2_fname, "w");
-        if ( out2 == NULL )
-            error("%s : %s.", args.output2_fname, strerror(errno));
     }
 
-    int length = args.umi.end - args.umi.start +1;
-    
-    if ( seq2 == NULL ) {
+    // check UMI regions
+    if ( args.fp2 == NULL ) {
         if ( args.umi.id == 2)
             error("Inconsistant UMI region. %s", args.umi_reg);
         
         if ( args.trim.id == 2 )
             error("Inconsistant trim region. %s", args.trim_reg);
-        
-        kstring_t string = {0, 0, 0};
-        
-        while ( (l1 = kseq_read(seq1)) >= 0 ) {
-            string.l = 0;
-            if ( seq1->qual.l == 0)
-                error("Only support FASTQ for now.");
-            
-            kputc('@', &string);
-            kputs(seq1->name.s, &string);
-            if ( string.s[string.l-2] == '/' && string.s[string.l-1] == '1')
-                string.l -= 2;
-            kputsn(seq1->seq.s+args.umi.start-1, length, &string);
-            kputc('\n', &string);
-            if ( args.umi.start == 1 ) 
-                kputs(seq1->seq.s+args.umi.end, &string);
-            else
-                kputsn(seq1->seq.s, args.umi.start-1, &string);
-            kputs("\n+\n", &string);
-            if ( args.umi.start == 1 ) 
-                kputs(seq1->qual.s+args.umi.end, &string);
-            else
-                kputsn(seq1->qual.s, args.umi.start-1, &string);
-            kputc('\n', &string);            
-        
-            if ( bgzf_write(out1, string.s, string.l) != string.l )
-                error("Write error : %d", out1->errcode);
-        }
+    }
 
-        if ( string.m )
-            free(string.s);
-        bgzf_close(out1);
-        kseq_destroy(seq1);
-        
-    } else {
-        kstring_t str1 = { 0, 0, 0};
-        kstring_t str2 = { 0, 0, 0};
-        
-        do {
-            l1 = kseq_read(seq1);
-            l2 = kseq_read(seq2);
-            if ( l1 < 0 || l2 < 0 )
-                break;
-            
-            for ( i = 0; i < seq1->name.l-1; ++i )
-                if ( seq1->name.s[i] != seq2->name.s[i])
-                    error("Inconsistant read name. %s vs %s.", seq1->name.s, seq2->name.s);
-            
-            str1.l = 0;
-            str2.l = 0;
-
-            if ( args.umi.id == 1 ) {
-                kputc('@', &str1);
-                kputs(seq1->name.s, &str1);
-                if ( str1.s[str1.l-2] == '/' && str1.s[str1.l-1] == '1')
-                    str1.l -= 2;
-                kputs("_UID:",&str1);
-                kputsn(seq1->seq.s+args.umi.start-1, length, &str1);
-                kputc('\n', &str1);
-                if ( args.umi.start == 1 ) 
-                    kputs(seq1->seq.s+args.umi.end, &str1);
-                else
-                    kputsn(seq1->seq.s, args.umi.start-1, &str1);
-                kputs("\n+\n", &str1);
-                if ( args.umi.start == 1 ) 
-                    kputs(seq1->qual.s+args.umi.end, &str1);
-                else
-                    kputsn(seq1->qual.s, args.umi.start-1, &str1);
-                kputc('\n', &str1);            
-
-                kputc('@', &str2);
-                kputs(seq2->name.s, &str2);
-                if ( str2.s[str2.l-2] == '/' && str2.s[str2.l-1] == '2')
-                    str2.l -= 2;
-                kputsn(seq1->seq.s+args.umi.start-1, length, &str2);
-                kputc('\n', &str2);
-                ksprintf(&str2, "%s\n+\n%s\n", seq2->seq.s, seq2->qual.s);
-                
-            } else {
-                kputc('@', &str1);
-                kputs(seq1->name.s, &str1);
-                if ( str1.s[str1.l-2] == '/' && str1.s[str1.l-1] == '1')
-                    str1.l -= 2;
-                kputs("_UID:",&str1);
-                kputsn(seq2->seq.s+args.umi.start-1, length, &str1);
-                kputc('\n', &str1);
-                ksprintf(&str1, "%s\n+\n%s\n", seq1->seq.s, seq1->qual.s);
-
-                kputc('@', &str2);
-                kputs(seq2->name.s, &str2);
-                if ( str2.s[str2.l-2] == '/' && str2.s[str2.l-1] == '2')
-                    str2.l -= 2;
-                kputs("_UID:",&str2);
-                kputsn(seq2->seq.s+args.umi.start-1, length, &str2);
-                kputc('\n', &str2);
-                if ( args.umi.start == 1 ) 
-                    kputs(seq2->seq.s+args.umi.end, &str2);
-                else
-                    kputsn(seq2->seq.s, args.umi.start-1, &str2);
-                kputs("\n+\n", &str2);
-                if ( args.umi.start == 1 ) 
-                    kputs(seq2->qual.s+args.umi.end, &str2);
-                else
-                    kputsn(seq2->qual.s, args.umi.start-1, &str2);
-                kputc('\n', &str2);
-            }
-            if ( bgzf_write(out1, str1.s, str1.l) != str1.l )
-                error("Write error : %d", out1->errcode);
+    if ( args.ubam_fname ) {
+        args.ubam = ubam_open(args.ubam_fname, args.pool);
+        if ( args.ubam == NULL )
+            error("%s : %s.", args.ubam_fname, strerror(errno));
+    }
+    else if ( args.stdout_flag ) {
+        args.out1 = fastq_stdout_open();
+        if ( args.out1 == NULL )
+            error("Failed to open stdout.");
+    }
+    else {
+        args.out1 = open_output(args.output1_fname);
+        if ( args.fp2 )
+            args.out2 = open_output(args.output2_fname);
+    }
 
-            if ( bgzf_write(out2, str2.s, str2.l) != str2.l )
-                error("Write error : %d", out2->errcode);
+    kt_pipeline(args.threads > 1 ? 2 : 1, umi_pipeline, &args, 3);
 
-        } while(1);
-        
-        if ( str1.m )
-            free(str1.s);
-        if ( str2.m)
-            free(str2.s);
-        bgzf_close(out1);
-        bgzf_close(out2);
-        kseq_destroy(seq1);
-        kseq_destroy(seq2);
-        if (l1 != l2)
-            error("Inconsistant read counts. %s vs %s.", args.input1_fname, args.input2_fname);
-    }
+    if ( args.ubam && ubam_close(args.ubam) )
+        error("Failed to close %s.", args.ubam_fname);
+    if ( args.stdout_flag && fastq_flush(args.out1, &args.out_buf, 1) )
+        error("Write error : %d", args.out1->errcode);
+    if ( args.out1 )
+        bgzf_close(args.out1);
+    if ( args.out2 )
+        bgzf_close(args.out2);
+    fastq_reader_close(args.fp1);
+    fastq_reader_close(args.fp2);
+    if ( args.pool )
+        hts_tpool_destroy(args.pool);
 
     if ( args.str1.m)
         free(args.str1.s);
     if ( args.str2.m)
         free(args.str2.s);
+    free(args.out_buf.s);
 
     return 0;
 }
@@ -0,0 +1,46 @@
+#!/bin/sh
+# dyncut_adaptor -adaptor auto in barcode split mode. Read 1 is the insert, the adaptor and
+# the barcode, so the detected adaptor should stop before the barcode and assign as many
+# reads as the adaptor given explicitly.
+# Usage: test/adaptor_auto.sh [bin directory]
+BIN=${1:-bin}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+ADAPTOR=AGATCGGAAGAGCACACGTC
+
+printf "s1\tACGTACGT\ns2\tTGCATGCA\ns3\tGATCCTAG\ns4\tCTAGGATC\n" > $DIR/bc.txt
+awk -v ada=$ADAPTOR -v out=$DIR 'function rand_seq(l,   s, i) {
+    s = ""
+    for ( i = 0; i < l; ++i ) s = s substr("ACGT", int(rand()*4)+1, 1)
+    return s
+}
+function qual(l,   s, i) {
+    s = ""
+    for ( i = 0; i < l; ++i ) s = s "I"
+    return s
+}
+BEGIN {
+    srand(1)
+    split("ACGTACGT TGCATGCA GATCCTAG CTAGGATC", bc, " ")
+    q = qual(100)
+    for ( n = 0; n < 5000; ++n ) {
+        s = rand_seq(30 + int(rand()*40)) ada bc[n%4+1]
+        s = s rand_seq(100 - length(s))
+        printf "@r%d/1\n%s\n+\n%s\n", n, s, q > out "/r_1.fq"
+        printf "@r%d/2\n%s\n+\n%s\n", n, rand_seq(100), q > out "/r_2.fq"
+    }
+}'
+gzip $DIR/r_1.fq $DIR/r_2.fq
+
+# reads assigned to the samples with the adaptor $2
+assigned() {
+    mkdir -p $DIR/$1
+    $BIN/dyncut_adaptor -adaptor $2 -detect 1000 -barcode $DIR/bc.txt -uid -out $DIR/$1 \
+        $DIR/r_1.fq.gz $DIR/r_2.fq.gz 2>/dev/null || exit 1
+    cat $DIR/$1/s?_1.fq.gz | gzip -dc | awk 'END { print NR/4 }'
+}
+n_explicit=$(assigned explicit $ADAPTOR)
+n_auto=$(assigned auto auto)
+
+echo "explicit adaptor assigns $n_explicit reads, auto assigns $n_auto reads"
+[ "$n_explicit" -gt 0 ] && [ "$n_auto" -eq "$n_explicit" ]
@@ -0,0 +1,25 @@
+#!/bin/sh
+# -qbin illumina8 on every score from Q0 to Q41. Q0 and Q1 are kept, Q2-9 are 6, Q10-19 are 15,
+# Q20-24 are 22, Q25-29 are 27, Q30-34 are 33, Q35-39 are 37 and Q40 or higher are 40.
+# Usage: test/qual_bins.sh [bin directory]
+BIN=${1:-bin}
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+
+awk -v out=$DIR 'BEGIN {
+    n = split("0 1 2 10 20 25 30 35 40", lo, " ")
+    split("0 1 6 15 22 27 33 37 40", score, " ")
+    for ( q = 0; q < 42; ++q ) {
+        for ( j = n; q < lo[j]; --j );
+        seq = seq "A"
+        qual = qual sprintf("%c", 33 + q)
+        expect = expect sprintf("%c", 33 + score[j])
+    }
+    printf "@r1\n%s\n+\n%s\n", seq, qual > out "/r.fq"
+    print expect > out "/expect.txt"
+}'
+
+# the adaptor is not in the read, so the read is written untrimmed
+$BIN/dyncut_adaptor -adaptor CCCCCCCCCCCC -qbin illumina8 -stdout $DIR/r.fq | sed -n 4p > $DIR/out.txt
+echo "illumina8 : $(cat $DIR/out.txt)"
+cmp -s $DIR/out.txt $DIR/expect.txt